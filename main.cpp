@@ -4,6 +4,15 @@
 #include <openssl/pem.h>
 #include <openssl/evp.h>
 #include <openssl/bio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <fstream>
 #include <iostream>
@@ -16,6 +25,23 @@
 #include <random>
 #include <vector>
 #include <cmath>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <thread>
+#include <ctime>
+#include <set>
+#include <list>
+#include <deque>
+#include <optional>
+#include <future>
+#include <array>
+#include <cstring>
+#include <unordered_map>
+#include <filesystem>
+#include <climits>
+#include <functional>
 
 using json  = nlohmann::json;
 using Clock = std::chrono::system_clock;
@@ -83,6 +109,24 @@ static std::string base64UrlEncode(const std::string& in) {
 	return url;
 }
 
+// Percent-encode a URL component
+static std::string urlEncode(const std::string& in) {
+	static const char* hex = "0123456789ABCDEF";
+	std::string out;
+	for (unsigned char c : in) {
+		if (std::isalnum(c) || c=='-' || c=='_' || c=='.' || c=='~') out.push_back((char)c);
+		else { out.push_back('%'); out.push_back(hex[c>>4]); out.push_back(hex[c&15]); }
+	}
+	return out;
+}
+
+// Throw on transport errors and non-2xx statuses
+static void checkHttp(const cpr::Response& r, const std::string& label) {
+	if (r.error) throw std::runtime_error(label + " HTTP failed: " + r.error.message);
+	if (r.status_code < 200 || r.status_code >= 300)
+		throw std::runtime_error(label + " HTTP " + std::to_string(r.status_code) + ": " + r.text);
+}
+
 // RSA‐SHA256 sign using PEM private key
 static std::string rsaSha256Sign(const std::string& data,
 								 const std::string& pem) {
@@ -158,594 +202,6386 @@ static std::string getAccessToken(const json& adc) {
 	return cached_token;
 }
 
-// Build prompt, call Vertex AI, parse JSON response
-static json queryGemini(const json& in,
-						const json& adc,
-						const std::string& project,
-						const std::string& location)
-{
-	// pull inputs
-	const std::string name          = in.value("name",""),
-					  kind          = in.value("type",""),
-					  handedness    = in.value("handedness",""),
-					  subtype       = in.value("subtype",""),
-					  rarity        = in.value("rarity",""),
-					  clothingPiece = in.value("clothingPiece",""),
-					  extraDesc     = in.value("description", "");
+// ————————————————————————————————————————————————
+// LLM providers: each one owns payload construction, auth, URL, transport and
+// text/usage extraction for its API, so any route can use any provider.
 
-	bool allowEnchantment = (rarity != "Common");
+struct LlmRequest {
+	std::string              prompt;
+	std::string              model;
+	int                      maxTokens   = 768;
+	double                   temperature = 1.0;
+	int                      candidates  = 1;
+	const std::atomic<bool>* cancel      = nullptr;   // aborts the transfer when set
+	Clock::time_point        deadline    = Clock::time_point::max();   // and once this passes
+};
 
-	// 1) Build prompt
-	std::ostringstream prompt;
-	prompt << "You are a Dungeons & Dragons 5E gear generator.\n"
-		   << "Produce ONLY a single JSON object (no extra text).\n";
+// Deadline of the route generation running on this thread (see withDeadline),
+// picked up by every upstream call made under it
+static thread_local Clock::time_point request_deadline = Clock::time_point::max();
 
-	if (kind == "Weapon") {
-		prompt << "I want a weapon\n";
-		if (!name.empty()) {
-			prompt << " called \"" << name << "\"";
-		}
-		prompt << " with these parameters:\n"
-			   << "  Category: " << handedness << "\n"
-			   << "  Type: "     << subtype << "\n"
-			   << "  Rarity: "   << rarity << "\n\n";
-			   if (!extraDesc.empty()) {
-				   prompt << "\nAdditional Details: " << extraDesc << "\n";
-			   }
-			   prompt << "Your JSON schema should be:\n" << R"({
-					"Name": "...",
-					"Category": "...",
-					"Type": "...",
-					"Rarity": "...",
-					"Cost": "...",
-					"DamageDice": "...",
-					"DamageType": "...",
-					"Weight": "...",
-					"Properties": ["...", "..."],
-					"Description": "..."
-				})";
-		prompt << "\nPopulate only the fields after those prefilled above.\n";
-		if (allowEnchantment) {
-			prompt << "Description: include a short history, benefits, and an enchantment in 150 words or less, "\
-					  "scale the enchantments appropriately according to rarity, only add curses to items of legendary rarity or greater, "\
-					  "most importantly: be original and imaginative. Do not rely on the term \"dying star\". "\
-				      "You are encouraged to use 1/2 lb. measurements on light items (e.g. 1/2 lb. or 1 1/2 lb.).\n";
-		} else {
-			prompt << "Description: include a short history and benefits in 150 words or less (do NOT include any enchantment). "\
-					  "Most importantly: be original and imaginative. Do not rely on the term \"dying star\". "\
-					  "You are encouraged to use 1/2 lb. measurements on light items (e.g. 1/2 lb. or 1 1/2 lb.).\n";
+struct LlmUsage {
+	int64_t promptTokens = 0;
+	int64_t outputTokens = 0;
+};
+
+struct LlmResult {
+	std::vector<std::string> texts;       // one per candidate
+	LlmUsage                 usage;
+	std::string              provider;
+	std::string              model;
+	double                   latencyMs = 0;
+};
+
+// List price in USD per 1M tokens, for spend estimates
+struct ModelPrice {
+	double in  = 0;
+	double out = 0;
+};
+
+// Rough list prices of the models the shipped routing uses and their kin;
+// a versioned name ("gpt-4.1-2025-04-14") takes its longest listed prefix
+static const std::map<std::string, ModelPrice> MODEL_PRICES = {
+	{"gemini-2.0-flash",      {0.10,  0.40}},
+	{"gemini-2.0-flash-lite", {0.075, 0.30}},
+	{"gemini-2.5-flash",      {0.30,  2.50}},
+	{"gemini-2.5-pro",        {1.25, 10.00}},
+	{"gpt-4.1",               {2.00,  8.00}},
+	{"gpt-4.1-mini",          {0.40,  1.60}},
+	{"gpt-4.1-nano",          {0.10,  0.40}},
+	{"gpt-4o",                {2.50, 10.00}},
+	{"gpt-4o-mini",           {0.15,  0.60}}
+};
+
+static std::optional<ModelPrice> listPrice(const std::string& model) {
+	const ModelPrice* best = nullptr;
+	size_t bestLen = 0;
+	for (auto& [name, price] : MODEL_PRICES)
+		if (model.compare(0, name.size(), name) == 0 && name.size() > bestLen) { best = &price; bestLen = name.size(); }
+	if (!best) return std::nullopt;
+	return *best;
+}
+
+// Upstream refused or was skipped (quota exhausted, circuit breaker open);
+// `reason` is a short machine-readable tag
+struct UpstreamUnavailable : std::runtime_error {
+	UpstreamUnavailable(const std::string& msg, std::string why)
+		: std::runtime_error(msg), reason(std::move(why)) {}
+	std::string reason;
+};
+
+// State of a provider-side batch job
+struct BatchStatus {
+	std::string state;    // "running", "succeeded" or "failed"
+	std::string detail;
+	json        raw;      // provider's job object
+};
+
+class LlmProvider {
+public:
+	virtual ~LlmProvider() = default;
+	virtual std::string name() const = 0;
+
+	// What `model` costs on this provider, nullopt when unknown
+	virtual std::optional<ModelPrice> price(const std::string& model) const { return listPrice(model); }
+
+	// Batch API: submit many requests (one model) as one job, poll it, and
+	// fetch (request index, text) pairs once it has succeeded
+	virtual std::string submitBatch(const std::string& jobName,
+									const std::vector<LlmRequest>& reqs) const {
+		(void)jobName; (void)reqs;
+		throw std::runtime_error(label() + " has no batch API");
+	}
+	virtual BatchStatus pollBatch(const std::string& remoteId) const {
+		(void)remoteId;
+		throw std::runtime_error(label() + " has no batch API");
+	}
+	virtual std::vector<std::pair<size_t, std::string>>
+	fetchBatch(const BatchStatus& st, const std::vector<LlmRequest>& reqs) const {
+		(void)st; (void)reqs;
+		throw std::runtime_error(label() + " has no batch API");
+	}
+
+	// Build, authenticate, send and parse one request; more candidates than
+	// the provider returns per call are collected over several calls
+	LlmResult generate(const LlmRequest& req) const {
+		int perCall = std::max(1, maxCandidates());
+		if (req.candidates <= perCall) return generateOnce(req);
+		auto t0 = Clock::now();
+		LlmResult out;
+		for (int left = req.candidates; left > 0; left -= perCall) {
+			LlmRequest part = req;
+			part.candidates = std::min(left, perCall);
+			LlmResult r = generateOnce(part);
+			out.texts.insert(out.texts.end(), r.texts.begin(), r.texts.end());
+			out.usage.promptTokens += r.usage.promptTokens;
+			out.usage.outputTokens += r.usage.outputTokens;
+			out.provider = r.provider;
+			out.model    = r.model;
 		}
+		out.latencyMs = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+		return out;
+	}
 
-	} else if (kind == "Armor") {
-		prompt << "I want an armor/clothing item\n";
-		if (!name.empty()) {
-			prompt << " called \"" << name << "\"";
-		}
-		prompt << " with these parameters:\n"
-			   << "  Category: "             << subtype << "\n"
-			   << "  Piece: "                << clothingPiece << "\n"
-			   << "  Armor Class: "          << (subtype == "Clothes" ? "N/A" : subtype) << "\n"
-			   << "  Attunement: "           << (subtype == "Clothes" ? "No"  : "Yes") << "\n"
-			   << "  Stealth Disadvantage: " << ((subtype == "Heavy" || subtype == "Shield") ? "Yes" : "No")
-			   << "\n\n";
-
-		prompt << "Your JSON schema should be:\n" << R"({
-			"Name": "...",
-			"Piece": "...",                  // headgear / clothes / etc.
-			"Category": "...",               // clothes/light/medium/heavy
-			"ArmorClass": "...",             // N/A or number
-			"Attunement": "...",             // Yes/No
-			"StealthDisadvantage": "...",    // Yes/No
-			"Weight": "...",                 // e.g. "1 lb." or "1 1/2 lbs."
-			"Cost": "...",                   // e.g. "15 gp"
-			"Properties": ["...", "..."],
-			"Description": "..."             // lore + benefits
-		})";
-
-		if (!clothingPiece.empty()) {
-			prompt << "  ClothingPiece: " << clothingPiece << "\n";
-		}
-		if (!extraDesc.empty()) {
-			prompt << "\nAdditional Details: " << extraDesc << "\n";
-		}
-		prompt << "\nYour JSON schema should be:\n" << R"({
-			"Name": "...",
-			"ItemType": "...",
-			"Rarity": "...",
-			"Category": "...",
-			"Cost": "...",
-			"ArmorClass": "...",
-			"Attunement": "...",
-			"Weight": "...",
-			"Properties": ["...", "..."],
-			"Description": "..."
-		})";
-		prompt << "\nPopulate fields after those prefilled above.\n";
-		if (allowEnchantment) {
-			prompt << "Description: include a short history, benefits, and an enchantment in 150 words or less, "\
-					  "scale the enchantments appropriately according to rarity, only add curses to items of legendary rarity or greater, "\
-					  "most importantly: be original and imaginative. Do not rely on the term \"dying star\". "\
-					  "You are encouraged to use 1/2 lb. measurements on light items (e.g. 1/2 lb. or 1 1/2 lb.).\n";
-		} else {
-			prompt << "Description: include a short history and benefits in 150 words or less (do NOT include any enchantment or curse). "\
-					  "Most importantly: be original and imaginative. Do not rely on the term \"dying star\". "\
-					  "You are encouraged to use 1/2 lb. measurements on light items (e.g. 1/2 lb. or 1 1/2 lb.).\n";
-		}
-	} else { 
-		prompt << "You are a Dungeons & Dragons 5E jewelry crafter.\n"
-			   << "Produce ONLY a single JSON object (no extra text).\n"
-			   << "I want a piece of jewelry with these parameters:\n"
-			   << "• Name: "    << name   << "\n"
-			   << "• Type: "    << subtype<< "\n"
-			   << "• Rarity: "  << rarity << "\n";
-					if (!extraDesc.empty()) {
-					prompt << "• Additional Details: " << extraDesc << "\n";
-			    }
-				prompt << "\nYour JSON schema should be:\n" << R"({
-					"Name": "...",
-					"Type": "...",
-					"Rarity": "...",
-					"Weight": "...",
-					"Description": "..."
-				}
-				)";
-
-		prompt << "\nPopulate only the fields after those prefilled above.\n";
-		if (allowEnchantment) {
-			prompt << "Description: include a short history, benefits, and an enchantment in 150 words or less, "\
-					  "scale the enchantments appropriately according to rarity, only add curses to items of legendary rarity or greater, "\
-					  "most importantly: be original and imaginative, you are encouraged to combine fantasy sources, "\
-				      "do not rely on terms like \"serpent\" or \"whispering sand\". Item weight should be a minimum of 1/2 lb.\n";
-		} else {
-			prompt << "Description: include a short history and benefits in 150 words or less (do NOT include any enchantment or curse). "\
-					  "Most importantly: be original and imaginative, you are encouraged to combine fantasy sources, "\
-					  "do not rely on terms like \"serpent\" or \"whispering sand\". Item weight should be a minimum of 1/2 lb.\n";
-			}
+protected:
+	// Candidates one call can return ("n"), 1 for servers without it
+	virtual int maxCandidates() const { return 8; }
+
+	LlmResult generateOnce(const LlmRequest& req) const {
+		auto t0 = Clock::now();
+		const std::atomic<bool>* cancel = req.cancel;
+		long timeoutMs = 0;   // none
+		if (req.deadline != Clock::time_point::max()) {
+			timeoutMs = (long)std::chrono::ceil<std::chrono::milliseconds>(req.deadline - t0).count();
+			if (timeoutMs <= 0) throw UpstreamUnavailable(label() + " not called, deadline passed", "deadline");
 		}
+		auto resp = cpr::Post(
+			cpr::Url{url(req)},
+			headers(),
+			cpr::Body{payload(req).dump()},
+			cpr::Timeout{std::chrono::milliseconds(timeoutMs)},
+			cpr::ProgressCallback{[cancel](cpr::cpr_off_t, cpr::cpr_off_t, cpr::cpr_off_t, cpr::cpr_off_t, intptr_t) {
+				return !(cancel && cancel->load());
+			}}
+		);
+		if (resp.error && timeoutMs && (resp.error.code == cpr::ErrorCode::OPERATION_TIMEDOUT || Clock::now() >= req.deadline)) {
+			throw UpstreamUnavailable(label() + " gave no response before the deadline", "deadline");
+		}
+		if (resp.error) {
+			throw std::runtime_error(label() + " HTTP POST failed: " + resp.error.message);
+		}
+		if (resp.status_code == 429) {
+			throw UpstreamUnavailable(label() + " quota exhausted: " + resp.text, "quota");
+		}
+		if (resp.status_code < 200 || resp.status_code >= 300) {
+			throw std::runtime_error(label() + " HTTP " + std::to_string(resp.status_code)
+									 + ": " + resp.text);
+		}
+		json full = json::parse(resp.text);
 
-	// 2) Prepare payload
-	json payload = {
-		{"contents", json::array({
-			{
-			{"role","user"},
-			{"parts", json::array({ {{"text", prompt.str()}} })}
-			}
-		})},
-		{"generationConfig", {
-			{"temperature",      1.0},
-			{"maxOutputTokens",  768},
-			{"topP",             0.95},
-			{"topK",             40}      
-		}}
-	};
+		LlmResult out;
+		out.texts     = texts(full);
+		out.usage     = usage(full);
+		out.provider  = name();
+		out.model     = req.model;
+		out.latencyMs = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+		if (out.texts.empty()) throw std::runtime_error(label() + " returned no candidates");
+		return out;
+	}
 
-	// 3) Build URL
-	std::string host  = "https://" + location + "-aiplatform.googleapis.com";
-	std::string model = "gemini-2.0-flash-001";
-	std::string url   = host
-		+ "/v1/projects/" + project
-		+ "/locations/"   + location
-		+ "/publishers/google/models/" + model
-		+ ":generateContent";
+	virtual std::string              label() const = 0;
+	virtual std::string              url(const LlmRequest& req) const = 0;
+	virtual cpr::Header              headers() const = 0;
+	virtual json                     payload(const LlmRequest& req) const = 0;
+	virtual std::vector<std::string> texts(const json& full) const = 0;
+	virtual LlmUsage                 usage(const json& full) const = 0;
+};
 
-	// 4) Send POST
-	auto resp = cpr::Post(
-		cpr::Url{url},
-		cpr::Header{
-			{"Content-Type","application/json"},
-			{"Authorization","Bearer "+getAccessToken(adc)}
-		},
-		cpr::Body{payload.dump()}
-	);
-	if (resp.error) {
-		throw std::runtime_error("HTTP POST failed: " + resp.error.message);
+// Vertex AI generateContent, authenticated with the service-account token
+class VertexProvider : public LlmProvider {
+public:
+	VertexProvider(json adc, std::string project, std::string location)
+		: adc_(std::move(adc)), project_(std::move(project)), location_(std::move(location)) {}
+
+	std::string name() const override { return "vertex"; }
+
+protected:
+	std::string label() const override { return "Vertex AI"; }
+
+	// VERTEX_API_BASE / GCS_API_BASE point these at a local stand-in
+	std::string host() const {
+		const char* base = std::getenv("VERTEX_API_BASE");
+		return base ? base : "https://" + location_ + "-aiplatform.googleapis.com";
 	}
-	if (resp.status_code < 200 || resp.status_code >= 300) {
-		throw std::runtime_error(
-		  "Vertex AI HTTP " + std::to_string(resp.status_code)
-		  + ": " + resp.text
-		);
+	static std::string gcsHost() {
+		const char* base = std::getenv("GCS_API_BASE");
+		return base ? base : "https://storage.googleapis.com";
 	}
 
-	// 5) Parse & clean
-	auto full = json::parse(resp.text);
-	std::string raw = full["candidates"][0]["content"]["parts"][0]["text"];
-	auto start = raw.find('{');
-	auto end   = raw.rfind('}');
-	if (start==std::string::npos||end==std::string::npos||end<=start) {
-		return full;
+	std::string url(const LlmRequest& req) const override {
+		return host()
+			+ "/v1/projects/" + project_
+			+ "/locations/"   + location_
+			+ "/publishers/google/models/" + req.model
+			+ ":generateContent";
 	}
-	std::string jsonText = raw.substr(start, end-start+1);
-	return json::parse(jsonText);
-}
 
-// Helper: if that numeric value > 1, switch to " lbs."
-static void adjustWeight(nlohmann::json &out) {
-	if (!out.contains("Weight") || !out["Weight"].is_string()) return;
+	cpr::Header headers() const override {
+		return cpr::Header{
+			{"Content-Type","application/json"},
+			{"Authorization","Bearer "+getAccessToken(adc_)}
+		};
+	}
 
-	// 1) grab & trim the original, e.g. "1 1/2 lb."
-	std::string w = trim(out["Weight"].get<std::string>());
+	json payload(const LlmRequest& req) const override {
+		return {
+			{"contents", json::array({
+				{
+				{"role","user"},
+				{"parts", json::array({ {{"text", req.prompt}} })}
+				}
+			})},
+			{"generationConfig", {
+				{"temperature",      req.temperature},
+				{"maxOutputTokens",  req.maxTokens},
+				{"topP",             0.95},
+				{"topK",             40},
+				{"candidateCount",   req.candidates}
+			}}
+		};
+	}
 
-	// 2) split at the last space, to separate numeric and unit
-	auto pos = w.find_last_of(' ');
-	if (pos == std::string::npos) return;
+	std::vector<std::string> texts(const json& full) const override {
+		std::vector<std::string> out;
+		for (auto& c : full.value("candidates", json::array())) {
+			out.push_back(c["content"]["parts"][0]["text"].get<std::string>());
+		}
+		return out;
+	}
 
-	std::string numericPart = trim(w.substr(0, pos));
-	// std::string oldUnit     = trim(w.substr(pos+1)); 
+	LlmUsage usage(const json& full) const override {
+		json u = full.value("usageMetadata", json::object());
+		return {u.value("promptTokenCount", (int64_t)0), u.value("candidatesTokenCount", (int64_t)0)};
+	}
 
-	// 3) decide singular vs plural
-	std::string unit = (numericPart == "1") ? "lb." : "lbs.";
+public:
+	// Batch prediction reads its input from and writes its output to
+	// gs://VERTEX_BATCH_BUCKET/bulk/<jobName>/
+	std::string submitBatch(const std::string& jobName,
+							const std::vector<LlmRequest>& reqs) const override {
+		const char* bucket = std::getenv("VERTEX_BATCH_BUCKET");
+		if (!bucket) throw std::runtime_error("VERTEX_BATCH_BUCKET not set");
+		if (reqs.empty()) throw std::runtime_error("Empty batch");
+		std::string prefix = "bulk/" + jobName;
 
-	// 4) write it back
-	out["Weight"] = numericPart + " " + unit;
-}
+		std::ostringstream jsonl;
+		for (auto& r : reqs) jsonl << json{{"request", payload(r)}}.dump() << "\n";
 
-nlohmann::json queryShopkeeper(const nlohmann::json& in,
-                               const nlohmann::json& adc,
-                               const std::string& project,
-                               const std::string& location) {
-    using json = nlohmann::json;
+		auto up = cpr::Post(
+			cpr::Url{gcsHost() + "/upload/storage/v1/b/" + bucket + "/o?uploadType=media&name="
+					 + urlEncode(prefix + "/input.jsonl")},
+			cpr::Header{
+				{"Content-Type","application/octet-stream"},
+				{"Authorization","Bearer "+getAccessToken(adc_)}
+			},
+			cpr::Body{jsonl.str()}
+		);
+		checkHttp(up, "GCS upload");
 
-    // 1) extract inputs (description is optional)
-    std::string name          = in.value("name", "");
-    std::string race          = in.value("race", "");
-    std::string settlement    = in.value("settlementSize", "");
-    std::string shopType      = in.value("shopType", "");
-    std::string extraDesc     = in.value("description", "");
+		json job = {
+			{"displayName", jobName},
+			{"model", "publishers/google/models/" + reqs[0].model},
+			{"inputConfig", {
+				{"instancesFormat", "jsonl"},
+				{"gcsSource", {{"uris", json::array({"gs://" + std::string(bucket) + "/" + prefix + "/input.jsonl"})}}}
+			}},
+			{"outputConfig", {
+				{"predictionsFormat", "jsonl"},
+				{"gcsDestination", {{"outputUriPrefix", "gs://" + std::string(bucket) + "/" + prefix + "/output"}}}
+			}}
+		};
+		auto resp = cpr::Post(
+			cpr::Url{host() + "/v1/projects/" + project_ + "/locations/" + location_ + "/batchPredictionJobs"},
+			headers(),
+			cpr::Body{job.dump()}
+		);
+		checkHttp(resp, "Vertex AI batch submit");
+		return json::parse(resp.text).at("name").get<std::string>();
+	}
 
-    // 2) build the user prompt
-    std::ostringstream prompt;
-    prompt << "You are a Dungeons & Dragons 5th Edition shopkeeper NPC generator.\n"
-           << "Produce ONLY a single JSON object (no extra text) with this schema:\n"
-           << R"({
-				"Name": "...",
-				"Race": "...",
-				"SettlementSize": "...",
-				"ShopType": "...",
-				"Description": "...",
-				"ItemsList": "[\"Item Name (10 gp)\",\"Another Item (2 sp)\",\"Another Item (5 cp)\",\"...\"]"
-		   })";
-		   prompt << "\nHere are the parameters:\n"
-				  << "• Name: "           << name       << "\n"
-				  << "• Race: "           << race       << "\n"
-				  << "• Settlement Size: "<< settlement << "\n"
-				  << "• Shop Type: "      << shopType   << "\n";
-    if (!extraDesc.empty()) {
-        prompt << "• Additional Details: " << extraDesc << "\n";
-    }
-    prompt << "\nGenerate a list of 10–15 items this shopkeeper sells, appropriate to "\
-              "the shop type and settlement size. "\
-			  "For each item, include its price in gold pieces (gp), silver pieces (sp), or copper pieces (cp) in parentheses after the name, "\ 
-			  "e.g. \"Longsword (15 gp)\".\n";
+	BatchStatus pollBatch(const std::string& remoteId) const override {
+		auto resp = cpr::Get(cpr::Url{host() + "/v1/" + remoteId}, headers());
+		checkHttp(resp, "Vertex AI batch poll");
+		json j = json::parse(resp.text);
+		std::string state = j.value("state", "");
+		BatchStatus st{"running", state, j};
+		if (state == "JOB_STATE_SUCCEEDED") st.state = "succeeded";
+		else if (state == "JOB_STATE_FAILED" || state == "JOB_STATE_CANCELLED" || state == "JOB_STATE_EXPIRED")
+			st.state = "failed";
+		if (j.contains("error")) st.detail += " " + j["error"].dump();
+		return st;
+	}
 
-    // 3) prepare the Vertex AI payload [USE THIS CODE TO TARGET GEMINI]
-    /* json payload = {
-        {"contents", json::array({
-            {
-                {"role",  "user"},
-                {"parts", json::array({ {{"text", prompt.str()}} }) }
-            }
-        })},
-        {"generationConfig", {
-            {"temperature",     1.0},
-            {"maxOutputTokens", 1024},
-            {"topP",            0.95},
-			{"topK",             40}
-        }}
-    };
+	// Output lines echo their request, so results are matched back by prompt
+	std::vector<std::pair<size_t, std::string>>
+	fetchBatch(const BatchStatus& st, const std::vector<LlmRequest>& reqs) const override {
+		std::string dir = st.raw.at("outputInfo").at("gcsOutputDirectory").get<std::string>();
+		if (dir.rfind("gs://", 0) != 0) throw std::runtime_error("Unexpected output directory: " + dir);
+		auto slash = dir.find('/', 5);
+		std::string bucket = dir.substr(5, slash - 5);
+		std::string prefix = (slash == std::string::npos) ? "" : dir.substr(slash + 1);
+		cpr::Header auth{{"Authorization","Bearer "+getAccessToken(adc_)}};
 
-    // 4) call the Gemini endpoint (MAY CHANGE THIS TO GEMINI 2.5)
-    std::string url = "https://aiplatform.googleapis.com"
-                    + std::string("/v1/projects/") + project
-                    + "/locations/"   + location
-                    + "/publishers/google/models/gemini-2.0-flash-001:generateContent";
-
-    std::string bearer = "Bearer " + getAccessToken(adc);
-    auto resp = cpr::Get(
-        cpr::Url{url},
-        cpr::Header{
-          {"Content-Type",  "application/json"},
-          {"Authorization", bearer}
-        },
-        cpr::Body{payload.dump()}
-    );
-    if (resp.error) {
-        throw std::runtime_error("Shopkeeper HTTP GET failed: " + resp.error.message);
-    }
-    if (resp.status_code < 200 || resp.status_code >= 300) {
-        throw std::runtime_error("Shopkeeper Vertex AI HTTP " +
-                                 std::to_string(resp.status_code) +
-                                 ": " + resp.text);
-    }
+		std::multimap<std::string, size_t> byPrompt;
+		for (size_t i = 0; i < reqs.size(); ++i) byPrompt.emplace(reqs[i].prompt, i);
 
-    // 5) extract the JSON blob from the model’s response
-    auto full = json::parse(resp.text);
-    std::string raw =
-      full["candidates"][0]["content"]["parts"][0]["text"].get<std::string>(); */ 
-	
-	 // 3) ChatCompletion via OpenAI GPT-4.1-mini
-    const char* key = std::getenv("OPENAI_API_KEY");
-    if (!key) throw std::runtime_error("OPENAI_API_KEY not set");
-	json oa_payload = {
-		{"model",                  "gpt-4.1-mini"},
-		{"messages", json::array({
-			{
-			{"role",    "user"},
-			{"content", prompt.str()}
-			}
-		})},
-		{"response_format", json({{"type", "text"}})},
-		{"temperature",            1},
-		{"max_completion_tokens", 1024},
-		{"top_p",                  1},
-		{"frequency_penalty",      0},
-		{"presence_penalty",       0},
-		{"store",                  false}
-	};
-
-    auto resp = cpr::Post(
-		cpr::Url{"https://api.openai.com/v1/chat/completions"},
-		cpr::Header{
-			{"Content-Type",  "application/json"},
-			{"Authorization", std::string("Bearer ") + key},
-		},
-		cpr::Body{oa_payload.dump()}
-    );
+		auto list = cpr::Get(cpr::Url{gcsHost() + "/storage/v1/b/" + bucket + "/o?prefix=" + urlEncode(prefix)}, auth);
+		checkHttp(list, "GCS list");
+		std::vector<std::pair<size_t, std::string>> out;
+		for (auto& obj : json::parse(list.text).value("items", json::array())) {
+			std::string name = obj.at("name");
+			if (name.size() < 6 || name.compare(name.size() - 6, 6, ".jsonl") != 0) continue;
+			auto file = cpr::Get(cpr::Url{gcsHost() + "/storage/v1/b/" + bucket + "/o/" + urlEncode(name) + "?alt=media"}, auth);
+			checkHttp(file, "GCS download");
+			std::istringstream lines(file.text);
+			std::string line;
+			while (std::getline(lines, line)) {
+				json l = json::parse(line, nullptr, false);
+				if (l.is_discarded() || !l.contains("response")) continue;
+				std::string prompt = l["request"]["contents"][0]["parts"][0]["text"];
+				auto it = byPrompt.find(prompt);
+				if (it == byPrompt.end()) continue;
+				auto t = texts(l["response"]);
+				if (!t.empty()) out.emplace_back(it->second, t[0]);
+				byPrompt.erase(it);
+			}
+		}
+		return out;
+	}
 
-	// Debug logging 
-	/* std::cerr 
-		<< "[DEBUG] OpenAI responded " << resp.status_code 
-		<< "\n[DEBUG]   body: " << resp.text << "\n"; */
+private:
+	json        adc_;
+	std::string project_;
+	std::string location_;
+};
 
-	// 4) Check for errors
-    if (resp.error) {
-		throw std::runtime_error("OpenAI HTTP POST failed: " + resp.error.message);
-    }
-    if (resp.status_code != 200) {
-		throw std::runtime_error("OpenAI HTTP " +
-                               std::to_string(resp.status_code) +
-                               ": " + resp.text);
-    }
+// OpenAI ChatCompletion, or any server speaking the same API
+// (e.g. llama.cpp's llama-server); the key is read from keyEnv when set
+class OpenAICompatibleProvider : public LlmProvider {
+public:
+	OpenAICompatibleProvider(std::string name, std::string label,
+							 std::string baseUrl, std::string keyEnv, bool keyRequired,
+							 std::optional<ModelPrice> price = std::nullopt)
+		: name_(std::move(name)), label_(std::move(label)), baseUrl_(std::move(baseUrl)),
+		  keyEnv_(std::move(keyEnv)), keyRequired_(keyRequired), price_(price) {}
 
-    // 5) extract the JSON blob from ChatCompletion response
-    auto jresp = json::parse(resp.text);
-    std::string raw = jresp["choices"][0]["message"]["content"].get<std::string>();
-    auto start = raw.find('{'), end = raw.rfind('}');
+	std::string name() const override { return name_; }
 
-	//Code for Gemini 
-    /* if (start == std::string::npos || end == std::string::npos || end <= start) {
-      return full;
-    }
-    std::string jsonText = raw.substr(start, end - start + 1);
-    return json::parse(jsonText); */
+	// The price registered for every model of this endpoint, else the list price
+	std::optional<ModelPrice> price(const std::string& model) const override {
+		return price_ ? price_ : listPrice(model);
+	}
 
-	//Code for OpenAI 
-	if (start == std::string::npos || end == std::string::npos || end <= start) {
-      return {};  // or throw
-    }
-    std::string jsonText = raw.substr(start, end - start + 1);
-    return json::parse(jsonText);
-}
-	
-int main(int argc, char* argv[]) {
-	loadDotenv(".env");
-	const char* key = std::getenv("OPENAI_API_KEY");
-    if (!key) throw std::runtime_error("OPENAI_API_KEY not set");
+protected:
+	std::string label() const override { return label_; }
 
-	const char* cred_env = std::getenv("GOOGLE_APPLICATION_CREDENTIALS");
-	if (!cred_env) {
-		std::cerr<<"Error: GOOGLE_APPLICATION_CREDENTIALS not set\n";
-		return 1;
+	std::string url(const LlmRequest&) const override {
+		return baseUrl_ + "/chat/completions";
 	}
-	json adc;
-	try { adc = loadJSON(cred_env); }
-	catch(const std::exception& e) {
-		std::cerr<<"Cred load failed: "<<e.what()<<"\n";
-		return 1;
+
+	cpr::Header auth() const {
+		cpr::Header hdr;
+		const char* key = keyEnv_.empty() ? nullptr : std::getenv(keyEnv_.c_str());
+		if (key && *key) hdr["Authorization"] = std::string("Bearer ") + key;
+		else if (keyRequired_) throw std::runtime_error(keyEnv_ + " not set");
+		return hdr;
 	}
 
-	const char* proj = std::getenv("GOOGLE_PROJECT_ID");
-	const char* loc  = std::getenv("GOOGLE_PROJECT_LOCATION");
-	if (!proj||!loc) {
-		std::cerr<<"Error: GOOGLE_PROJECT_ID or LOCATION missing\n";
-		return 1;
+	cpr::Header headers() const override {
+		cpr::Header hdr = auth();
+		hdr["Content-Type"] = "application/json";
+		return hdr;
 	}
-	std::string project  = proj;
-	std::string location = loc;
 
-	// CLI mode
-	if (argc>1 && std::string(argv[1])=="--cli") {
-		std::string inraw{
-		  std::istreambuf_iterator<char>(std::cin),
-		  std::istreambuf_iterator<char>()
+	json payload(const LlmRequest& req) const override {
+		return {
+			{"model",                  req.model},
+			{"messages", json::array({
+				{
+				{"role",    "user"},
+				{"content", req.prompt}
+				}
+			})},
+			{"response_format", json({{"type", "text"}})},
+			{"temperature",            req.temperature},
+			{"max_completion_tokens",  req.maxTokens},
+			{"n",                      req.candidates},
+			{"top_p",                  1},
+			{"frequency_penalty",      0},
+			{"presence_penalty",       0},
+			{"store",                  false}
 		};
-		try {
-			json in  = json::parse(inraw);
-			json out = queryGemini(in, adc, project, location);
-			std::cout<<out.dump()<<"\n";
-			return 0;
-		} catch(const std::exception& e) {
-			std::cerr<<"CLI error: "<<e.what()<<"\n";
-			return 2;
+	}
+
+	std::vector<std::string> texts(const json& full) const override {
+		std::vector<std::string> out;
+		for (auto& c : full.value("choices", json::array())) {
+			out.push_back(c["message"]["content"].get<std::string>());
 		}
+		return out;
 	}
 
-	// HTTP‐server mode
-	crow::SimpleApp app;
+	LlmUsage usage(const json& full) const override {
+		json u = full.value("usage", json::object());
+		return {u.value("prompt_tokens", (int64_t)0), u.value("completion_tokens", (int64_t)0)};
+	}
 
-	// Gear builder route
-	CROW_ROUTE(app, "/api/gear").methods("GET"_method)
-	([&](const crow::request& req){
-		try {
-			json in;
-			auto& params = req.url_params;
-			if (auto v = params.get("name"))           in["name"]           = v;
-			if (auto v = params.get("type"))           in["type"]           = v;
-			if (auto v = params.get("handedness"))     in["handedness"]     = v;
-			if (auto v = params.get("subtype"))        in["subtype"]        = v;
-			if (auto v = params.get("rarity"))         in["rarity"]         = v;
-			if (auto v = params.get("clothingPiece"))  in["clothingPiece"]  = v;
-			if (auto v = params.get("description"))    in["description"]    = v;
-
-			json out = queryGemini(in, adc, project, location);
-            crow::response res(out.dump());
-            res.set_header("Content-Type","application/json");
-            return res;
-        } catch (const std::exception& e) {
-            json err = {{"error","ProcessingFailed"},{"message",e.what()}};
-            crow::response res(500, err.dump());
-            res.set_header("Content-Type","application/json");
-            return res;
-        }
-    });
+public:
+	// Batch API: upload a JSONL file of requests, then create a batch over it
+	std::string submitBatch(const std::string& jobName,
+							const std::vector<LlmRequest>& reqs) const override {
+		std::ostringstream jsonl;
+		for (size_t i = 0; i < reqs.size(); ++i) {
+			jsonl << json{
+				{"custom_id", std::to_string(i)},
+				{"method",    "POST"},
+				{"url",       "/v1/chat/completions"},
+				{"body",      payload(reqs[i])}
+			}.dump() << "\n";
+		}
+		std::string data = jsonl.str();
 
-	// Random‐gear route
-	CROW_ROUTE(app, "/api/gear/random").methods("GET"_method)
-	([&](){
-		static std::mt19937_64 gen{ std::random_device{}() };
+		auto up = cpr::Post(
+			cpr::Url{baseUrl_ + "/files"},
+			auth(),
+			cpr::Multipart{
+				{"purpose", "batch"},
+				{"file",    cpr::Buffer{data.begin(), data.end(), jobName + ".jsonl"}}
+			}
+		);
+		checkHttp(up, label_ + " batch upload");
+		std::string fileId = json::parse(up.text).at("id");
 
-		std::vector<std::string> rarities{"Common","Uncommon","Rare","Very Rare","Legendary","Artifact"};
-		std::uniform_int_distribution<> dR(0, (int)rarities.size()-1);
+		json batch = {
+			{"input_file_id",     fileId},
+			{"endpoint",          "/v1/chat/completions"},
+			{"completion_window", "24h"}
+		};
+		auto resp = cpr::Post(cpr::Url{baseUrl_ + "/batches"}, headers(), cpr::Body{batch.dump()});
+		checkHttp(resp, label_ + " batch submit");
+		return json::parse(resp.text).at("id").get<std::string>();
+	}
 
-		std::vector<std::string> types{"Weapon","Armor"};
-		std::uniform_int_distribution<> dT(0,1);
+	BatchStatus pollBatch(const std::string& remoteId) const override {
+		auto resp = cpr::Get(cpr::Url{baseUrl_ + "/batches/" + remoteId}, auth());
+		checkHttp(resp, label_ + " batch poll");
+		json j = json::parse(resp.text);
+		std::string status = j.value("status", "");
+		BatchStatus st{"running", status, j};
+		if (status == "completed") st.state = "succeeded";
+		else if (status == "failed" || status == "expired" || status == "cancelled" || status == "cancelling")
+			st.state = "failed";
+		if (j.contains("request_counts")) st.detail += " " + j["request_counts"].dump();
+		return st;
+	}
 
-		json in;
-		in["type"]   = types[dT(gen)];
-		in["rarity"] = rarities[dR(gen)];
-		in["name"]   = "";
-
-		if (in["type"] == "Weapon") {
-			std::vector<std::string> hands{"Single-Handed","Two-Handed"};
-			std::uniform_int_distribution<> dH(0,1);
-			std::string hand = hands[dH(gen)];
-			in["handedness"] = hand;
-			std::vector<std::string> subs = (hand == "Single-Handed")
-			? std::vector<std::string>{
-				"Club",
-				"Dagger",
-				"Flail",
-				"Hand Crossbows",
-				"Handaxe",
-				"Javelin",
-				"Light Hammer",
-				"Mace",
-				"Morningstar",
-				"Rapier",
-				"Scimitar",
-				"Sickle",
-				"Shortsword",
-				"War pick"
-			 }
-			: std::vector<std::string>{
-				"Battleaxe",
-				"Glaive",
-				"Greataxe",
-				"Greatsword",
-				"Halberd",
-				"Longsword",
-				"Maul",
-				"Pike",
-				"Quarterstave",
-				"Spears",
-				"Trident",
-				"Warhammer"
-			};
-			std::uniform_int_distribution<> dS(0, (int)subs.size()-1);
-			in["subtype"] = subs[dS(gen)];
-		} else {
-			std::vector<std::string> armorClasses{"Light","Medium","Heavy","Shield","Clothes"};
-			std::uniform_int_distribution<> dA(0, (int)armorClasses.size()-1);
-			std::string ac = armorClasses[dA(gen)];
-			in["subtype"] = ac;
-			if (ac != "Shield") {
-				std::vector<std::string> cloths{"Helmet","Chestplate","Gauntlets","Boots","Cloak","Hat"};
-				std::uniform_int_distribution<> dC(0, (int)cloths.size()-1);
-				in["clothingPiece"] = cloths[dC(gen)];
-			}
-		}
+	std::vector<std::pair<size_t, std::string>>
+	fetchBatch(const BatchStatus& st, const std::vector<LlmRequest>& reqs) const override {
+		std::string fileId = st.raw.value("output_file_id", "");
+		if (fileId.empty()) throw std::runtime_error(label_ + " batch has no output file");
+		auto resp = cpr::Get(cpr::Url{baseUrl_ + "/files/" + fileId + "/content"}, auth());
+		checkHttp(resp, label_ + " batch download");
 
-		try {
-			json out = queryGemini(in, adc, project, location);
-			adjustWeight(out);
-			crow::response res(out.dump());
-			res.set_header("Content-Type","application/json");
-			return res;
-		} catch(const std::exception& e) {
-			json err = {{"error","ProcessingFailed"},{"message",e.what()}};
-			crow::response res(500, err.dump());
-			res.set_header("Content-Type","application/json");
-			return res;
+		std::vector<std::pair<size_t, std::string>> out;
+		std::istringstream lines(resp.text);
+		std::string line;
+		while (std::getline(lines, line)) {
+			json l = json::parse(line, nullptr, false);
+			if (l.is_discarded() || !l.contains("response") || l["response"].is_null()) continue;
+			if (l["response"].value("status_code", 0) != 200) continue;
+			size_t idx = std::stoul(l.value("custom_id", "0"));
+			auto t = texts(l["response"]["body"]);
+			if (idx < reqs.size() && !t.empty()) out.emplace_back(idx, t[0]);
 		}
-	});
+		return out;
+	}
 
-	CROW_ROUTE(app, "/api/shopkeeper").methods("GET"_method)
-    ([&](const crow::request& req){
-		try {
-			json in;
-            auto& params = req.url_params;
-            if (auto v = params.get("name"))           in["name"]           = v;
-            if (auto v = params.get("race"))           in["race"]           = v;
-            if (auto v = params.get("settlementSize")) in["settlementSize"] = v;
-            if (auto v = params.get("shopType"))       in["shopType"]       = v;
-            if (auto v = params.get("description"))    in["description"]    = v;
+private:
+	std::string               name_, label_, baseUrl_, keyEnv_;
+	bool                      keyRequired_;
+	std::optional<ModelPrice> price_;
+};
 
-            auto out = queryShopkeeper(in, adc, project, location);
-            crow::response res(out.dump());
-            res.set_header("Content-Type","application/json");
-            return res;
-        } catch (const std::exception& e) {
-            nlohmann::json err = {
-                {"error",   "ProcessingFailed"},
-                {"message", e.what()}
-            };
-            crow::response res(500, err.dump());
-            res.set_header("Content-Type","application/json");
-            return res;
-        }
-    });
+// llama.cpp's llama-server and similar local servers: one completion per
+// call ("n" must be 1) and the classic max_tokens, without OpenAI-only fields
+class LocalProvider : public OpenAICompatibleProvider {
+public:
+	// Runs on our own hardware, so free unless a price is registered
+	LocalProvider(std::string name, std::string label, std::string baseUrl, std::string keyEnv,
+				  std::optional<ModelPrice> price = ModelPrice{})
+		: OpenAICompatibleProvider(std::move(name), std::move(label), std::move(baseUrl), std::move(keyEnv), false, price) {}
 
-	CROW_ROUTE(app, "/api/shopkeeper/random").methods("GET"_method)
-    ([&](){
-        static std::mt19937_64 gen{ std::random_device{}() };
-        std::vector<std::string> races = {
-            "Aarakocra","Aasimar","Air Genasi","Bugbear","Centaur","Changeling","Deep Gnome","Duergar","Dragonborn",
-            "Dwarf","Earth Genasi","Eladrin","Elf","Fairy","Firbolg","Fire Genasi","Githyanki","Githzerai","Gnome",
-            "Goliath","Half-Elf","Halfling","Half-Orc","Harengon","Hobgoblin","Human","Kenku","Kobold","Lizardfolk",
-            "Minotaur","Orc","Satyr","Sea Elf","Shadar-kai","Shifter","Tabaxi","Tiefling","Tortle","Triton",
-            "Water Genasi","Yuan-ti"
-        };
-        std::uniform_int_distribution<> dR(0, (int)races.size()-1);
-
-        std::vector<std::string> settlements{"Outpost","Village","Town","City"};
-        std::uniform_int_distribution<> dS(0, (int)settlements.size()-1);
-
-        std::vector<std::string> shopTypes{
-            "Alchemist","Apostle","Artificer","Apothecary","Blacksmith","Bookstore","Cobbler","Fletcher",
-            "General Store","Haberdashery","Innkeeper","Leatherworker","Pawnshop","Tailor"
-        };
-        std::uniform_int_distribution<> dT(0, (int)shopTypes.size()-1);
-
-        json in;
-        in["name"]           = "";
-        in["race"]           = races[dR(gen)];
-        in["settlementSize"] = settlements[dS(gen)];
-        in["shopType"]       = shopTypes[dT(gen)];
-        in["description"]    = "";
+protected:
+	int maxCandidates() const override { return 1; }
 
-        try {
-            json out = queryShopkeeper(in, adc, project, location);
-            crow::response res(out.dump());
-            res.set_header("Content-Type","application/json");
-            return res;
-        } catch (const std::exception& e) {
-            json err = {{"error","ProcessingFailed"},{"message",e.what()}};
-            crow::response res(500, err.dump());
-            res.set_header("Content-Type","application/json");
-            return res;
-        }
-    });
+	json payload(const LlmRequest& req) const override {
+		return {
+			{"model",       req.model},
+			{"messages",    json::array({{{"role", "user"}, {"content", req.prompt}}})},
+			{"temperature", req.temperature},
+			{"max_tokens",  req.maxTokens},
+			{"top_p",       1}
+		};
+	}
+};
 
-	app.port(5000).multithreaded().run();
+// Provider registry, swapped wholesale so lookups never take a lock
+using ProviderMap = std::map<std::string, std::shared_ptr<const LlmProvider>>;
+static std::shared_ptr<const ProviderMap> provider_registry = std::make_shared<const ProviderMap>();
+static std::mutex                         provider_registry_mutex;
+
+static void registerProvider(std::shared_ptr<const LlmProvider> p) {
+	std::lock_guard<std::mutex> lk(provider_registry_mutex);
+	auto next = std::make_shared<ProviderMap>(*std::atomic_load(&provider_registry));
+	(*next)[p->name()] = std::move(p);
+	std::atomic_store(&provider_registry, std::shared_ptr<const ProviderMap>(next));
+}
+
+static std::shared_ptr<const LlmProvider> findProvider(const std::string& name) {
+	auto reg = std::atomic_load(&provider_registry);
+	auto it  = reg->find(name);
+	if (it == reg->end()) throw std::runtime_error("Unknown provider: " + name);
+	return it->second;
+}
+
+// Built-in providers: vertex, openai, and local (LOCAL_LLM_URL, default
+// http://127.0.0.1:8080/v1, with an optional LOCAL_LLM_API_KEY)
+static void registerDefaultProviders(const json& adc,
+									 const std::string& project,
+									 const std::string& location)
+{
+	const char* localUrl = std::getenv("LOCAL_LLM_URL");
+	registerProvider(std::make_shared<VertexProvider>(adc, project, location));
+	registerProvider(std::make_shared<OpenAICompatibleProvider>(
+		"openai", "OpenAI", "https://api.openai.com/v1", "OPENAI_API_KEY", true));
+	registerProvider(std::make_shared<LocalProvider>(
+		"local", "Local LLM", localUrl ? localUrl : "http://127.0.0.1:8080/v1", "LOCAL_LLM_API_KEY"));
+}
+
+// Pull the outermost {...} out of model text, discarded json if there is none
+static json extractJsonObject(const std::string& raw) {
+	auto start = raw.find('{');
+	auto end   = raw.rfind('}');
+	if (start==std::string::npos||end==std::string::npos||end<=start) {
+		return json(json::value_t::discarded);
+	}
+	return json::parse(raw.substr(start, end-start+1), nullptr, false);
+}
+
+// Read a numeric environment variable, falling back to def
+static double envDouble(const std::string& name, double def) {
+	const char* v = std::getenv(name.c_str());
+	if (!v || !*v) return def;
+	try { return std::stod(v); }
+	catch (...) { return def; }
+}
+
+// ————————————————————————————————————————————————
+// Model routing: (type, rarity, route) -> provider & model, read from the
+// JSON file named by ROUTING_TABLE (default routing.json). Rules are tried in
+// order, a missing matcher is a wildcard. The file is re-read when its mtime
+// changes, or on POST /api/admin/routing/reload.
+
+struct ModelChoice {
+	std::string provider;   // registered provider name: "vertex", "openai", "local", ...
+	std::string model;
+	std::shared_ptr<const ModelChoice> fallback;   // tried when this one fails
+	std::optional<ModelPrice>          price;      // overrides the provider's price
+};
+
+struct RouteRule {
+	std::set<std::string> types, rarities, routes;
+	ModelChoice           choice;
+};
+
+struct RoutingTable {
+	std::vector<RouteRule>          rules;
+	std::filesystem::file_time_type mtime{};
+};
+
+static std::shared_ptr<const RoutingTable> routing_table;
+static std::mutex                          routing_reload_mutex;
+static std::atomic<Clock::rep>             routing_checked{0};
+
+// Built-in table used when no routing file is present
+static std::shared_ptr<RoutingTable> defaultRoutingTable() {
+	auto t = std::make_shared<RoutingTable>();
+	RouteRule shop;
+	shop.routes = {"shopkeeper", "shopkeeper/random", "shopkeeper/pool"};
+	shop.choice = {"openai", "gpt-4.1-mini", nullptr};
+	t->rules.push_back(shop);
+	RouteRule gear;
+	gear.choice = {"vertex", "gemini-2.0-flash-001", nullptr};
+	t->rules.push_back(gear);
+	return t;
+}
+
+static std::set<std::string> ruleMatcher(const json& r, const char* key) {
+	std::set<std::string> out;
+	if (!r.contains(key)) return out;
+	if (r[key].is_string()) out.insert(r[key].get<std::string>());
+	else for (auto& v : r[key]) out.insert(v.get<std::string>());
+	return out;
+}
+
+// {"usdPerMTokIn": ..., "usdPerMTokOut": ...} on a rule or provider, if given
+static std::optional<ModelPrice> parsePrice(const json& r) {
+	if (!r.contains("usdPerMTokIn") && !r.contains("usdPerMTokOut")) return std::nullopt;
+	return ModelPrice{r.value("usdPerMTokIn", 0.0), r.value("usdPerMTokOut", 0.0)};
+}
+
+// {"provider": ..., "model": ..., "fallback": {...}}
+static ModelChoice parseModelChoice(const json& r) {
+	ModelChoice c{r.at("provider").get<std::string>(), r.value("model", ""), nullptr, parsePrice(r)};
+	if (c.provider != "procedural") {
+		if (c.model.empty()) throw std::runtime_error("Rule for " + c.provider + " has no model");
+		findProvider(c.provider);   // throws on an unknown provider
+	}
+	if (r.contains("fallback"))
+		c.fallback = std::make_shared<const ModelChoice>(parseModelChoice(r["fallback"]));
+	return c;
+}
+
+static std::shared_ptr<RoutingTable> loadRoutingTable(const std::string& path) {
+	json j = loadJSON(path);
+	auto t = std::make_shared<RoutingTable>();
+	// Extra OpenAI-compatible endpoints: {"providers": {"name": {"baseUrl": ..., "keyEnv": ...,
+	// "local": true for llama-server style servers, "usdPerMTokIn"/"Out" for racing budgets}}}
+	json providers = j.value("providers", json::object());
+	for (auto& [name, p] : providers.items()) {
+		auto price = parsePrice(p);
+		if (p.value("local", false))
+			registerProvider(std::make_shared<LocalProvider>(
+				name, name, p.at("baseUrl").get<std::string>(), p.value("keyEnv", ""), price.value_or(ModelPrice{})));
+		else
+			registerProvider(std::make_shared<OpenAICompatibleProvider>(
+				name, name, p.at("baseUrl").get<std::string>(), p.value("keyEnv", ""), false, price));
+	}
+	for (auto& r : j.at("rules")) {
+		RouteRule rule;
+		rule.types    = ruleMatcher(r, "type");
+		rule.rarities = ruleMatcher(r, "rarity");
+		rule.routes   = ruleMatcher(r, "route");
+		rule.choice   = parseModelChoice(r);
+		t->rules.push_back(rule);
+	}
+	t->mtime = std::filesystem::last_write_time(path);
+	return t;
+}
+
+static std::string routingTablePath() {
+	const char* p = std::getenv("ROUTING_TABLE");
+	return p ? p : "routing.json";
+}
+
+// Re-read the routing file; keeps the current table if the file is broken
+static void reloadRoutingTable(bool force) {
+	std::lock_guard<std::mutex> lk(routing_reload_mutex);
+	routing_checked = Clock::now().time_since_epoch().count();
+	std::string path = routingTablePath();
+	std::error_code ec;
+	auto mtime = std::filesystem::last_write_time(path, ec);
+	auto cur   = std::atomic_load(&routing_table);
+	if (ec) {
+		if (!cur) std::atomic_store(&routing_table, std::shared_ptr<const RoutingTable>(defaultRoutingTable()));
+		return;
+	}
+	if (!force && cur && cur->mtime == mtime) return;
+	try {
+		std::atomic_store(&routing_table, std::shared_ptr<const RoutingTable>(loadRoutingTable(path)));
+	} catch (const std::exception& e) {
+		std::cerr << "Routing table reload failed: " << e.what() << "\n";
+		if (!cur) std::atomic_store(&routing_table, std::shared_ptr<const RoutingTable>(defaultRoutingTable()));
+	}
+}
+
+static ModelChoice routeModel(const std::string& type,
+							  const std::string& rarity,
+							  const std::string& route)
+{
+	if (Clock::now() - Clock::time_point(Clock::duration(routing_checked.load())) > std::chrono::seconds(5))
+		reloadRoutingTable(false);
+	auto t = std::atomic_load(&routing_table);
+	for (auto& r : t->rules) {
+		if (!r.types.empty()    && !r.types.count(type))     continue;
+		if (!r.rarities.empty() && !r.rarities.count(rarity)) continue;
+		if (!r.routes.empty()   && !r.routes.count(route))   continue;
+		return r.choice;
+	}
+	return {"vertex", "gemini-2.0-flash-001", nullptr};
+}
+
+// Upstream generations currently in flight, used to find idle quota
+static std::atomic<int> upstream_in_flight{0};
+
+// Per-provider circuit breaker: BREAKER_FAILURES consecutive failures (or one
+// quota refusal) open it for BREAKER_COOLDOWN_SECONDS, during which calls to
+// that provider fail fast
+struct Breaker {
+	int               failures = 0;
+	Clock::time_point openUntil{};
+};
+static std::map<std::string, Breaker> breakers;
+static std::mutex                     breaker_mutex;
+
+static void breakerCheck(const std::string& provider) {
+	std::lock_guard<std::mutex> lk(breaker_mutex);
+	if (Clock::now() < breakers[provider].openUntil)
+		throw UpstreamUnavailable("Circuit breaker open for " + provider, "breaker-open");
+}
+
+static void breakerRecord(const std::string& provider, bool ok, bool quota) {
+	static const int  threshold = (int)envDouble("BREAKER_FAILURES", 5);
+	static const long cooldown  = (long)envDouble("BREAKER_COOLDOWN_SECONDS", 30);
+	std::lock_guard<std::mutex> lk(breaker_mutex);
+	Breaker& b = breakers[provider];
+	if (ok) { b.failures = 0; return; }
+	if (++b.failures >= threshold || quota) {
+		b.openUntil = Clock::now() + std::chrono::seconds(cooldown);
+		b.failures  = 0;
+	}
+}
+
+// Send a request to the chosen provider & model.
+// On failure the choice's fallback tier (if any) is tried in turn.
+static LlmResult generateWith(const ModelChoice& choice, LlmRequest req) {
+	try {
+		req.model = choice.model;
+		if (req.deadline == Clock::time_point::max()) req.deadline = request_deadline;
+		// Only the gear routes build items locally, anywhere else skip to the fallback
+		if (choice.provider == "procedural")
+			throw std::runtime_error("Procedural generation does not serve this request");
+		breakerCheck(choice.provider);
+		struct InFlight {
+			InFlight()  { upstream_in_flight++; }
+			~InFlight() { upstream_in_flight--; }
+		} guard;
+		try {
+			LlmResult out = findProvider(choice.provider)->generate(req);
+			breakerRecord(choice.provider, true, false);
+			return out;
+		} catch (const UpstreamUnavailable& e) {
+			// Running out of the caller's time is not the provider's fault either
+			if (e.reason != "deadline") breakerRecord(choice.provider, false, true);
+			throw;
+		} catch (const std::exception&) {
+			// A race loser aborted on purpose is not the provider's fault
+			if (!(req.cancel && req.cancel->load())) breakerRecord(choice.provider, false, false);
+			throw;
+		}
+	} catch (const UpstreamUnavailable& e) {
+		if (!choice.fallback || e.reason == "deadline") throw;
+		try {
+			return generateWith(*choice.fallback, req);
+		} catch (const UpstreamUnavailable& f) {
+			throw UpstreamUnavailable(std::string(e.what()) + "; fallback: " + f.what(), e.reason);
+		} catch (const std::exception& f) {
+			throw std::runtime_error(std::string(e.what()) + "; fallback: " + f.what());
+		}
+	} catch (const std::exception& e) {
+		if (!choice.fallback) throw;
+		try {
+			return generateWith(*choice.fallback, req);
+		} catch (const std::exception& f) {
+			throw std::runtime_error(std::string(e.what()) + "; fallback: " + f.what());
+		}
+	}
+}
+
+// Run a route's generation under GEN_DEADLINE_MS (0 = no deadline) on the
+// calling thread. Upstream calls made inside it get the time that is left and
+// are aborted when it runs out; the caller then gets
+// UpstreamUnavailable("deadline").
+template<class F>
+static json withDeadline(F work) {
+	static const long deadlineMs = (long)envDouble("GEN_DEADLINE_MS", 0);
+	if (deadlineMs <= 0) return work();
+	struct Scope {
+		Clock::time_point saved = request_deadline;
+		explicit Scope(Clock::time_point d) { request_deadline = std::min(saved, d); }
+		~Scope() { request_deadline = saved; }
+	} scope(Clock::now() + std::chrono::milliseconds(deadlineMs));
+	try {
+		return work();
+	} catch (const std::exception&) {
+		if (Clock::now() < request_deadline) throw;
+		throw UpstreamUnavailable("No response within " + std::to_string(deadlineMs) + " ms", "deadline");
+	}
+}
+
+// ————————————————————————————————————————————————
+// Speculative racing: the same prompt goes to the routed model and its
+// fallback at once, the first valid JSON object wins and the other transfer
+// is aborted. Per route: RACE_<ROUTE>_SAMPLE_RATE (0..1) and
+// RACE_<ROUTE>_DAILY_BUDGET_USD, the ceiling on estimated spend for raced
+// requests per UTC day.
+
+// Price of one contender: the rule's own, else its provider's, else the
+// dearest listed model, so an unknown one can't slip under the budget
+static ModelPrice choicePrice(const ModelChoice& c) {
+	if (c.price) return *c.price;
+	try {
+		if (auto p = findProvider(c.provider)->price(c.model)) return *p;
+	} catch (const std::exception&) {}
+	ModelPrice dearest;
+	for (auto& [name, p] : MODEL_PRICES) { dearest.in = std::max(dearest.in, p.in); dearest.out = std::max(dearest.out, p.out); }
+	return dearest;
+}
+
+// Contender 0 is the route's model, 1 its fallback
+struct RaceBucket {
+	uint64_t races         = 0;
+	uint64_t primaryWins   = 0;
+	uint64_t fallbackWins  = 0;
+	double   primaryWinMs  = 0;
+	double   fallbackWinMs = 0;
+	double   deltaMs       = 0;   // loser minus winner, when both completed
+	uint64_t deltas        = 0;
+};
+
+struct RaceRoute {
+	double      sampleRate      = 0;
+	double      deltaSampleRate = 0;   // races whose loser runs to completion
+	double      dailyBudgetUsd  = 0;
+	double      spentUsd        = 0;
+	int         day             = -1;
+	std::string contenders[2];         // "provider/model" of the latest race
+	RaceBucket  hours[24];
+};
+
+static std::map<std::string, RaceRoute> race_routes;
+static std::mutex                       race_mutex;
+
+static int utcHour(Clock::time_point t) {
+	std::time_t tt = Clock::to_time_t(t);
+	return (int)((tt / 3600) % 24);
+}
+
+// Must be called with race_mutex held
+static RaceRoute& raceRoute(const std::string& route) {
+	auto it = race_routes.find(route);
+	if (it != race_routes.end()) return it->second;
+	std::string env = route;
+	for (auto& c : env) c = (c=='/' ? '_' : (char)std::toupper((unsigned char)c));
+	RaceRoute& r = race_routes[route];
+	r.sampleRate      = envDouble("RACE_" + env + "_SAMPLE_RATE", 0.0);
+	r.deltaSampleRate = envDouble("RACE_" + env + "_DELTA_SAMPLE_RATE", 0.1);
+	r.dailyBudgetUsd  = envDouble("RACE_" + env + "_DAILY_BUDGET_USD", 0.0);
+	return r;
+}
+
+// Decide whether to race this request between `choice` and its fallback,
+// and reserve its estimated cost
+static bool shouldRace(const std::string& route,
+					   const ModelChoice& choice,
+					   const std::string& prompt,
+					   int maxTokens)
+{
+	static std::mt19937_64 gen{ std::random_device{}() };
+	if (!choice.fallback || choice.provider == "procedural" || choice.fallback->provider == "procedural") return false;
+	// Both contenders are billed in full: the loser is aborted after the fact
+	ModelPrice a = choicePrice(choice), b = choicePrice(*choice.fallback);
+	double inTok = prompt.size() / 4.0;
+	double cost  = (inTok * (a.in + b.in) + maxTokens * (a.out + b.out)) / 1e6;
+
+	std::lock_guard<std::mutex> lk(race_mutex);
+	RaceRoute& r = raceRoute(route);
+	if (r.sampleRate <= 0) return false;
+	if (std::uniform_real_distribution<>(0.0, 1.0)(gen) >= r.sampleRate) return false;
+
+	int day = (int)(Clock::to_time_t(Clock::now()) / 86400);
+	if (day != r.day) { r.day = day; r.spentUsd = 0; }
+	if (r.spentUsd + cost > r.dailyBudgetUsd) return false;
+	r.spentUsd += cost;
+	return true;
+}
+
+struct RaceState {
+	std::mutex              m;
+	std::condition_variable cv;
+	std::atomic<bool>       cancel{false};
+	int                     pending = 2;
+	bool                    won     = false;
+	int                     winner  = -1;     // 0 = routed model, 1 = its fallback
+	bool                    measure = false;  // let the loser finish for the delta
+	json                    result;
+	LlmResult               resultMeta;
+	std::string             errors;
+	double                  ms[2]   = {0, 0};
+	bool                    valid[2] = {false, false};
+	Clock::time_point       start;
+};
+
+static void recordRace(const std::string& route, const RaceState& st) {
+	std::lock_guard<std::mutex> lk(race_mutex);
+	RaceBucket& b = raceRoute(route).hours[utcHour(st.start)];
+	b.races++;
+	if (st.winner == 0) { b.primaryWins++;  b.primaryWinMs  += st.ms[0]; }
+	if (st.winner == 1) { b.fallbackWins++; b.fallbackWinMs += st.ms[1]; }
+	if (st.valid[0] && st.valid[1]) {
+		b.deltaMs += std::fabs(st.ms[0] - st.ms[1]);
+		b.deltas++;
+	}
+}
+
+// Send one prompt to the routed model and its fallback, return the first
+// valid JSON object. The loser is aborted, except on the sampled races
+// (RACE_<ROUTE>_DELTA_SAMPLE_RATE) that measure how far behind it was.
+static json raceProviders(const std::string& route,
+						  const ModelChoice& choice,
+						  const std::string& prompt,
+						  int maxTokens,
+						  LlmResult* meta = nullptr)
+{
+	static std::mt19937_64 gen{ std::random_device{}() };
+	const ModelChoice contenders[2] = {
+		{choice.provider,           choice.model,           nullptr, choice.price},
+		{choice.fallback->provider, choice.fallback->model, nullptr, choice.fallback->price}
+	};
+	auto st = std::make_shared<RaceState>();
+	st->start = Clock::now();
+	{
+		std::lock_guard<std::mutex> lk(race_mutex);
+		RaceRoute& r = raceRoute(route);
+		st->measure = std::uniform_real_distribution<>(0.0, 1.0)(gen) < r.deltaSampleRate;
+		for (int idx = 0; idx < 2; ++idx)
+			r.contenders[idx] = contenders[idx].provider + "/" + contenders[idx].model;
+	}
+
+	for (int idx = 0; idx < 2; ++idx) {
+		std::thread([st, route, prompt, maxTokens, idx, c = contenders[idx], deadline = request_deadline]() {
+			json parsed(json::value_t::discarded);
+			LlmResult res;
+			std::string err;
+			try {
+				LlmRequest req;
+				req.prompt    = prompt;
+				req.maxTokens = maxTokens;
+				req.cancel    = &st->cancel;
+				req.deadline  = deadline;
+				res    = generateWith(c, req);
+				parsed = extractJsonObject(res.texts[0]);
+			} catch (const std::exception& e) {
+				err = e.what();
+			}
+			bool ok = parsed.is_object() && !parsed.empty();
+
+			std::unique_lock<std::mutex> lk(st->m);
+			st->ms[idx]    = std::chrono::duration<double, std::milli>(Clock::now() - st->start).count();
+			st->valid[idx] = ok;
+			if (ok && !st->won) {
+				st->won    = true;
+				st->winner = idx;
+				st->result = std::move(parsed);
+				st->resultMeta = std::move(res);
+				if (!st->measure) st->cancel = true;
+			} else if (!ok) {
+				st->errors += "[" + c.provider + "] "
+							+ (err.empty() ? std::string("no JSON object") : err) + " ";
+			}
+			if (--st->pending == 0) {
+				lk.unlock();
+				recordRace(route, *st);
+			}
+			st->cv.notify_all();
+		}).detach();
+	}
+
+	std::unique_lock<std::mutex> lk(st->m);
+	st->cv.wait(lk, [&]{ return st->won || st->pending == 0; });
+	if (!st->won) throw std::runtime_error("Race failed: " + st->errors);
+	if (meta) *meta = st->resultMeta;
+	return st->result;
+}
+
+// Per route, per UTC hour win rates and latencies
+static json raceStats() {
+	std::lock_guard<std::mutex> lk(race_mutex);
+	json out = json::object();
+	for (auto& [route, r] : race_routes) {
+		json hours = json::array();
+		for (int h = 0; h < 24; ++h) {
+			const RaceBucket& b = r.hours[h];
+			if (!b.races) continue;
+			hours.push_back({
+				{"hour",              h},
+				{"races",             b.races},
+				{"primaryWins",       b.primaryWins},
+				{"fallbackWins",      b.fallbackWins},
+				{"primaryMeanWinMs",  b.primaryWins  ? b.primaryWinMs  / b.primaryWins  : 0.0},
+				{"fallbackMeanWinMs", b.fallbackWins ? b.fallbackWinMs / b.fallbackWins : 0.0},
+				{"meanDeltaMs",       b.deltas ? b.deltaMs / b.deltas : 0.0},
+				{"deltaSamples",      b.deltas}
+			});
+		}
+		out[route] = {
+			{"sampleRate",      r.sampleRate},
+			{"deltaSampleRate", r.deltaSampleRate},
+			{"primary",         r.contenders[0]},
+			{"fallback",        r.contenders[1]},
+			{"dailyBudgetUsd",  r.dailyBudgetUsd},
+			{"spentTodayUsd",   r.spentUsd},
+			{"hours",           hours}
+		};
+	}
+	return out;
+}
+
+// ————————————————————————————————————————————————
+// Item types: each gear type's prompt, output check and /api/gear/random
+// table, compiled once at startup from JSON definitions. Weapon, Armor and
+// Jewelry are built in; every ITEM_TYPES_DIR/*.json (default item_types)
+// adds a type, or replaces the built-in one with the same "type".
+//
+//   "type", "article"      "Potion", "a potion" ("I want a potion called ...")
+//   "role", "noun"         prompt persona (default "gear generator"), name base
+//   "nameBase"             "Potion of {subtype}", the noun if a key is empty
+//   "prompt"               [{"label", "key", "map", "otherwise"}] parameter lines
+//   "fields", "required"   schema [{"name", "list", "hint"}], checked fields
+//   "description"          {"magic", "mundane"} instructions, mundane for Common
+//   "weight", "rarities"   share of /api/gear/random and its rarities
+//   "sample"               [{"key", "by", "values"}] random parameters, "values"
+//                          a list or, with "by", lists by an earlier value
+//   "fallback"             used for unknown types (Jewelry)
+
+static const char* const BUILTIN_ITEM_TYPES = R"json([
+{
+	"type": "Weapon", "article": "a weapon", "noun": "Blade",
+	"prompt": [
+		{"label": "Category", "key": "handedness"},
+		{"label": "Type",     "key": "subtype"},
+		{"label": "Rarity",   "key": "rarity"}
+	],
+	"fields": [
+		{"name": "Name"}, {"name": "Category"}, {"name": "Type"}, {"name": "Rarity"}, {"name": "Cost"},
+		{"name": "DamageDice"}, {"name": "DamageType"}, {"name": "Weight"},
+		{"name": "Properties", "list": true}, {"name": "Description"}
+	],
+	"description": {
+		"magic": "Description: include a short history, benefits, and an enchantment in 150 words or less, scale the enchantments appropriately according to rarity, only add curses to items of legendary rarity or greater, most importantly: be original and imaginative. Do not rely on the term \"dying star\". You are encouraged to use 1/2 lb. measurements on light items (e.g. 1/2 lb. or 1 1/2 lb.).",
+		"mundane": "Description: include a short history and benefits in 150 words or less (do NOT include any enchantment). Most importantly: be original and imaginative. Do not rely on the term \"dying star\". You are encouraged to use 1/2 lb. measurements on light items (e.g. 1/2 lb. or 1 1/2 lb.)."
+	},
+	"sample": [
+		{"key": "handedness", "values": ["Single-Handed", "Two-Handed"]},
+		{"key": "subtype", "by": "handedness", "values": {
+			"Single-Handed": ["Club", "Dagger", "Flail", "Hand Crossbows", "Handaxe", "Javelin", "Light Hammer",
+							  "Mace", "Morningstar", "Rapier", "Scimitar", "Sickle", "Shortsword", "War pick"],
+			"Two-Handed":    ["Battleaxe", "Glaive", "Greataxe", "Greatsword", "Halberd", "Longsword", "Maul",
+							  "Pike", "Quarterstave", "Spears", "Trident", "Warhammer"]
+		}}
+	]
+},
+{
+	"type": "Armor", "article": "an armor/clothing item", "noun": "Armor",
+	"prompt": [
+		{"label": "Category",             "key": "subtype"},
+		{"label": "Piece",                "key": "clothingPiece"},
+		{"label": "Rarity",               "key": "rarity"},
+		{"label": "Armor Class",          "key": "subtype", "map": {"Clothes": "N/A"}},
+		{"label": "Attunement",           "key": "subtype", "map": {"Clothes": "No"}, "otherwise": "Yes"},
+		{"label": "Stealth Disadvantage", "key": "subtype", "map": {"Heavy": "Yes", "Shield": "Yes"}, "otherwise": "No"}
+	],
+	"fields": [
+		{"name": "Name"},
+		{"name": "Piece",               "hint": "headgear / clothes / etc."},
+		{"name": "Category",            "hint": "clothes/light/medium/heavy"},
+		{"name": "Rarity"},
+		{"name": "ArmorClass",          "hint": "N/A or number"},
+		{"name": "Attunement",          "hint": "Yes/No"},
+		{"name": "StealthDisadvantage", "hint": "Yes/No"},
+		{"name": "Weight",              "hint": "e.g. \"1 lb.\" or \"1 1/2 lbs.\""},
+		{"name": "Cost",                "hint": "e.g. \"15 gp\""},
+		{"name": "Properties", "list": true},
+		{"name": "Description",         "hint": "lore + benefits"}
+	],
+	"description": {
+		"magic": "Description: include a short history, benefits, and an enchantment in 150 words or less, scale the enchantments appropriately according to rarity, only add curses to items of legendary rarity or greater, most importantly: be original and imaginative. Do not rely on the term \"dying star\". You are encouraged to use 1/2 lb. measurements on light items (e.g. 1/2 lb. or 1 1/2 lb.).",
+		"mundane": "Description: include a short history and benefits in 150 words or less (do NOT include any enchantment or curse). Most importantly: be original and imaginative. Do not rely on the term \"dying star\". You are encouraged to use 1/2 lb. measurements on light items (e.g. 1/2 lb. or 1 1/2 lb.)."
+	},
+	"sample": [
+		{"key": "subtype", "values": ["Light", "Medium", "Heavy", "Shield", "Clothes"]},
+		{"key": "clothingPiece", "by": "subtype", "values": {
+			"Light":   ["Helmet", "Chestplate", "Gauntlets", "Boots", "Cloak", "Hat"],
+			"Medium":  ["Helmet", "Chestplate", "Gauntlets", "Boots", "Cloak", "Hat"],
+			"Heavy":   ["Helmet", "Chestplate", "Gauntlets", "Boots", "Cloak", "Hat"],
+			"Clothes": ["Helmet", "Chestplate", "Gauntlets", "Boots", "Cloak", "Hat"]
+		}}
+	]
+},
+{
+	"type": "Jewelry", "article": "a piece of jewelry", "role": "jewelry crafter", "noun": "Ring",
+	"fallback": true, "weight": 0,
+	"prompt": [
+		{"label": "Type",   "key": "subtype"},
+		{"label": "Rarity", "key": "rarity"}
+	],
+	"fields": [{"name": "Name"}, {"name": "Type"}, {"name": "Rarity"}, {"name": "Weight"}, {"name": "Description"}],
+	"description": {
+		"magic": "Description: include a short history, benefits, and an enchantment in 150 words or less, scale the enchantments appropriately according to rarity, only add curses to items of legendary rarity or greater, most importantly: be original and imaginative, you are encouraged to combine fantasy sources, do not rely on terms like \"serpent\" or \"whispering sand\". Item weight should be a minimum of 1/2 lb.",
+		"mundane": "Description: include a short history and benefits in 150 words or less (do NOT include any enchantment or curse). Most importantly: be original and imaginative, you are encouraged to combine fantasy sources, do not rely on terms like \"serpent\" or \"whispering sand\". Item weight should be a minimum of 1/2 lb."
+	},
+	"sample": [
+		{"key": "subtype", "values": ["Ring", "Amulet", "Necklace", "Bracelet", "Earrings", "Brooch", "Circlet", "Pendant"]}
+	]
+}
+])json";
+
+class ItemType {
+public:
+	explicit ItemType(const json& def) {
+		type_   = def.at("type").get<std::string>();
+		noun_   = def.value("noun", type_);
+		weight_ = def.value("weight", 1.0);
+		const json rarities = def.value("rarities", json::array({"Common", "Uncommon", "Rare", "Very Rare", "Legendary", "Artifact"}));
+		for (auto& r : rarities) rarities_.push_back(r.get<std::string>());
+		if (rarities_.empty()) throw std::runtime_error(type_ + " has no rarities");
+
+		// "Potion of {subtype}" -> literal / key pieces
+		std::string base = def.value("nameBase", "{subtype}");
+		for (size_t i = 0; i < base.size(); ) {
+			size_t open = base.find('{', i), close = base.find('}', open);
+			if (open == std::string::npos || close == std::string::npos) { nameBase_.push_back({base.substr(i), ""}); break; }
+			nameBase_.push_back({base.substr(i, open - i), base.substr(open + 1, close - open - 1)});
+			i = close + 1;
+		}
+
+		head_ = "You are a Dungeons & Dragons 5E " + def.value("role", std::string("gear generator")) + ".\n"
+			  + "Produce ONLY a single JSON object (no extra text).\n"
+			  + "I want " + def.at("article").get<std::string>();
+		const json lines = def.value("prompt", json::array());
+		for (auto& p : lines) {
+			Line l;
+			l.key       = p.at("key").get<std::string>();
+			l.prefix    = "  " + p.at("label").get<std::string>() + ": ";
+			l.otherwise = p.value("otherwise", "");
+			const json map = p.value("map", json::object());
+			for (auto& [from, to] : map.items()) l.map[from] = to.get<std::string>();
+			lines_.push_back(std::move(l));
+		}
+
+		// Schema, then the description instructions for Common / above Common
+		std::string schema = "\nYour JSON schema should be:\n{\n";
+		const json fields = def.at("fields");
+		for (size_t i = 0; i < fields.size(); ++i) {
+			const std::string name = fields[i].at("name").get<std::string>();
+			schema += "  \"" + name + "\": " + (fields[i].value("list", false) ? "[\"...\", \"...\"]" : "\"...\"");
+			if (i + 1 < fields.size()) schema += ",";
+			if (fields[i].contains("hint")) schema += "    // " + fields[i]["hint"].get<std::string>();
+			schema += "\n";
+			if (fields[i].value("list", false)) lists_.push_back(name);
+		}
+		schema += "}\nPopulate only the fields after those prefilled above.\n";
+		const json desc = def.value("description", json::object());
+		const std::string mundane = desc.value("mundane", ""), magic = desc.value("magic", mundane);
+		description_[0] = mundane.empty() ? "" : mundane + "\n";
+		description_[1] = magic.empty()   ? "" : magic   + "\n";
+		tails_[0] = schema + description_[0];
+		tails_[1] = schema + description_[1];
+		const json required = def.value("required", json::array({"Name", "Description"}));
+		for (auto& f : required) required_.push_back(f.get<std::string>());
+
+		const json sample = def.value("sample", json::array());
+		for (auto& s : sample) {
+			Param p;
+			p.key = s.at("key").get<std::string>();
+			p.by  = s.value("by", "");
+			const json& values = s.at("values");
+			if (p.by.empty()) p.values[""] = values.get<std::vector<std::string>>();
+			else for (auto& [from, list] : values.items()) p.values[from] = list.get<std::vector<std::string>>();
+			params_.push_back(std::move(p));
+		}
+	}
+
+	const std::string& type()   const { return type_; }
+	const std::string& noun()   const { return noun_; }
+	double             weight() const { return weight_; }
+
+	// The "Description: ..." instructions, for Common or for magic items
+	const std::string& description(bool magic) const { return description_[magic]; }
+
+	// Request keys the prompt or sampler reads
+	std::vector<std::string> keys() const {
+		std::vector<std::string> out;
+		for (auto& l : lines_)   out.push_back(l.key);
+		for (auto& p : params_)  out.push_back(p.key);
+		for (auto& n : nameBase_) if (!n.second.empty()) out.push_back(n.second);
+		return out;
+	}
+
+	// The whole generation prompt; `name` is promptName(in)
+	std::string prompt(const json& in, const std::string& name) const {
+		std::string p;
+		p.reserve(head_.size() + tails_[1].size() + 256);
+		p += head_;
+		if (!name.empty()) p += " called " + name;
+		p += " with these parameters:\n";
+		for (auto& l : lines_) {
+			std::string v = in.value(l.key, "");
+			if (v.empty()) continue;
+			auto m = l.map.find(v);
+			p += l.prefix;
+			p += m != l.map.end() ? m->second : l.otherwise.empty() ? v : l.otherwise;
+			p += '\n';
+		}
+		std::string extra = in.value("description", "");
+		if (!extra.empty()) p += "\nAdditional Details: " + extra + "\n";
+		p += tails_[in.value("rarity", "") != "Common"];
+		return p;
+	}
+
+	// Required fields are non-empty, list fields are arrays (a string is
+	// split on commas); false rejects the response
+	bool validate(json& out) const {
+		if (!out.is_object()) return false;
+		for (auto& f : required_) {
+			auto it = out.find(f);
+			if (it == out.end() || it->is_null() || (it->is_string() && it->get<std::string>().empty())) return false;
+		}
+		for (auto& f : lists_) {
+			auto it = out.find(f);
+			if (it == out.end() || it->is_array()) continue;
+			if (!it->is_string()) return false;
+			json list = json::array();
+			std::stringstream ss(it->get<std::string>());
+			for (std::string part; std::getline(ss, part, ','); )
+				if (!trim(part).empty()) list.push_back(trim(part));
+			*it = list;
+		}
+		return true;
+	}
+
+	// Random request parameters of this type
+	json sample(std::mt19937_64& gen) const {
+		json in = {{"type", type_}, {"rarity", rarities_[std::uniform_int_distribution<size_t>(0, rarities_.size() - 1)(gen)]}, {"name", ""}};
+		for (auto& p : params_) {
+			auto it = p.values.find(p.by.empty() ? "" : in.value(p.by, ""));
+			if (it == p.values.end() || it->second.empty()) continue;
+			in[p.key] = it->second[std::uniform_int_distribution<size_t>(0, it->second.size() - 1)(gen)];
+		}
+		return in;
+	}
+
+	// What local names are built on: "Potion of Healing", else the noun
+	std::string baseName(const json& in) const {
+		std::string out;
+		for (auto& [literal, key] : nameBase_) {
+			out += literal;
+			if (key.empty()) continue;
+			std::string v = in.value(key, "");
+			if (v.empty()) return noun_;
+			out += v;
+		}
+		return out.empty() ? noun_ : out;
+	}
+
+private:
+	struct Line {                   // "  <label>: <value>", or its mapping
+		std::string key, prefix, otherwise;
+		std::unordered_map<std::string, std::string> map;
+	};
+	struct Param {                  // one sampled parameter; values by the "by" key's value
+		std::string key, by;
+		std::unordered_map<std::string, std::vector<std::string>> values;
+	};
+
+	std::string                                      type_, noun_, head_;
+	std::string                                      tails_[2];   // Common, above Common
+	std::string                                      description_[2];
+	double                                           weight_ = 1;
+	std::vector<std::string>                         rarities_, required_, lists_;
+	std::vector<std::pair<std::string, std::string>> nameBase_;   // literal, then key
+	std::vector<Line>                                lines_;
+	std::vector<Param>                               params_;
+};
+
+class ItemTypes {
+public:
+	// Built-ins, then ITEM_TYPES_DIR; a file that doesn't compile is skipped
+	ItemTypes() {
+		for (auto& def : json::parse(BUILTIN_ITEM_TYPES)) add(def);
+		const char* d = std::getenv("ITEM_TYPES_DIR");
+		std::filesystem::path dir = d ? d : "item_types";
+		std::error_code ec;
+		std::vector<std::filesystem::path> files;
+		for (auto& e : std::filesystem::directory_iterator(dir, ec))
+			if (e.path().extension() == ".json") files.push_back(e.path());
+		std::sort(files.begin(), files.end());
+		for (auto& f : files) {
+			try { add(loadJSON(f.string())); }
+			catch (const std::exception& e) { std::cerr << "Item type " << f << " skipped: " << e.what() << "\n"; }
+		}
+
+		std::set<std::string> keys{"name", "type", "rarity", "description"};
+		double total = 0;
+		for (auto& t : order_) {
+			for (auto& k : t->keys()) keys.insert(k);
+			if (t->weight() <= 0) continue;
+			total += t->weight();
+			sampled_.push_back(t.get());
+			cumulative_.push_back(total);
+		}
+		keys_.assign(keys.begin(), keys.end());
+		fallback_ = byType_.at(fallbackType_).get();
+		if (sampled_.empty()) throw std::runtime_error("No item type has a random weight");
+	}
+
+	// The definition for a request's "type", or the fallback one
+	const ItemType& of(const std::string& type) const {
+		auto it = byType_.find(type);
+		return it != byType_.end() ? *it->second : *fallback_;
+	}
+	bool known(const std::string& type) const { return byType_.count(type) > 0; }
+
+	// Random parameters across types, by weight
+	json sample(std::mt19937_64& gen) const {
+		double r = std::uniform_real_distribution<>(0, cumulative_.back())(gen);
+		size_t i = std::upper_bound(cumulative_.begin(), cumulative_.end(), r) - cumulative_.begin();
+		return sampled_[std::min(i, sampled_.size() - 1)]->sample(gen);
+	}
+
+	// Every request parameter some type reads
+	const std::vector<std::string>& requestKeys() const { return keys_; }
+
+	std::vector<std::string> names() const {
+		std::vector<std::string> out;
+		for (auto& t : order_) out.push_back(t->type());
+		return out;
+	}
+
+private:
+	void add(const json& def) {
+		auto t = std::make_shared<const ItemType>(def);
+		auto it = byType_.find(t->type());
+		if (it != byType_.end())
+			std::replace(order_.begin(), order_.end(), it->second, t);
+		else
+			order_.push_back(t);
+		byType_[t->type()] = t;
+		if (def.value("fallback", false) || fallbackType_.empty()) fallbackType_ = t->type();
+	}
+
+	std::vector<std::shared_ptr<const ItemType>>                       order_;
+	std::unordered_map<std::string, std::shared_ptr<const ItemType>> byType_;
+	std::string                                                       fallbackType_;
+	const ItemType*                                                   fallback_ = nullptr;
+	std::vector<const ItemType*>                                      sampled_;
+	std::vector<double>                                               cumulative_;
+	std::vector<std::string>                                          keys_;
+};
+
+// Compiled on first use; main() calls it at startup
+static const ItemTypes& itemTypes() {
+	static const ItemTypes types;
+	return types;
+}
+
+// ————————————————————————————————————————————————
+// Local names: a character trigram model per naming tradition, trained once
+// on first use from the small corpora below, so a name costs microseconds
+// instead of model tokens. Tabaxi and kenku use descriptive names, which
+// come from a phrase grammar instead.
+
+template<class T, size_t N>
+static const T& pickOne(const T (&arr)[N], std::mt19937_64& gen) {
+	return arr[std::uniform_int_distribution<size_t>(0, N - 1)(gen)];
+}
+
+struct NameCorpus {
+	const char* style;
+	const char* names;   // lowercase, space-separated; "head+tail" marks a compound
+};
+
+static const NameCorpus NAME_CORPORA[] = {
+	{"human",         "aldric bryn cedric dorian elara fenna gareth helena isolde jorah kaelen lysa marek nessa "
+					  "orin petra quentin rowan selene tamsin ulric vera wendell yara zora brannoc hilde osric mira "
+					  "tovin garrick emeric adela corwin maren tobias edda rolan sabine"},
+	{"human-family",  "ashgrove tull vell hask marr fenn holm crane rook hale brightwater harrow blackwood thatcher "
+					  "miller cooper greaves longfield underhill westbrook dunmore carrow pellam stroud wyndham"},
+	{"dwarf",         "agnar baldrim borin brundar dolgrin durnik eskil fundin gorrim grimbald haldor kazrik korda "
+					  "morgrun nalda orla rurik skaldra sigrun thrain tordis ulfgar vorna yrsa brisa dagny helgrid "
+					  "hjalma bruni"},
+	{"dwarf-clan",    "anvil+born battle+crag copper+vein deep+delve ember+forge frost+beard gold+hand iron+mantle "
+					  "stone+foot granite+brow hammer+fall bronze+holt ore+beard flint+heart deep+mark cinder+axe"},
+	{"elf",           "aerendil caelith elandor faelyn galinor ilyndra laethis maerith naelis orithel quelenna "
+					  "rilaen saerith thalion vaelis yllandra aeris lirael seraphel nimriel thaelor cyrandil elowen "
+					  "iriel faerond"},
+	{"elf-family",    "moon+whisper silver+frond dawn+leaf star+bloom night+breeze gold+petal mist+walker thorn+wood "
+					  "bright+bough dusk+mantle wind+song leaf+shadow"},
+	{"halfling",      "bramble cora dunstan elsie finnick perrin posy tobin wendel bertie cobb dilly lavender "
+					  "marlo nib oswin poppy rollo tansy tilly wilmer hobb daisy jory milo"},
+	{"halfling-family","apple+brook barley+corn bramble+foot cobble+stone fern+whistle hearth+stone honey+pot "
+					  "kettle+whistle meadow+sweet puddle+foot quick+step tumble+wood"},
+	{"gnome",         "bimble dabbin fizwick gimbal nackle orryn pock quillo rimble sprocket wizzle zook bixi "
+					  "carlin ellibet fonkin nissa tibbet wrenna zanna"},
+	{"gnome-clan",    "cogs+worth copper+kettle fiddle+wick gear+spring glimmer+stone nackle+burr quick+gear "
+					  "spark+whistle tinker+top wobble+cog"},
+	{"deep-gnome",    "brindlenod durthin gorrik kelbren nebbin skrig tarbek urdle vorsk zibbit grelda kranna "
+					  "mossra dulvik"},
+	{"orc",           "azgul brogath dursh gharn grulk hagra kruul mogra narzug orgash rakka shagra thrak ughra "
+					  "urzog vashka yarg zugrash borka gulra"},
+	{"dragonborn",    "arkhesh balvaar dravos ghesmir jhaazar korrinth mazhar nyzara orrhan quarrith rhazzar "
+					  "sorvith tazhiel vharran zorrath kalithra"},
+	{"dragonborn-clan","kharvethal ossindrar vorthenix zarrakhon ulmarrith tessarrin yzarvath drakkaris "
+					  "myrrathen ghorvaxis"},
+	{"tiefling",      "azrakel belith caldrax damaris ezrael hexen kallista malachar nyx orrias rhazael sabriel "
+					  "vexis zarophel ishra lucan morvessa"},
+	{"goblinoid",     "brakk drogg grish hruk klagg murg nagg rukk skarl trogg vrak zogg brugga krezz"},
+	{"genasi",        "brisa caelum ember flint gale ignatius kaiden marisol nimbus pyra rill sorrel talus tempest "
+					  "vesper zephyra cinder coral"},
+	{"centaur",       "arkadios chirenna demios eurythos helikon ismene kallias melanthe phaedros rhodeia sthenos "
+					  "thalassa xanthos zephyrine doreion"},
+	{"changeling",    "aru bin cas dox enn fie gal hox ixi jin kas lam mox nin ovi paz rix sim tav"},
+	{"fairy",         "briar dewdrop fennel hollyhock juniper lumen marigold nettle pipwick quill rosalind sorrel "
+					  "thistle twig willow zinnia"},
+	{"firbolg",       "bramwyn caolan dairmid eithne fionn gormla kiaran lorcan mairead niamh oisin rhiannon tadhg "
+					  "una"},
+	{"gith",          "ak'zir belthrek chryssa dhal'vor enkrith gyzrah jhestra k'vaal lath'ri mirrak nazzeth orryx "
+					  "quoor rhazz t'kaal vezrith zhenn"},
+	{"goliath",       "aruk belak dhanna eglath gurok kanna mauth nalla orak paavu thalai uthal vimak"},
+	{"harengon",      "clover hopwell fennick juniper marram nettle pip quickfoot rosehip sorrel thistle tumble "
+					  "wisp barley"},
+	{"kobold",        "arix dakk gix irrk kobb mik nixx pok rizz skek tikk vex yip zarn"},
+	{"lizardfolk",    "ashkar ghessa ikaris jhurr korrash mazsk ossk rhassk sathuk thessk uzzar vresh zhakk"},
+	{"minotaur",      "asterion baraxos dorgath gorrun kharnos mogran orrak taurvos thraxus vorgan arkhos"},
+	{"satyr",         "dionel faunis lyrias merrin orphe pell silvan tibo vyrdan xyros"},
+	{"shadar-kai",    "aervyn cael morwen nythrel saevis vaelith ilvash drovaen sorrowyn umbrel"},
+	{"shifter",       "ash brindle dusk ember fallow grizzle hollow marrow rook scratch sable thorn whisker"},
+	{"tortle",        "bako dumu gorra inli jopa kurru lomo nibu olok pemma quabbo sullo tumo ubba wokko yappa"},
+	{"triton",        "corran delphis maelis nereon oshara pelagos sereth thalon ulessa vaelor zyrra"},
+	{"yuan-ti",       "azhessa ixith jeshtal kazhir nesseth ophira sszeth vash'ti xhanara zyssith"},
+	{"aarakocra",     "aera akkra hirri kiirra kreeth qeela rrikk skree tikki whiiro zhiir cahli"},
+};
+
+// Given-name style and family-name style (nullptr for none) per race
+struct RaceNames { const char* race; const char* given; const char* family; };
+static constexpr RaceNames RACE_NAMES[] = {
+	{"Aarakocra", "aarakocra", nullptr},       {"Aasimar", "human", "human-family"},
+	{"Air Genasi", "genasi", nullptr},         {"Bugbear", "goblinoid", nullptr},
+	{"Centaur", "centaur", nullptr},           {"Changeling", "changeling", nullptr},
+	{"Deep Gnome", "deep-gnome", nullptr},     {"Duergar", "dwarf", "dwarf-clan"},
+	{"Dragonborn", "dragonborn", "dragonborn-clan"}, {"Dwarf", "dwarf", "dwarf-clan"},
+	{"Earth Genasi", "genasi", nullptr},       {"Eladrin", "elf", "elf-family"},
+	{"Elf", "elf", "elf-family"},              {"Fairy", "fairy", nullptr},
+	{"Firbolg", "firbolg", nullptr},           {"Fire Genasi", "genasi", nullptr},
+	{"Githyanki", "gith", nullptr},            {"Githzerai", "gith", nullptr},
+	{"Gnome", "gnome", "gnome-clan"},          {"Goliath", "goliath", nullptr},
+	{"Half-Elf", "elf", "human-family"},       {"Halfling", "halfling", "halfling-family"},
+	{"Half-Orc", "orc", "human-family"},       {"Harengon", "harengon", nullptr},
+	{"Hobgoblin", "goblinoid", nullptr},       {"Human", "human", "human-family"},
+	{"Kenku", nullptr, nullptr},               {"Kobold", "kobold", nullptr},
+	{"Lizardfolk", "lizardfolk", nullptr},     {"Minotaur", "minotaur", nullptr},
+	{"Orc", "orc", nullptr},                   {"Satyr", "satyr", nullptr},
+	{"Sea Elf", "elf", "elf-family"},          {"Shadar-kai", "shadar-kai", nullptr},
+	{"Shifter", "shifter", nullptr},           {"Tabaxi", nullptr, nullptr},
+	{"Tiefling", "tiefling", "human-family"},  {"Tortle", "tortle", nullptr},
+	{"Triton", "triton", nullptr},             {"Water Genasi", "genasi", nullptr},
+	{"Yuan-ti", "yuan-ti", nullptr},
+};
+
+// Order-2 character Markov model over one corpus; names it was trained on
+// are not generated back. A corpus of compounds ("iron+mantle") instead
+// recombines heads and tails, which reads better than letter chains.
+class MarkovNames {
+public:
+	explicit MarkovNames(const char* corpus) {
+		std::istringstream ss(corpus);
+		std::string w;
+		while (ss >> w) {
+			auto plus = w.find('+');
+			if (plus != std::string::npos) {
+				heads_.push_back(w.substr(0, plus));
+				tails_.push_back(w.substr(plus + 1));
+				w.erase(plus, 1);
+			}
+			seen_.insert(w);
+			minLen_ = std::min(minLen_, w.size());
+			maxLen_ = std::max(maxLen_, w.size());
+			std::string s = "^^" + w + "$";
+			for (size_t i = 2; i < s.size(); ++i) {
+				auto& next = next_[s.substr(i - 2, 2)];
+				auto it = std::find_if(next.begin(), next.end(), [&](auto& p) { return p.first == s[i]; });
+				if (it == next.end()) next.push_back({s[i], 1});
+				else it->second++;
+			}
+		}
+	}
+
+	std::string generate(std::mt19937_64& gen) const {
+		if (!heads_.empty()) {
+			std::uniform_int_distribution<size_t> pick(0, heads_.size() - 1);
+			size_t h = pick(gen), t = pick(gen);
+			if (h == t) t = (t + 1) % tails_.size();
+			return capitalized(heads_[h] + tails_[t]);
+		}
+		for (int attempt = 0; attempt < 24; ++attempt) {
+			std::string w = "^^";
+			while (w.size() < maxLen_ + 4) {
+				auto& next = next_.at(w.substr(w.size() - 2));
+				int total = 0;
+				for (auto& p : next) total += p.second;
+				int r = std::uniform_int_distribution<>(1, total)(gen);
+				char c = '$';
+				for (auto& p : next) if ((r -= p.second) <= 0) { c = p.first; break; }
+				if (c == '$') break;
+				w.push_back(c);
+			}
+			w = w.substr(2);
+			if (w.size() >= std::max<size_t>(3, minLen_) && w.size() <= maxLen_ + 1 && !seen_.count(w) && speakable(w))
+				return capitalized(w);
+		}
+		// Tiny corpora can run out of new names; reuse a real one
+		auto it = seen_.begin();
+		std::advance(it, std::uniform_int_distribution<size_t>(0, seen_.size() - 1)(gen));
+		return capitalized(*it);
+	}
+
+private:
+	// No leading consonant cluster of three, none of four anywhere
+	static bool speakable(const std::string& w) {
+		int run = 0;
+		for (size_t i = 0; i < w.size(); ++i) {
+			bool consonant = std::isalpha((unsigned char)w[i]) && !std::strchr("aeiouy", w[i]);
+			run = consonant ? run + 1 : 0;
+			if (run >= 4 || (run == 3 && i == 2)) return false;
+		}
+		return true;
+	}
+
+	static std::string capitalized(std::string w) {
+		for (size_t i = 0; i < w.size(); ++i)
+			if (i == 0 || w[i - 1] == '-' || w[i - 1] == ' ') w[i] = (char)std::toupper((unsigned char)w[i]);
+		return w;
+	}
+
+	std::map<std::string, std::vector<std::pair<char, int>>> next_;
+	std::set<std::string>                                    seen_;
+	std::vector<std::string>                                 heads_, tails_;
+	size_t minLen_ = SIZE_MAX, maxLen_ = 0;
+};
+
+static const MarkovNames& nameModel(const std::string& style) {
+	static const std::map<std::string, MarkovNames> models = [] {
+		std::map<std::string, MarkovNames> m;
+		for (auto& c : NAME_CORPORA) m.emplace(c.style, MarkovNames(c.names));
+		return m;
+	}();
+	return models.at(style);
+}
+
+// "Smoke on the River", "Five Timber"
+static std::string tabaxiName(std::mt19937_64& gen) {
+	static const char* const firsts[] = {"Cloud", "Smoke", "Rain", "Jade", "Ember", "Moss", "Thistle", "Copper",
+										 "Lantern", "Ink", "Salt", "Feather", "Silk", "Bramble"};
+	static const char* const places[] = {"on the Mountaintop", "in the Rain", "beneath the Bridge", "over the Marsh",
+										 "by the River", "in the Canopy", "on the Dunes", "under the Moon"};
+	static const char* const counts[] = {"Two", "Three", "Five", "Seven", "Nine"};
+	static const char* const things[] = {"Timber", "Bells", "Stones", "Lanterns", "Rivers", "Shoes", "Knots"};
+	if (std::uniform_int_distribution<>(0, 2)(gen) == 0)
+		return std::string(pickOne(counts, gen)) + " " + pickOne(things, gen);
+	return std::string(pickOne(firsts, gen)) + " " + pickOne(places, gen);
+}
+
+// Kenku go by sounds they can mimic
+static std::string kenkuName(std::mt19937_64& gen) {
+	static const char* const sounds[] = {"Rattle", "Clatter", "Creak", "Chime", "Scrape", "Snap", "Tock", "Hiss",
+										 "Thump", "Squeak", "Knock", "Rustle", "Whistle", "Clink", "Splash"};
+	static const char* const actions[] = {"Rattling", "Creaking", "Clinking", "Whistling", "Dripping", "Tapping"};
+	static const char* const sources[] = {"Door", "Chain", "Kettle", "Bell", "Hinge", "Coin", "Wheel", "Shutter"};
+	if (std::uniform_int_distribution<>(0, 1)(gen))
+		return std::string(pickOne(sounds, gen));
+	return std::string(pickOne(actions, gen)) + " " + pickOne(sources, gen);
+}
+
+// A name in the race's tradition, with a family name where it has one
+static std::string localPersonName(const std::string& race, std::mt19937_64& gen) {
+	if (race == "Tabaxi") return tabaxiName(gen);
+	if (race == "Kenku")  return kenkuName(gen);
+	static const RaceNames human{"Human", "human", "human-family"};
+	const RaceNames* r = &human;
+	for (auto& e : RACE_NAMES) if (race == e.race && e.given) r = &e;
+	std::string name = nameModel(r->given).generate(gen);
+	if (r->family) name += " " + nameModel(r->family).generate(gen);
+	return name;
+}
+
+// ————————————————————————————————————————————————
+// Procedural gear: Common items assembled from the SRD equipment tables plus
+// a small name/description grammar, with no model call. A routing rule picks
+// it per type, rarity and route with "provider": "procedural"; requests it
+// cannot serve (a free-text description, an unknown subtype) go to the rule's
+// fallback instead.
+
+struct SrdWeapon {
+	const char* name;
+	const char* handedness;   // grouped as in randomGearParams
+	int         costCp;
+	const char* damageDice;
+	const char* damageType;
+	double      weight;       // lb.
+	const char* properties;   // '|'-separated
+};
+
+static constexpr SrdWeapon SRD_WEAPONS[] = {
+	{"Club",           "Single-Handed",     10, "1d4",  "Bludgeoning",  2,   "Light"},
+	{"Dagger",         "Single-Handed",    200, "1d4",  "Piercing",     1,   "Finesse|Light|Thrown (range 20/60)"},
+	{"Dart",           "Single-Handed",      5, "1d4",  "Piercing",     0.25,"Finesse|Thrown (range 20/60)"},
+	{"Flail",          "Single-Handed",   1000, "1d8",  "Bludgeoning",  2,   ""},
+	{"Hand Crossbow",  "Single-Handed",   7500, "1d6",  "Piercing",     3,   "Ammunition (range 30/120)|Light|Loading"},
+	{"Handaxe",        "Single-Handed",    500, "1d6",  "Slashing",     2,   "Light|Thrown (range 20/60)"},
+	{"Javelin",        "Single-Handed",     50, "1d6",  "Piercing",     2,   "Thrown (range 30/120)"},
+	{"Light Hammer",   "Single-Handed",    200, "1d4",  "Bludgeoning",  2,   "Light|Thrown (range 20/60)"},
+	{"Mace",           "Single-Handed",    500, "1d6",  "Bludgeoning",  4,   ""},
+	{"Morningstar",    "Single-Handed",   1500, "1d8",  "Piercing",     4,   ""},
+	{"Rapier",         "Single-Handed",   2500, "1d8",  "Piercing",     2,   "Finesse"},
+	{"Scimitar",       "Single-Handed",   2500, "1d6",  "Slashing",     3,   "Finesse|Light"},
+	{"Sickle",         "Single-Handed",    100, "1d4",  "Slashing",     2,   "Light"},
+	{"Shortsword",     "Single-Handed",   1000, "1d6",  "Piercing",     2,   "Finesse|Light"},
+	{"Sling",          "Single-Handed",     10, "1d4",  "Bludgeoning",  0,   "Ammunition (range 30/120)"},
+	{"War Pick",       "Single-Handed",    500, "1d8",  "Piercing",     2,   ""},
+	{"Whip",           "Single-Handed",    200, "1d4",  "Slashing",     3,   "Finesse|Reach"},
+	{"Battleaxe",      "Two-Handed",      1000, "1d8",  "Slashing",     4,   "Versatile (1d10)"},
+	{"Glaive",         "Two-Handed",      2000, "1d10", "Slashing",     6,   "Heavy|Reach|Two-Handed"},
+	{"Greataxe",       "Two-Handed",      3000, "1d12", "Slashing",     7,   "Heavy|Two-Handed"},
+	{"Greatsword",     "Two-Handed",      5000, "2d6",  "Slashing",     6,   "Heavy|Two-Handed"},
+	{"Halberd",        "Two-Handed",      2000, "1d10", "Slashing",     6,   "Heavy|Reach|Two-Handed"},
+	{"Heavy Crossbow", "Two-Handed",      5000, "1d10", "Piercing",    18,   "Ammunition (range 100/400)|Heavy|Loading|Two-Handed"},
+	{"Light Crossbow", "Two-Handed",      2500, "1d8",  "Piercing",     5,   "Ammunition (range 80/320)|Loading|Two-Handed"},
+	{"Longbow",        "Two-Handed",      5000, "1d8",  "Piercing",     2,   "Ammunition (range 150/600)|Heavy|Two-Handed"},
+	{"Longsword",      "Two-Handed",      1500, "1d8",  "Slashing",     3,   "Versatile (1d10)"},
+	{"Maul",           "Two-Handed",      1000, "2d6",  "Bludgeoning", 10,   "Heavy|Two-Handed"},
+	{"Pike",           "Two-Handed",       500, "1d10", "Piercing",    18,   "Heavy|Reach|Two-Handed"},
+	{"Quarterstaff",   "Two-Handed",        20, "1d6",  "Bludgeoning",  4,   "Versatile (1d8)"},
+	{"Shortbow",       "Two-Handed",      2500, "1d6",  "Piercing",     2,   "Ammunition (range 80/320)|Two-Handed"},
+	{"Spear",          "Two-Handed",       100, "1d6",  "Piercing",     3,   "Thrown (range 20/60)|Versatile (1d8)"},
+	{"Trident",        "Two-Handed",       500, "1d6",  "Piercing",     4,   "Thrown (range 20/60)|Versatile (1d8)"},
+	{"Warhammer",      "Two-Handed",      1500, "1d8",  "Bludgeoning",  2,   "Versatile (1d10)"},
+};
+
+struct SrdArmor {
+	const char* name;
+	const char* category;     // Light, Medium, Heavy, Shield, Clothes
+	const char* material;     // names the other pieces of a set
+	int         costCp;
+	const char* armorClass;
+	bool        stealthDisadvantage;
+	double      weight;       // lb.
+	const char* properties;   // '|'-separated
+};
+
+static constexpr SrdArmor SRD_ARMOR[] = {
+	{"Padded Armor",          "Light",   "Padded",          500,    "11 + Dex modifier",         true,  8,  ""},
+	{"Leather Armor",         "Light",   "Leather",        1000,    "11 + Dex modifier",         false, 10, ""},
+	{"Studded Leather Armor", "Light",   "Studded Leather", 4500,   "12 + Dex modifier",         false, 13, ""},
+	{"Hide Armor",            "Medium",  "Hide",           1000,    "12 + Dex modifier (max 2)", false, 12, ""},
+	{"Chain Shirt",           "Medium",  "Chain",          5000,    "13 + Dex modifier (max 2)", false, 20, ""},
+	{"Scale Mail",            "Medium",  "Scale",          5000,    "14 + Dex modifier (max 2)", true,  45, ""},
+	{"Breastplate",           "Medium",  "Steel",          40000,   "14 + Dex modifier (max 2)", false, 20, ""},
+	{"Half Plate",            "Medium",  "Half-Plate",     75000,   "15 + Dex modifier (max 2)", true,  40, ""},
+	{"Ring Mail",             "Heavy",   "Ringed",         3000,    "14",                        true,  40, ""},
+	{"Chain Mail",            "Heavy",   "Chain",          7500,    "16",                        true,  55, "Strength 13"},
+	{"Splint Armor",          "Heavy",   "Splinted",       20000,   "17",                        true,  60, "Strength 15"},
+	{"Plate Armor",           "Heavy",   "Plate",          150000,  "18",                        true,  65, "Strength 15"},
+	{"Shield",                "Shield",  "Wooden",         1000,    "+2",                        false, 6,  ""},
+	{"Common Clothes",        "Clothes", "Homespun",        50,     "N/A",                       false, 3,  ""},
+	{"Traveler's Clothes",    "Clothes", "Traveler's",     200,     "N/A",                       false, 4,  ""},
+	{"Costume Clothes",       "Clothes", "Costume",        500,     "N/A",                       false, 4,  ""},
+	{"Fine Clothes",          "Clothes", "Fine",           1500,    "N/A",                       false, 6,  ""},
+};
+
+// Share of a body armor's cost and weight that one other piece of the set takes
+struct SetPiece { const char* piece; double share; };
+static constexpr SetPiece SET_PIECES[] = {
+	{"Helmet", 0.10}, {"Gauntlets", 0.05}, {"Boots", 0.10}, {"Cloak", 0.08}, {"Hat", 0.05},
+};
+
+// Case-insensitive, ignoring a plural "s" ("Hand Crossbows", "Spears")
+static bool srdNameMatches(const char* srd, const std::string& want) {
+	std::string a = srd, b = want;
+	for (auto& c : a) c = (char)std::tolower((unsigned char)c);
+	for (auto& c : b) c = (char)std::tolower((unsigned char)c);
+	if (b.size() > 1 && b.back() == 's' && b != a) b.pop_back();
+	return a == b;
+}
+
+static const SrdWeapon* findSrdWeapon(const std::string& subtype) {
+	std::string want = srdNameMatches("Quarterstave", subtype) ? "Quarterstaff" : subtype;
+	for (auto& w : SRD_WEAPONS) if (srdNameMatches(w.name, want)) return &w;
+	return nullptr;
+}
+
+static std::vector<std::string> splitProperties(const char* props) {
+	std::vector<std::string> out;
+	std::string cur;
+	for (const char* p = props; *p; ++p) {
+		if (*p == '|') { out.push_back(cur); cur.clear(); }
+		else cur.push_back(*p);
+	}
+	if (!cur.empty()) out.push_back(cur);
+	return out;
+}
+
+// 200 -> "2 gp", 50 -> "5 sp", 5 -> "5 cp"
+static std::string formatCost(int cp) {
+	if (cp >= 100 && cp % 100 == 0) return std::to_string(cp / 100) + " gp";
+	if (cp >= 10  && cp % 10 == 0)  return std::to_string(cp / 10) + " sp";
+	return std::to_string(cp) + " cp";
+}
+
+// Rounded to the half pound, at least 1/2 lb.: "1/2 lb.", "1 1/2 lbs.", "3 lbs."
+static std::string formatWeight(double lb) {
+	int halves = std::max(1, (int)std::lround(lb * 2));
+	std::string num = halves / 2 ? std::to_string(halves / 2) : "";
+	if (halves % 2) num += num.empty() ? "1/2" : " 1/2";
+	return num + (halves <= 2 ? " lb." : " lbs.");
+}
+
+// SRD armor of a category, in table order
+static std::vector<const SrdArmor*> srdArmorFor(const std::string& category) {
+	std::vector<const SrdArmor*> out;
+	for (auto& a : SRD_ARMOR) if (category == a.category) out.push_back(&a);
+	return out;
+}
+
+// The set piece a request names, nullptr for the body piece (Chestplate, no
+// piece, or a shield); false when the tables do not know the piece
+static bool findSetPiece(const std::string& category, const std::string& clothingPiece, const SetPiece*& piece) {
+	piece = nullptr;
+	if (category == "Shield" || clothingPiece.empty() || clothingPiece == "Chestplate") return true;
+	for (auto& p : SET_PIECES) if (clothingPiece == p.piece) piece = &p;
+	return piece != nullptr;
+}
+
+// Mechanics the SRD fixes for a weapon; Cost is the mundane price
+static json srdWeaponStats(const SrdWeapon& w) {
+	return {
+		{"Cost",       formatCost(w.costCp)},
+		{"DamageDice", w.damageDice},
+		{"DamageType", w.damageType},
+		{"Weight",     formatWeight(w.weight)},
+		{"Properties", splitProperties(w.properties)}
+	};
+}
+
+static int srdArmorCostCp(const SrdArmor& a, const SetPiece* piece) {
+	return piece ? std::max(1, (int)std::lround(a.costCp * piece->share)) : a.costCp;
+}
+
+// Mechanics of a body armor, or of another piece of its set: those are priced
+// and weighed as a share of the body piece and add no Armor Class of their own
+static json srdArmorStats(const SrdArmor& a, const SetPiece* piece, const std::string& clothingPiece) {
+	std::vector<std::string> props = splitProperties(a.properties);
+	if (piece) props = {std::string("Part of a set of ") + a.name};
+	if (a.stealthDisadvantage && !piece) props.push_back("Disadvantage on Stealth checks");
+	std::string category = a.category;
+	return {
+		{"Base",                a.name},
+		{"Piece",               piece ? piece->piece : category == "Shield" ? "Shield" : clothingPiece.empty() ? "Chestplate" : clothingPiece},
+		{"Category",            category},
+		{"ArmorClass",          piece ? "N/A" : a.armorClass},
+		{"StealthDisadvantage", a.stealthDisadvantage && !piece ? "Yes" : "No"},
+		{"Weight",              formatWeight(piece ? a.weight * piece->share : a.weight)},
+		{"Cost",                formatCost(srdArmorCostCp(a, piece))},
+		{"Properties",          props}
+	};
+}
+
+// DMG magic item price bands in gp; Common items sell at their mundane price
+struct PriceBand { const char* rarity; int lo, hi; };
+static constexpr PriceBand MAGIC_PRICE_BANDS[] = {
+	{"Uncommon", 101, 500}, {"Rare", 501, 5000}, {"Very Rare", 5001, 50000},
+	{"Legendary", 50001, 250000}, {"Artifact", 250001, 1000000},
+};
+
+// Log-uniform within the rarity's band, to two significant digits; 0 for Common
+static int magicPriceGp(const std::string& rarity, std::mt19937_64& gen) {
+	for (auto& b : MAGIC_PRICE_BANDS) {
+		if (rarity != b.rarity) continue;
+		double gp = std::exp(std::uniform_real_distribution<double>(std::log(b.lo), std::log(b.hi))(gen));
+		double step = std::pow(10.0, std::floor(std::log10(gp)) - 1);
+		return std::clamp((int)(std::round(gp / step) * step), b.lo, b.hi);
+	}
+	return 0;
+}
+
+static const char* const PROC_ADJECTIVES[] = {
+	"Notched", "Riveted", "Well-Worn", "Plain", "Sturdy", "Blackened", "Polished", "Travel-Worn",
+	"Hand-Forged", "Weathered", "Patched", "Oiled", "Serviceable", "Scuffed", "Old"
+};
+static const char* const PROC_OWNERS[] = {
+	"Soldier's", "Watchman's", "Hunter's", "Drover's", "Militia", "Caravan", "Sellsword's",
+	"Ferryman's", "Miner's", "Pilgrim's", "Squire's", "Reeve's"
+};
+static const char* const PROC_PLACES[] = {
+	"Eastmarch", "the Copper Hills", "Greywater", "Hollowford", "the Border Keeps", "Stonebridge",
+	"Redfern", "the Saltmarsh", "Millbrook", "Westwatch", "Kettle Ford", "the River Towns"
+};
+static const char* const PROC_PURPOSES[] = {
+	"for the local militia", "as a journeyman's proof piece", "to settle a debt with a mercenary company",
+	"for caravan guards on the southern road", "in a season when the workshop took any order it could get",
+	"for a lord's household guard", "to outfit a band of frontier settlers", "for a traveling fair"
+};
+static const char* const PROC_WEAPON_TRAITS[] = {
+	"The grip is wrapped in waxed cord that stays sure in wet weather.",
+	"The balance sits close to the hand, quick to recover after a swing.",
+	"A maker's mark is stamped just below the grip, worn smooth by years of use.",
+	"Every edge and fitting has been cleaned and oiled by a careful owner.",
+	"A leather loop lets it hang from a belt without snagging.",
+	"Small nicks show honest use, but nothing that weakens the steel.",
+	"The work is plain and unadorned, easy for any village smith to repair."
+};
+static const char* const PROC_ARMOR_TRAITS[] = {
+	"The straps are newly replaced and adjust easily on the march.",
+	"The lining has been patched more than once, but the fit is still good.",
+	"A faded company badge is stitched inside, where only the wearer sees it.",
+	"The seams are double-stitched against hard travel.",
+	"Old repairs in slightly different materials show where blows have landed.",
+	"The inside is warm in the cold months and dries quickly after rain."
+};
+static const char* const PROC_JEWELRY_TRAITS[] = {
+	"The clasp is simple and strong, made to be worn every day.",
+	"The metal has a soft sheen from years against the skin.",
+	"A short inscription on the inside has been worn almost illegible.",
+	"Pieces like this are kept in a family for weddings and name-days.",
+	"The metalwork is modest but even, the mark of a steady hand.",
+	"A faint pawnbroker's scratch shows it was once pawned and redeemed."
+};
+
+struct JewelryMaterial { const char* name; int costCp; };
+static constexpr JewelryMaterial JEWELRY_MATERIALS[] = {
+	{"Copper", 200}, {"Brass", 300}, {"Bronze", 500}, {"Pewter", 500}, {"Silver", 1000}, {"Gold", 2500},
+};
+static const char* const JEWELRY_STONES[] = {
+	"quartz", "jasper", "onyx", "moonstone", "carnelian", "agate", "hematite", "turquoise"
+};
+static const char* const JEWELRY_TYPES[] = {
+	"Ring", "Amulet", "Necklace", "Bracelet", "Earrings", "Brooch", "Circlet", "Pendant"
+};
+
+// "<Adjective> <Base>", "<Owner> <Base>", "<Base> of <Place>" or "<Family name>'s <Base>"
+static std::string proceduralName(const std::string& base, std::mt19937_64& gen) {
+	switch (std::uniform_int_distribution<>(0, 3)(gen)) {
+	case 0:  return std::string(pickOne(PROC_ADJECTIVES, gen)) + " " + base;
+	case 1:  return std::string(pickOne(PROC_OWNERS, gen)) + " " + base;
+	case 2:  return base + " of " + pickOne(PROC_PLACES, gen);
+	default: return nameModel("human-family").generate(gen) + "'s " + base;
+	}
+}
+
+// One history sentence and one or two traits
+template<size_t N>
+static std::string proceduralDescription(const std::string& what,
+										 const char* const (&traits)[N],
+										 std::mt19937_64& gen)
+{
+	std::string lower = what;
+	for (auto& c : lower) c = (char)std::tolower((unsigned char)c);
+	std::ostringstream d;
+	d << localPersonName("Human", gen) << " of " << pickOne(PROC_PLACES, gen) << " made "
+	  << (lower.back() == 's' ? "these " : "this ") << lower << " " << pickOne(PROC_PURPOSES, gen) << ". ";
+	size_t a = std::uniform_int_distribution<size_t>(0, N - 1)(gen);
+	size_t b = std::uniform_int_distribution<size_t>(0, N - 2)(gen);
+	d << traits[a];
+	if (std::uniform_int_distribution<>(0, 1)(gen)) d << " " << traits[b >= a ? b + 1 : b];
+	return d.str();
+}
+
+// Build one item with the same schema the gear prompt asks the model for,
+// or null when the parameters are outside the tables
+static json proceduralGear(const json& in) {
+	static thread_local std::mt19937_64 gen{ std::random_device{}() };
+	const std::string name          = in.value("name", ""),
+					  kind          = in.value("type", ""),
+					  handedness    = in.value("handedness", ""),
+					  subtype       = in.value("subtype", ""),
+					  rarity        = in.value("rarity", "Common"),
+					  clothingPiece = in.value("clothingPiece", "");
+	if (!in.value("description", "").empty()) return nullptr;
+
+	json out;
+	if (kind == "Weapon") {
+		const SrdWeapon* w = nullptr;
+		if (!subtype.empty()) {
+			if (!(w = findSrdWeapon(subtype))) return nullptr;
+		} else {
+			std::vector<const SrdWeapon*> pool;
+			for (auto& e : SRD_WEAPONS)
+				if (handedness.empty() || handedness == e.handedness) pool.push_back(&e);
+			if (pool.empty()) return nullptr;
+			w = pool[std::uniform_int_distribution<size_t>(0, pool.size() - 1)(gen)];
+		}
+		out = srdWeaponStats(*w);
+		out["Name"]        = name.empty() ? proceduralName(w->name, gen) : name;
+		out["Category"]    = handedness.empty() ? w->handedness : handedness;
+		out["Type"]        = subtype.empty() ? w->name : subtype;
+		out["Rarity"]      = rarity;
+		out["Description"] = proceduralDescription(std::string(w->name), PROC_WEAPON_TRAITS, gen);
+	} else if (kind == "Armor") {
+		std::vector<const SrdArmor*> pool;
+		if (subtype.empty()) for (auto& e : SRD_ARMOR) pool.push_back(&e);
+		else pool = srdArmorFor(subtype);
+		if (pool.empty()) return nullptr;
+		const SrdArmor* a = pool[std::uniform_int_distribution<size_t>(0, pool.size() - 1)(gen)];
+		const SetPiece* piece;
+		if (!findSetPiece(a->category, clothingPiece, piece)) return nullptr;
+
+		std::string base = piece ? std::string(a->material) + " " + piece->piece : a->name;
+		out = srdArmorStats(*a, piece, clothingPiece);
+		out["Name"]        = name.empty() ? proceduralName(base, gen) : name;
+		out["Rarity"]      = rarity;
+		out["Attunement"]  = "No";
+		out["Description"] = proceduralDescription(base, PROC_ARMOR_TRAITS, gen);
+	} else if (itemTypes().of(kind).type() == "Jewelry") {   // and unknown types
+		std::string type = subtype.empty() ? pickOne(JEWELRY_TYPES, gen) : subtype;
+		const JewelryMaterial& m = pickOne(JEWELRY_MATERIALS, gen);
+		int cost = m.costCp;
+		std::string base = std::string(m.name) + " " + type;
+		std::string desc = proceduralDescription(base, PROC_JEWELRY_TRAITS, gen);
+		if (std::uniform_int_distribution<>(0, 2)(gen) == 0) {
+			desc += std::string(" A small polished ") + pickOne(JEWELRY_STONES, gen) + " is set into it.";
+			cost += 1000;
+		}
+		out = {
+			{"Name",        name.empty() ? proceduralName(base, gen) : name},
+			{"Type",        type},
+			{"Rarity",      rarity},
+			{"Cost",        formatCost(cost)},
+			{"Weight",      "1/2 lb."},
+			{"Description", desc}
+		};
+	} else {
+		return nullptr;   // data-defined types have no tables here
+	}
+	return out;
+}
+
+static const char* const EPIC_PREFIXES[] = {
+	"Storm", "Ember", "Frost", "Grave", "Dawn", "Dusk", "Iron", "Night", "Thorn", "Ash", "Wolf", "Raven",
+	"Gloom", "Sun", "Moon", "Stone", "Bright", "Oath", "Rune", "Wind", "Thunder", "Hollow", "Tide", "Cinder"
+};
+static const char* const EPIC_EPITHETS[] = {
+	"the Quiet Dawn", "the Last Watch", "the Broken Oath", "the Seventh Tide", "the Long Winter",
+	"the Burning Road", "the Hollow Crown", "the Silent Choir", "the First Snow", "the Drowned Bell",
+	"the Green Hunt", "the Ashen Vale", "Unmarked Graves", "Lost Harvests"
+};
+
+// Second half of a compound name ("Ember" + "fang"), by what the item is
+static const std::vector<const char*>& epicSuffixes(const std::string& kind, const std::string& base) {
+	static const std::vector<const char*> blades{"fang", "edge", "bite", "song", "tongue", "fall"};
+	static const std::vector<const char*> axes  {"cleaver", "reaver", "split", "hew", "bite"};
+	static const std::vector<const char*> blunt {"breaker", "maul", "fall", "knell", "crush"};
+	static const std::vector<const char*> poles {"reach", "thorn", "spire", "lance", "sting"};
+	static const std::vector<const char*> bows  {"string", "flight", "shot", "wing", "call"};
+	static const std::vector<const char*> armor {"guard", "ward", "mantle", "shell", "hide", "weave"};
+	static const std::vector<const char*> gems  {"heart", "eye", "tear", "knot", "star", "spark"};
+	std::string b = base;
+	for (auto& c : b) c = (char)std::tolower((unsigned char)c);
+	auto has = [&](std::initializer_list<const char*> words) {
+		for (auto* w : words) if (b.find(w) != std::string::npos) return true;
+		return false;
+	};
+	if (kind == "Armor")  return armor;
+	if (kind != "Weapon") return gems;
+	if (has({"bow", "sling", "dart", "blowgun"}))                         return bows;
+	if (has({"axe", "halberd", "glaive"}))                                return axes;
+	if (has({"spear", "pike", "trident", "javelin", "lance"}))            return poles;
+	if (has({"sword", "dagger", "rapier", "scimitar", "sickle", "whip"})) return blades;
+	return blunt;
+}
+
+// A local name for a gear request: mundane for Common, otherwise a compound
+// ("Emberfang"), an owner's ("Harrow's Tidebreaker") or an epithet
+// ("Longsword of the Last Watch")
+static std::string localItemName(const json& in, std::mt19937_64& gen) {
+	const std::string kind = in.value("type", ""), subtype = in.value("subtype", ""),
+					  piece = in.value("clothingPiece", "");
+	std::string base;
+	if (kind == "Weapon") {
+		const SrdWeapon* w = findSrdWeapon(subtype);
+		base = w ? w->name : subtype.empty() ? "Blade" : subtype;
+	} else if (kind == "Armor") {
+		base = subtype == "Shield" ? "Shield" : !piece.empty() && piece != "Chestplate" ? piece
+			 : subtype == "Clothes" ? "Garb" : "Armor";
+	} else {
+		base = itemTypes().of(kind).baseName(in);
+	}
+	if (in.value("rarity", "") == "Common") return proceduralName(base, gen);
+
+	auto& suffixes = epicSuffixes(kind, base);
+	std::string compound = std::string(pickOne(EPIC_PREFIXES, gen))
+						 + suffixes[std::uniform_int_distribution<size_t>(0, suffixes.size() - 1)(gen)];
+	switch (std::uniform_int_distribution<>(0, 2)(gen)) {
+	case 0:  return compound;
+	case 1:  return nameModel("human-family").generate(gen) + "'s " + compound;
+	default: return base + " of " + pickOne(EPIC_EPITHETS, gen);
+	}
+}
+
+// How a prompt names the item or shopkeeper: the request's own name, or
+// the locally generated "nameChoices" for the model to pick from
+static std::string promptName(const json& in) {
+	std::string name = in.value("name", "");
+	if (!name.empty()) return "\"" + name + "\"";
+	if (!in.contains("nameChoices") || !in["nameChoices"].is_array() || in["nameChoices"].empty()) return "";
+	const json& c = in["nameChoices"];
+	if (c.size() == 1) return "\"" + c[0].get<std::string>() + "\"";
+	std::string out = "one of ";
+	for (size_t i = 0; i < c.size(); ++i)
+		out += (i ? (i + 1 == c.size() ? " or " : ", ") : "") + ("\"" + c[i].get<std::string>() + "\"");
+	return out;
+}
+
+// Offer `count` local names when the request leaves the name open
+// (LOCAL_NAMES=0 turns this off). Not a string, so no cache key sees it.
+// A non-zero seed draws the same names every time, for prompts that must be
+// rebuilt later (bulk jobs).
+static json withLocalNames(json in, const std::string& kind, int count, uint64_t seed = 0) {
+	static const bool enabled = envDouble("LOCAL_NAMES", 1) != 0;
+	static thread_local std::mt19937_64 shared{ std::random_device{}() };
+	if (!enabled || !in.value("name", "").empty()) return in;
+	std::mt19937_64 seeded{ seed };
+	std::mt19937_64& gen = seed ? seeded : shared;
+	json choices = json::array();
+	for (int i = 0; i < std::max(1, count); ++i)
+		choices.push_back(kind == "shopkeeper" ? localPersonName(in.value("race", ""), gen) : localItemName(in, gen));
+	in["nameChoices"] = choices;
+	return in;
+}
+
+// Whether the SRD tables fix this request's mechanics, so the model only
+// writes the creative fields (see buildSrdGearPrompt / applySrdStats)
+static bool srdCovers(const json& in) {
+	const std::string kind = in.value("type", ""), subtype = in.value("subtype", "");
+	if (kind == "Weapon") return findSrdWeapon(subtype) != nullptr;
+	if (kind != "Armor" || srdArmorFor(subtype).empty()) return false;
+	const SetPiece* piece;
+	return findSetPiece(subtype, in.value("clothingPiece", ""), piece);
+}
+
+// Gear prompt for requests the SRD tables cover: the model writes only Name,
+// Properties and Description, plus which base armor of the category it is
+static std::string buildSrdGearPrompt(const json& in)
+{
+	const std::string name          = promptName(in),
+					  kind          = in.value("type",""),
+					  handedness    = in.value("handedness",""),
+					  subtype       = in.value("subtype",""),
+					  rarity        = in.value("rarity",""),
+					  clothingPiece = in.value("clothingPiece",""),
+					  extraDesc     = in.value("description", "");
+	auto joined = [](const std::vector<std::string>& v) {
+		std::string out;
+		for (auto& s : v) out += (out.empty() ? "" : ", ") + s;
+		return out;
+	};
+
+	std::ostringstream prompt;
+	prompt << "You are a Dungeons & Dragons 5E gear generator.\n"
+		   << "Produce ONLY a single JSON object (no extra text).\n";
+	bool askBase = false;
+	prompt << "Rarity: " << rarity << "\n";
+	if (kind == "Weapon") {
+		const SrdWeapon* w = findSrdWeapon(subtype);
+		prompt << "Item: " << w->name << " (" << (handedness.empty() ? w->handedness : handedness) << ")";
+		if (!name.empty()) prompt << " called " << name;
+		prompt << ".\nIts SRD stats are already set: " << w->damageDice << " " << w->damageType << " damage";
+		if (*w->properties) prompt << "; " << joined(splitProperties(w->properties));
+		prompt << ".\n";
+	} else {
+		const SetPiece* piece;
+		findSetPiece(subtype, clothingPiece, piece);
+		auto bases = srdArmorFor(subtype);
+		prompt << "Item: "
+			   << (subtype == "Shield"  ? std::string("shield")
+				 : piece                ? std::string(piece->piece) + " from a set of " + subtype + " armor"
+				 : subtype == "Clothes" ? std::string("set of clothes")
+				 :                        "suit of " + subtype + " armor");
+		if (!name.empty()) prompt << " called " << name;
+		prompt << ".\n";
+		if (bases.size() > 1) {
+			std::vector<std::string> names;
+			for (auto* a : bases) names.push_back(a->name);
+			prompt << "Base: one of " << joined(names) << ". Its SRD stats follow from the base.\n";
+			askBase = true;
+		}
+	}
+	if (!extraDesc.empty()) {
+		prompt << "Additional Details: " << extraDesc << "\n";
+	}
+	prompt << "\nYour JSON schema should be:\n"
+		   << "{\"Name\": \"...\", " << (askBase ? "\"Base\": \"...\", " : "")
+		   << (extraDesc.empty() ? "" : "\"Cost\": \"...\", ")
+		   << "\"Properties\": [\"...\"], \"Description\": \"...\"}\n"
+		   << "Properties: only what this item adds to its SRD properties, [] if nothing.\n";
+	if (rarity != "Common") {
+		prompt << "Description: include a short history, benefits, and an enchantment in 150 words or less, "\
+				  "scale the enchantments appropriately according to rarity, only add curses to items of legendary rarity or greater, "\
+				  "most importantly: be original and imaginative. Do not rely on the term \"dying star\".\n";
+	} else {
+		prompt << "Description: include a short history and benefits in 150 words or less (do NOT include any enchantment or curse). "\
+				  "Most importantly: be original and imaginative. Do not rely on the term \"dying star\".\n";
+	}
+	return prompt.str();
+}
+
+// Fill the SRD mechanics into an item the model wrote from buildSrdGearPrompt.
+// Above Common, Cost is the mundane price plus a magic price from the
+// rarity's DMG band; with a description the model's Cost stands, since the
+// description may name a price.
+static void applySrdStats(const json& in, json& out) {
+	static thread_local std::mt19937_64 gen{ std::random_device{}() };
+	if (!out.is_object() || !srdCovers(in)) return;
+	const std::string kind          = in.value("type", ""),
+					  subtype       = in.value("subtype", ""),
+					  rarity        = in.value("rarity", ""),
+					  clothingPiece = in.value("clothingPiece", "");
+
+	json stats;
+	int mundaneCp;
+	if (kind == "Weapon") {
+		const SrdWeapon* w = findSrdWeapon(subtype);
+		stats     = srdWeaponStats(*w);
+		mundaneCp = w->costCp;
+		stats["Category"] = in.value("handedness", "").empty() ? std::string(w->handedness) : in.value("handedness", "");
+		stats["Type"]     = subtype;
+	} else {
+		const SetPiece* piece;
+		findSetPiece(subtype, clothingPiece, piece);
+		auto bases = srdArmorFor(subtype);
+		const SrdArmor* a = bases.front();
+		if (out.contains("Base") && out["Base"].is_string())
+			for (auto* b : bases) if (srdNameMatches(b->name, out["Base"].get<std::string>())) a = b;
+		stats     = srdArmorStats(*a, piece, clothingPiece);
+		mundaneCp = srdArmorCostCp(*a, piece);
+		stats["Attunement"] = subtype == "Clothes" ? "No" : "Yes";
+	}
+	stats["Rarity"] = rarity;
+	if (int gp = magicPriceGp(rarity, gen))
+		stats["Cost"] = std::to_string(gp + (mundaneCp + 99) / 100) + " gp";
+	if (!in.value("description", "").empty() && out.contains("Cost")) stats.erase("Cost");
+
+	// SRD properties first, then whatever the item adds
+	std::vector<std::string> props = stats["Properties"].get<std::vector<std::string>>();
+	if (out.contains("Properties") && out["Properties"].is_array())
+		for (auto& p : out["Properties"])
+			if (p.is_string() && std::find(props.begin(), props.end(), p.get<std::string>()) == props.end())
+				props.push_back(p.get<std::string>());
+	stats["Properties"] = props;
+	out.update(stats);
+}
+
+// Build the gear prompt from request parameters
+static std::string buildGearPrompt(const json& in)
+{
+	// Mechanics the SRD fixes are filled in locally afterwards
+	if (srdCovers(in)) return buildSrdGearPrompt(in);
+	return itemTypes().of(in.value("type", "")).prompt(in, promptName(in));
+}
+
+// Output budget for buildGearPrompt: the SRD prompt asks only for Name,
+// Properties and a Description, the same budget a Description reroll gets
+static int gearMaxTokens(const json& in) {
+	return srdCovers(in) ? 384 : 768;
+}
+
+// Build prompt, call the routed model (or race both providers), and parse
+// up to `candidates` JSON responses from one request
+static std::vector<json> queryGeminiCandidates(const json& in,
+											   const std::string& route,
+											   int candidates,
+											   LlmResult* meta = nullptr)
+{
+	// 1) Rules routed to "procedural" build the items locally
+	ModelChoice choice = routeModel(in.value("type",""), in.value("rarity",""), route);
+	if (choice.provider == "procedural") {
+		auto t0 = Clock::now();
+		std::vector<json> outs;
+		for (int i = 0; i < candidates; ++i) {
+			json out = proceduralGear(in);
+			if (out.is_null()) break;
+			outs.push_back(std::move(out));
+		}
+		if (!outs.empty()) {
+			if (meta) {
+				*meta = LlmResult{};
+				meta->provider  = "procedural";
+				meta->model     = "srd";
+				meta->latencyMs = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+			}
+			return outs;
+		}
+		if (!choice.fallback) throw std::runtime_error("Procedural generation cannot build this item and the rule has no fallback");
+		choice = *choice.fallback;
+	}
+
+	// 2) Build prompt, offering local names when none was asked for
+	const ItemType& type = itemTypes().of(in.value("type", ""));
+	std::string prompt = buildGearPrompt(withLocalNames(in, "gear", candidates));
+	const int maxTokens = gearMaxTokens(in);
+
+	// 3) Race both providers when the route samples this request
+	if (candidates == 1 && shouldRace(route, choice, prompt, maxTokens)) {
+		json out = raceProviders(route, choice, prompt, maxTokens, meta);
+		applySrdStats(in, out);
+		if (!type.validate(out)) throw std::runtime_error("Model response is missing required fields");
+		return {out};
+	}
+
+	// 4) Send to the provider & model routed for this type and rarity
+	LlmRequest req;
+	req.prompt     = prompt;
+	req.maxTokens  = maxTokens;
+	req.candidates = candidates;
+	LlmResult result = generateWith(choice, req);
+	if (meta) *meta = result;
+
+	// 5) Parse, clean & check against the item type
+	std::vector<json> outs;
+	for (auto& raw : result.texts) {
+		json out = extractJsonObject(raw);
+		if (out.is_discarded()) continue;
+		applySrdStats(in, out);
+		if (!type.validate(out)) continue;
+		outs.push_back(std::move(out));
+	}
+	if (outs.empty()) {
+		throw std::runtime_error("Model returned no valid JSON object: " + result.texts[0]);
+	}
+	return outs;
+}
+
+static json queryGemini(const json& in,
+						const std::string& route = "gear",
+						LlmResult* meta = nullptr)
+{
+	return queryGeminiCandidates(in, route, 1, meta)[0];
+}
+
+// Regenerate a single field of an existing item, the rest is sent as context;
+// `type` is the request's gear type, guessed from the item when empty
+static json rerollGearField(const json& item,
+							const std::string& field,
+							const std::string& type = "",
+							LlmResult* meta = nullptr)
+{
+	const std::string rarity = item.value("Rarity", "");
+	bool allowEnchantment = (rarity != "Common");
+	std::string kind = !type.empty()              ? type
+					 : item.contains("DamageDice") ? "Weapon"
+					 : item.contains("ArmorClass") ? "Armor" : "Jewelry";
+
+	// 1) Context is the item minus the field being replaced
+	json context = item;
+	context.erase(field);
+
+	// 2) Build prompt, only the requested field is asked for
+	std::ostringstream prompt;
+	prompt << "You are a Dungeons & Dragons 5E gear generator.\n"
+		   << "Here is an existing item:\n" << context.dump(2) << "\n\n"
+		   << "Write a new value for its \"" << field << "\" field, consistent with the rest of the item.\n"
+		   << "Produce ONLY a single JSON object (no extra text) of the form {\"" << field << "\": ...}.\n";
+
+	int maxTokens = 96;
+	if (field == "Description") {
+		maxTokens = 384;
+		// Same instructions as a fresh item of this type
+		prompt << itemTypes().of(kind).description(allowEnchantment);
+	} else if (field == "Name") {
+		maxTokens = 32;
+		prompt << "Name: a short, original name of at most five words.\n";
+	} else if (field == "Properties") {
+		maxTokens = 128;
+		prompt << "Properties: a JSON array of short strings.\n";
+	}
+
+	// 3) Send POST, pull the field back out
+	ModelChoice choice = routeModel(kind, rarity, "gear/reroll");
+	LlmRequest req;
+	req.prompt    = prompt.str();
+	req.maxTokens = maxTokens;
+	LlmResult result = generateWith(choice, req);
+	if (meta) *meta = result;
+	std::string raw = result.texts[0];
+	json part = extractJsonObject(raw);
+	if (part.is_discarded()) {
+		throw std::runtime_error("Reroll returned no JSON object");
+	}
+	if (!part.contains(field)) {
+		throw std::runtime_error("Reroll response is missing field: " + field);
+	}
+
+	json out = item;
+	out[field] = part[field];
+	return out;
+}
+
+// Helper: if that numeric value > 1, switch to " lbs."
+static void adjustWeight(nlohmann::json &out) {
+	if (!out.contains("Weight") || !out["Weight"].is_string()) return;
+
+	// 1) grab & trim the original, e.g. "1 1/2 lb."
+	std::string w = trim(out["Weight"].get<std::string>());
+
+	// 2) split at the last space, to separate numeric and unit
+	auto pos = w.find_last_of(' ');
+	if (pos == std::string::npos) return;
+
+	std::string numericPart = trim(w.substr(0, pos));
+	// std::string oldUnit     = trim(w.substr(pos+1)); 
+
+	// 3) decide singular vs plural
+	std::string unit = (numericPart == "1") ? "lb." : "lbs.";
+
+	// 4) write it back
+	out["Weight"] = numericPart + " " + unit;
+}
+
+// ————————————————————————————————————————————————
+// Shop catalog: the standard stock of each shop type with base prices (PHB
+// where it lists one), the smallest settlement that carries it and how often
+// it turns up. A shopkeeper's ItemsList is sampled and priced from here, so
+// the model only writes the persona and, optionally, a few unique items.
+
+struct CatalogEntry {
+	const char* shopType;
+	const char* name;
+	int         priceCp;
+	int         minSettlement;   // 0 Outpost, 1 Village, 2 Town, 3 City
+	int         weight;          // relative chance of being stocked
+};
+
+static constexpr CatalogEntry SHOP_CATALOG[] = {
+	{"Alchemist", "Acid (vial)",                   2500,  1, 4},
+	{"Alchemist", "Alchemist's Fire (flask)",      5000,  1, 4},
+	{"Alchemist", "Antitoxin (vial)",              5000,  0, 5},
+	{"Alchemist", "Potion of Healing",             5000,  0, 8},
+	{"Alchemist", "Oil (flask)",                     10,  0, 6},
+	{"Alchemist", "Alchemist's Supplies",          5000,  2, 2},
+	{"Alchemist", "Empty Vial",                     100,  0, 6},
+	{"Alchemist", "Glass Bottle",                   200,  0, 4},
+	{"Alchemist", "Perfume (vial)",                 500,  1, 3},
+	{"Alchemist", "Soap",                             2,  0, 5},
+	{"Alchemist", "Ink (1 ounce bottle)",          1000,  1, 3},
+	{"Alchemist", "Component Pouch",               2500,  2, 2},
+	{"Alchemist", "Basic Poison (vial)",          10000,  2, 1},
+	{"Alchemist", "Smelling Salts",                  20,  0, 3},
+	{"Alchemist", "Lamp Black (pouch)",               5,  0, 2},
+	{"Alchemist", "Flask",                            2,  0, 4},
+
+	{"Apostle", "Holy Symbol (amulet)",             500,  0, 7},
+	{"Apostle", "Holy Symbol (emblem)",             500,  0, 6},
+	{"Apostle", "Holy Symbol (reliquary)",          500,  1, 4},
+	{"Apostle", "Holy Water (flask)",              2500,  0, 6},
+	{"Apostle", "Prayer Book",                     2500,  1, 4},
+	{"Apostle", "Vestments",                        100,  0, 5},
+	{"Apostle", "Candle",                             1,  0, 8},
+	{"Apostle", "Block of Incense",                  10,  0, 6},
+	{"Apostle", "Censer",                           200,  1, 3},
+	{"Apostle", "Prayer Beads",                     100,  0, 5},
+	{"Apostle", "Blessed Salt (pouch)",               5,  0, 4},
+	{"Apostle", "Devotional Icon",                  500,  1, 3},
+	{"Apostle", "Alms Box",                         200,  1, 2},
+	{"Apostle", "Priest's Pack",                   1900,  2, 2},
+	{"Apostle", "Healer's Kit",                     500,  0, 4},
+	{"Apostle", "Oil (flask)",                       10,  0, 3},
+
+	{"Artificer", "Tinker's Tools",                5000,  1, 5},
+	{"Artificer", "Thieves' Tools",                2500,  2, 3},
+	{"Artificer", "Smith's Tools",                 2000,  0, 4},
+	{"Artificer", "Jeweler's Tools",               2500,  2, 3},
+	{"Artificer", "Glassblower's Tools",           3000,  2, 2},
+	{"Artificer", "Cartographer's Tools",          1500,  1, 3},
+	{"Artificer", "Navigator's Tools",             2500,  2, 2},
+	{"Artificer", "Mason's Tools",                 1000,  0, 3},
+	{"Artificer", "Lock",                          1000,  1, 5},
+	{"Artificer", "Manacles",                       200,  0, 4},
+	{"Artificer", "Magnifying Glass",             10000,  2, 2},
+	{"Artificer", "Spyglass",                    100000,  3, 1},
+	{"Artificer", "Hourglass",                     2500,  1, 3},
+	{"Artificer", "Bullseye Lantern",              1000,  1, 4},
+	{"Artificer", "Merchant's Scale",               500,  0, 4},
+	{"Artificer", "Abacus",                         200,  0, 3},
+	{"Artificer", "Ball Bearings (bag of 1,000)",   100,  0, 4},
+	{"Artificer", "Hunting Trap",                   500,  0, 4},
+	{"Artificer", "Grappling Hook",                 200,  0, 4},
+
+	{"Apothecary", "Healer's Kit",                  500,  0, 8},
+	{"Apothecary", "Herbalism Kit",                 500,  0, 5},
+	{"Apothecary", "Potion of Healing",            5000,  1, 5},
+	{"Apothecary", "Antitoxin (vial)",             5000,  0, 4},
+	{"Apothecary", "Willowbark Tea (pouch)",          2,  0, 6},
+	{"Apothecary", "Herbal Poultice",                10,  0, 6},
+	{"Apothecary", "Sleeping Draught",               50,  0, 4},
+	{"Apothecary", "Linen Bandages (roll)",           5,  0, 7},
+	{"Apothecary", "Mortar and Pestle",             100,  0, 3},
+	{"Apothecary", "Empty Vial",                    100,  0, 4},
+	{"Apothecary", "Dried Herbs (bundle)",            1,  0, 6},
+	{"Apothecary", "Salt (1 lb.)",                    5,  0, 4},
+	{"Apothecary", "Ginger (1 lb.)",                100,  1, 3},
+	{"Apothecary", "Pepper (1 lb.)",                200,  1, 2},
+	{"Apothecary", "Cinnamon (1 lb.)",              200,  2, 2},
+	{"Apothecary", "Cloves (1 lb.)",               1500,  2, 1},
+	{"Apothecary", "Saffron (1 lb.)",              1500,  3, 1},
+	{"Apothecary", "Soap",                            2,  0, 4},
+
+	{"Blacksmith", "Dagger",                        200,  0, 7},
+	{"Blacksmith", "Handaxe",                       500,  0, 6},
+	{"Blacksmith", "Light Hammer",                  200,  0, 4},
+	{"Blacksmith", "Mace",                          500,  0, 5},
+	{"Blacksmith", "Sickle",                        100,  0, 4},
+	{"Blacksmith", "Spear",                         100,  0, 6},
+	{"Blacksmith", "Battleaxe",                    1000,  0, 4},
+	{"Blacksmith", "Longsword",                    1500,  1, 5},
+	{"Blacksmith", "Shortsword",                   1000,  0, 5},
+	{"Blacksmith", "Warhammer",                    1500,  1, 3},
+	{"Blacksmith", "War Pick",                      500,  1, 3},
+	{"Blacksmith", "Morningstar",                  1500,  1, 3},
+	{"Blacksmith", "Flail",                        1000,  1, 3},
+	{"Blacksmith", "Greatsword",                   5000,  2, 2},
+	{"Blacksmith", "Greataxe",                     3000,  2, 2},
+	{"Blacksmith", "Halberd",                      2000,  2, 2},
+	{"Blacksmith", "Maul",                         1000,  1, 2},
+	{"Blacksmith", "Chain Shirt",                  5000,  1, 3},
+	{"Blacksmith", "Ring Mail",                    3000,  1, 2},
+	{"Blacksmith", "Chain Mail",                   7500,  2, 2},
+	{"Blacksmith", "Splint Armor",                20000,  3, 1},
+	{"Blacksmith", "Plate Armor",                150000,  3, 1},
+	{"Blacksmith", "Shield",                       1000,  0, 5},
+	{"Blacksmith", "Horseshoes (set of 4)",         100,  0, 6},
+	{"Blacksmith", "Iron Spikes (10)",              100,  0, 5},
+	{"Blacksmith", "Smith's Tools",                2000,  1, 2},
+	{"Blacksmith", "Chain (10 feet)",               500,  0, 3},
+	{"Blacksmith", "Iron Pot",                      200,  0, 4},
+	{"Blacksmith", "Crowbar",                       200,  0, 4},
+
+	{"Bookstore", "Book",                          2500,  1, 5},
+	{"Bookstore", "Paper (one sheet)",               20,  0, 7},
+	{"Bookstore", "Parchment (one sheet)",           10,  0, 7},
+	{"Bookstore", "Ink (1 ounce bottle)",          1000,  0, 6},
+	{"Bookstore", "Ink Pen",                          2,  0, 7},
+	{"Bookstore", "Sealing Wax",                     50,  0, 5},
+	{"Bookstore", "Map or Scroll Case",             100,  0, 5},
+	{"Bookstore", "Calligrapher's Supplies",       1000,  1, 3},
+	{"Bookstore", "Scholar's Pack",                4000,  2, 2},
+	{"Bookstore", "Blank Spellbook",               5000,  2, 2},
+	{"Bookstore", "Regional Map",                   100,  0, 5},
+	{"Bookstore", "Bestiary of the Wilds",         2500,  2, 2},
+	{"Bookstore", "History of the Realm",          2500,  2, 2},
+	{"Bookstore", "Farmer's Almanac",               500,  0, 4},
+	{"Bookstore", "Herbal Compendium",             2500,  1, 2},
+	{"Bookstore", "Chalk (1 piece)",                  1,  0, 4},
+	{"Bookstore", "Cartographer's Tools",          1500,  2, 1},
+
+	{"Cobbler", "Common Boots",                      50,  0, 8},
+	{"Cobbler", "Riding Boots",                     200,  0, 5},
+	{"Cobbler", "Traveling Boots",                  100,  0, 6},
+	{"Cobbler", "Soft Slippers",                     20,  0, 4},
+	{"Cobbler", "Sandals",                           10,  0, 5},
+	{"Cobbler", "Hobnailed Boots",                  100,  0, 4},
+	{"Cobbler", "Winter Boots",                     300,  0, 4},
+	{"Cobbler", "Wooden Clogs",                       5,  0, 4},
+	{"Cobbler", "Waders",                           200,  1, 2},
+	{"Cobbler", "Fine Shoes",                       400,  2, 3},
+	{"Cobbler", "Dancing Shoes",                    500,  2, 2},
+	{"Cobbler", "Boot Laces",                         1,  0, 6},
+	{"Cobbler", "Boot Polish (tin)",                  2,  0, 5},
+	{"Cobbler", "Leather Patch",                      1,  0, 4},
+	{"Cobbler", "Cobbler's Tools",                  500,  1, 2},
+
+	{"Fletcher", "Shortbow",                       2500,  0, 6},
+	{"Fletcher", "Longbow",                        5000,  1, 4},
+	{"Fletcher", "Light Crossbow",                 2500,  1, 3},
+	{"Fletcher", "Heavy Crossbow",                 5000,  2, 2},
+	{"Fletcher", "Hand Crossbow",                  7500,  3, 1},
+	{"Fletcher", "Arrows (20)",                     100,  0, 8},
+	{"Fletcher", "Crossbow Bolts (20)",             100,  1, 5},
+	{"Fletcher", "Quiver",                          100,  0, 6},
+	{"Fletcher", "Crossbow Bolt Case",              100,  1, 3},
+	{"Fletcher", "Javelin",                          50,  0, 4},
+	{"Fletcher", "Darts (10)",                       50,  0, 4},
+	{"Fletcher", "Sling",                            10,  0, 3},
+	{"Fletcher", "Sling Bullets (20)",                4,  0, 3},
+	{"Fletcher", "Blowgun",                        1000,  2, 1},
+	{"Fletcher", "Blowgun Needles (50)",            100,  2, 1},
+	{"Fletcher", "Bowstring",                        10,  0, 6},
+	{"Fletcher", "Fletching Feathers (bundle)",       2,  0, 4},
+	{"Fletcher", "Woodcarver's Tools",              100,  1, 2},
+
+	{"General Store", "Backpack",                   200,  0, 7},
+	{"General Store", "Bedroll",                    100,  0, 7},
+	{"General Store", "Blanket",                     50,  0, 6},
+	{"General Store", "Candle",                       1,  0, 6},
+	{"General Store", "Crowbar",                    200,  0, 4},
+	{"General Store", "Fishing Tackle",             100,  0, 4},
+	{"General Store", "Tinderbox",                   50,  0, 6},
+	{"General Store", "Hempen Rope (50 feet)",      100,  0, 7},
+	{"General Store", "Silk Rope (50 feet)",       1000,  2, 2},
+	{"General Store", "Hooded Lantern",             500,  0, 5},
+	{"General Store", "Oil (flask)",                 10,  0, 6},
+	{"General Store", "Iron Pot",                   200,  0, 4},
+	{"General Store", "Rations (1 day)",             50,  0, 8},
+	{"General Store", "Sack",                         1,  0, 5},
+	{"General Store", "Shovel",                     200,  0, 4},
+	{"General Store", "Soap",                         2,  0, 4},
+	{"General Store", "Torch",                        1,  0, 8},
+	{"General Store", "Waterskin",                   20,  0, 7},
+	{"General Store", "Whetstone",                    1,  0, 5},
+	{"General Store", "Mess Kit",                    20,  0, 4},
+	{"General Store", "Two-Person Tent",            200,  0, 4},
+	{"General Store", "Grappling Hook",             200,  1, 3},
+	{"General Store", "Chain (10 feet)",            500,  1, 2},
+	{"General Store", "Climber's Kit",             2500,  2, 2},
+	{"General Store", "Caltrops (bag of 20)",       100,  1, 2},
+	{"General Store", "Signal Whistle",               5,  0, 3},
+	{"General Store", "Hourglass",                 2500,  2, 1},
+	{"General Store", "Spyglass",                100000,  3, 1},
+
+	{"Haberdashery", "Felt Hat",                     50,  0, 6},
+	{"Haberdashery", "Wide-Brimmed Hat",            100,  0, 5},
+	{"Haberdashery", "Leather Gloves",               50,  0, 6},
+	{"Haberdashery", "Fine Kid Gloves",             200,  2, 3},
+	{"Haberdashery", "Wool Scarf",                   20,  0, 5},
+	{"Haberdashery", "Leather Belt",                 30,  0, 5},
+	{"Haberdashery", "Hood",                         30,  0, 4},
+	{"Haberdashery", "Ribbons (bundle)",              1,  0, 5},
+	{"Haberdashery", "Bone Buttons (dozen)",          5,  0, 5},
+	{"Haberdashery", "Handkerchief",                  2,  0, 5},
+	{"Haberdashery", "Sewing Kit",                   50,  0, 4},
+	{"Haberdashery", "Feathered Cap",               300,  2, 2},
+	{"Haberdashery", "Silk Sash",                   500,  2, 2},
+	{"Haberdashery", "Perfume (vial)",              500,  1, 2},
+	{"Haberdashery", "Steel Mirror",                500,  1, 2},
+	{"Haberdashery", "Fur-Lined Mittens",           100,  0, 3},
+	{"Haberdashery", "Signet Ring",                 500,  2, 1},
+
+	{"Innkeeper", "Ale (mug)",                        4,  0, 9},
+	{"Innkeeper", "Ale (gallon)",                    20,  0, 5},
+	{"Innkeeper", "Common Wine (pitcher)",           20,  0, 6},
+	{"Innkeeper", "Fine Wine (bottle)",            1000,  2, 2},
+	{"Innkeeper", "Squalid Meal",                     3,  0, 3},
+	{"Innkeeper", "Poor Meal",                        6,  0, 5},
+	{"Innkeeper", "Modest Meal",                     30,  0, 7},
+	{"Innkeeper", "Comfortable Meal",                50,  1, 5},
+	{"Innkeeper", "Wealthy Meal",                    80,  2, 3},
+	{"Innkeeper", "Poor Room (per night)",           10,  0, 5},
+	{"Innkeeper", "Modest Room (per night)",         50,  0, 7},
+	{"Innkeeper", "Comfortable Room (per night)",    80,  1, 5},
+	{"Innkeeper", "Wealthy Room (per night)",       200,  2, 3},
+	{"Innkeeper", "Bread (loaf)",                     2,  0, 6},
+	{"Innkeeper", "Cheese (hunk)",                   10,  0, 5},
+	{"Innkeeper", "Meat (chunk)",                    30,  0, 5},
+	{"Innkeeper", "Rations (1 day)",                 50,  0, 4},
+	{"Innkeeper", "Stabling (per night)",            50,  0, 4},
+	{"Innkeeper", "Hot Bath",                         3,  1, 4},
+
+	{"Leatherworker", "Leather Armor",             1000,  0, 6},
+	{"Leatherworker", "Studded Leather Armor",     4500,  1, 3},
+	{"Leatherworker", "Hide Armor",                1000,  0, 4},
+	{"Leatherworker", "Padded Armor",               500,  0, 4},
+	{"Leatherworker", "Backpack",                   200,  0, 6},
+	{"Leatherworker", "Belt Pouch",                  50,  0, 7},
+	{"Leatherworker", "Waterskin",                   20,  0, 6},
+	{"Leatherworker", "Riding Saddle",             1000,  0, 4},
+	{"Leatherworker", "Pack Saddle",                500,  0, 3},
+	{"Leatherworker", "Saddlebags",                 400,  0, 4},
+	{"Leatherworker", "Bit and Bridle",             200,  0, 4},
+	{"Leatherworker", "Whip",                       200,  0, 3},
+	{"Leatherworker", "Sling",                       10,  0, 3},
+	{"Leatherworker", "Quiver",                     100,  0, 4},
+	{"Leatherworker", "Map or Scroll Case",         100,  1, 3},
+	{"Leatherworker", "Component Pouch",           2500,  2, 2},
+	{"Leatherworker", "Leatherworker's Tools",      500,  1, 2},
+
+	{"Pawnshop", "Dice Set",                         10,  0, 5},
+	{"Pawnshop", "Playing Card Set",                 50,  0, 5},
+	{"Pawnshop", "Lute",                           3500,  1, 3},
+	{"Pawnshop", "Flute",                           200,  0, 4},
+	{"Pawnshop", "Drum",                            600,  0, 3},
+	{"Pawnshop", "Steel Mirror",                    500,  0, 4},
+	{"Pawnshop", "Signet Ring",                     500,  1, 3},
+	{"Pawnshop", "Disguise Kit",                   2500,  2, 2},
+	{"Pawnshop", "Forgery Kit",                    1500,  3, 1},
+	{"Pawnshop", "Dagger",                          200,  0, 5},
+	{"Pawnshop", "Shortsword",                     1000,  0, 4},
+	{"Pawnshop", "Light Crossbow",                 2500,  1, 2},
+	{"Pawnshop", "Chain Shirt",                    5000,  1, 2},
+	{"Pawnshop", "Hooded Lantern",                  500,  0, 4},
+	{"Pawnshop", "Hourglass",                      2500,  1, 2},
+	{"Pawnshop", "Bagpipes",                       3000,  2, 1},
+	{"Pawnshop", "Lyre",                           3000,  2, 1},
+	{"Pawnshop", "Traveler's Clothes",              200,  0, 4},
+	{"Pawnshop", "Fine Clothes",                   1500,  1, 2},
+	{"Pawnshop", "Copper Amulet",                   200,  0, 3},
+	{"Pawnshop", "Silver Ring",                    1000,  1, 2},
+	{"Pawnshop", "Tinderbox",                        50,  0, 4},
+	{"Pawnshop", "Spyglass",                     100000,  3, 1},
+
+	{"Tailor", "Common Clothes",                     50,  0, 8},
+	{"Tailor", "Traveler's Clothes",                200,  0, 7},
+	{"Tailor", "Fine Clothes",                     1500,  1, 4},
+	{"Tailor", "Costume Clothes",                   500,  1, 3},
+	{"Tailor", "Robes",                             100,  0, 5},
+	{"Tailor", "Vestments",                         100,  1, 3},
+	{"Tailor", "Wool Cloak",                        100,  0, 6},
+	{"Tailor", "Linen Shirt",                        20,  0, 5},
+	{"Tailor", "Wool Trousers",                      30,  0, 5},
+	{"Tailor", "Cotton Cloth (1 sq. yd.)",           50,  0, 5},
+	{"Tailor", "Linen (1 sq. yd.)",                 500,  1, 3},
+	{"Tailor", "Silk (1 sq. yd.)",                 1000,  2, 2},
+	{"Tailor", "Weaver's Tools",                    100,  1, 2},
+	{"Tailor", "Sewing Kit",                         50,  0, 4},
+	{"Tailor", "Alterations",                        10,  0, 5},
+	{"Tailor", "Embroidered Doublet",               800,  2, 2},
+};
+
+static int settlementIndex(const std::string& settlement) {
+	static const char* const sizes[] = {"Outpost", "Village", "Town", "City"};
+	for (int i = 0; i < 4; ++i) if (settlement == sizes[i]) return i;
+	return 2;
+}
+
+// Stock size and price range per settlement: outposts carry little and
+// charge for hauling it in, cities carry most and compete on price
+struct SettlementTerms { int minItems, maxItems; double priceLo, priceHi; };
+static constexpr SettlementTerms SETTLEMENT_TERMS[] = {
+	{6, 9, 1.10, 1.50}, {8, 11, 1.00, 1.25}, {10, 13, 0.90, 1.15}, {12, 15, 0.85, 1.10},
+};
+
+static bool shopCataloged(const std::string& shopType) {
+	for (auto& e : SHOP_CATALOG) if (shopType == e.shopType) return true;
+	return false;
+}
+
+// Price to the coin a shop would quote in: whole gp from 1 gp, whole sp
+// from 1 sp, cp below that
+static std::string quotePrice(double cp) {
+	if (cp >= 100) return formatCost((int)std::lround(cp / 100) * 100);
+	if (cp >= 10)  return formatCost((int)std::lround(cp / 10) * 10);
+	return formatCost(std::max(1, (int)std::lround(cp)));
+}
+
+// "Item (price)" entries for a shop's ItemsList, drawn without replacement
+// by weight from what its settlement carries. The same seed gives the same
+// stock; empty when the shop type is not in the catalog.
+static std::vector<std::string> sampleShopStock(const json& in, uint64_t seed) {
+	std::string shopType = in.value("shopType", "");
+	int settlement = settlementIndex(in.value("settlementSize", ""));
+	const SettlementTerms& terms = SETTLEMENT_TERMS[settlement];
+	std::mt19937_64 gen{seed};
+
+	// Weighted sampling without replacement: keep the largest u^(1/w)
+	std::uniform_real_distribution<double> u(0.0, 1.0);
+	std::vector<std::pair<double, const CatalogEntry*>> keyed;
+	for (auto& e : SHOP_CATALOG)
+		if (shopType == e.shopType && e.minSettlement <= settlement)
+			keyed.push_back({std::pow(u(gen), 1.0 / e.weight), &e});
+	size_t want = (size_t)std::uniform_int_distribution<>(terms.minItems, terms.maxItems)(gen);
+	want = std::min(want, keyed.size());
+	std::partial_sort(keyed.begin(), keyed.begin() + want, keyed.end(),
+					  [](auto& a, auto& b) { return a.first > b.first; });
+
+	std::vector<std::string> out;
+	std::uniform_real_distribution<double> markup(terms.priceLo, terms.priceHi);
+	for (size_t i = 0; i < want; ++i)
+		out.push_back(std::string(keyed[i].second->name) + " (" + quotePrice(keyed[i].second->priceCp * markup(gen)) + ")");
+	return out;
+}
+
+// Replace a model-written shopkeeper's stock with the sampled one, followed
+// by the unique items it was asked for
+static void applyShopStock(json& out, const std::vector<std::string>& stock) {
+	if (!out.is_object() || stock.empty()) return;
+	std::vector<std::string> items = stock;
+	json unique = out.value("UniqueItems", json::array());
+	if (unique.is_array())
+		for (auto& u : unique) if (u.is_string()) items.push_back(u.get<std::string>());
+	out.erase("UniqueItems");
+	out["ItemsList"] = json(items).dump();
+}
+
+// Build the shopkeeper prompt from request parameters; with a sampled
+// `stock` the model writes only the persona and up to SHOP_UNIQUE_ITEMS
+// unique items
+static std::string buildShopkeeperPrompt(const nlohmann::json& in,
+                                         const std::vector<std::string>& stock = {}) {
+
+    // 1) extract inputs (description is optional)
+    std::string name          = promptName(in);
+    std::string race          = in.value("race", "");
+    std::string settlement    = in.value("settlementSize", "");
+    std::string shopType      = in.value("shopType", "");
+    std::string extraDesc     = in.value("description", "");
+
+    // 2) build the user prompt
+    std::ostringstream prompt;
+    prompt << "You are a Dungeons & Dragons 5th Edition shopkeeper NPC generator.\n"
+           << "Produce ONLY a single JSON object (no extra text) with this schema:\n";
+    if (!stock.empty()) {
+        static const int uniqueItems = (int)envDouble("SHOP_UNIQUE_ITEMS", 2);
+        prompt << "{\"Name\": \"...\", \"Race\": \"...\", \"SettlementSize\": \"...\", \"ShopType\": \"...\", "
+               << "\"Description\": \"...\""
+               << (uniqueItems > 0 ? ", \"UniqueItems\": [\"Item Name (10 gp)\"]" : "") << "}\n"
+               << "Here are the parameters:\n"
+               << "• Name: "           << name       << "\n"
+               << "• Race: "           << race       << "\n"
+               << "• Settlement Size: "<< settlement << "\n"
+               << "• Shop Type: "      << shopType   << "\n";
+        if (!extraDesc.empty()) {
+            prompt << "• Additional Details: " << extraDesc << "\n";
+        }
+        prompt << "\nThe shop's regular stock is already set: ";
+        for (size_t i = 0; i < stock.size(); ++i) prompt << (i ? ", " : "") << stock[i];
+        prompt << ".\n";
+        if (uniqueItems > 0) {
+            prompt << "UniqueItems: up to " << uniqueItems << " unusual items only this shopkeeper sells, "\
+                      "each with its price in parentheses, e.g. \"Longsword (15 gp)\".\n";
+        }
+        return prompt.str();
+    }
+    prompt << R"({
+				"Name": "...",
+				"Race": "...",
+				"SettlementSize": "...",
+				"ShopType": "...",
+				"Description": "...",
+				"ItemsList": "[\"Item Name (10 gp)\",\"Another Item (2 sp)\",\"Another Item (5 cp)\",\"...\"]"
+		   })";
+		   prompt << "\nHere are the parameters:\n"
+				  << "• Name: "           << name       << "\n"
+				  << "• Race: "           << race       << "\n"
+				  << "• Settlement Size: "<< settlement << "\n"
+				  << "• Shop Type: "      << shopType   << "\n";
+    if (!extraDesc.empty()) {
+        prompt << "• Additional Details: " << extraDesc << "\n";
+    }
+    prompt << "\nGenerate a list of 10–15 items this shopkeeper sells, appropriate to "\
+              "the shop type and settlement size. "\
+			  "For each item, include its price in gold pieces (gp), silver pieces (sp), or copper pieces (cp) in parentheses after the name, "\ 
+			  "e.g. \"Longsword (15 gp)\".\n";
+
+    return prompt.str();
+}
+
+// Up to `candidates` shopkeepers from one request; unparseable ones are dropped
+static std::vector<nlohmann::json> queryShopkeeperCandidates(const nlohmann::json& in,
+                                                             const std::string& route,
+                                                             int candidates,
+                                                             LlmResult* meta = nullptr) {
+    using json = nlohmann::json;
+
+    // 1) sample the regular stock locally, then build the user prompt
+    static thread_local std::mt19937_64 gen{ std::random_device{}() };
+    std::vector<std::string> stock;
+    if (shopCataloged(in.value("shopType", ""))) stock = sampleShopStock(in, gen());
+    std::string prompt = buildShopkeeperPrompt(withLocalNames(in, "shopkeeper", candidates), stock);
+
+    // 2) race the routed model against its fallback when the route samples this request
+    ModelChoice choice = routeModel("", "", route);
+    if (candidates == 1 && shouldRace(route, choice, prompt, 1024)) {
+        json out = raceProviders(route, choice, prompt, 1024, meta);
+        applyShopStock(out, stock);
+        return {out};
+    }
+
+    // 3) send to the routed provider & model (GPT-4.1-mini by default)
+    LlmRequest req;
+    req.prompt     = prompt;
+    req.maxTokens  = 1024;
+    req.candidates = candidates;
+    LlmResult result = generateWith(choice, req);
+    if (meta) *meta = result;
+
+    // 4) extract the JSON blob from the model's text
+    std::vector<json> outs;
+    for (auto& raw : result.texts) {
+        json out = extractJsonObject(raw);
+        if (out.is_discarded()) continue;
+        applyShopStock(out, stock);
+        outs.push_back(std::move(out));
+    }
+    return outs;
+}
+
+nlohmann::json queryShopkeeper(const nlohmann::json& in,
+                               const std::string& route = "shopkeeper",
+                               LlmResult* meta = nullptr) {
+    auto outs = queryShopkeeperCandidates(in, route, 1, meta);
+    if (outs.empty()) {
+      return {};  // or throw
+    }
+    return outs[0];
+}
+	
+// Pick random gear parameters, as used by /api/gear/random
+static json randomGearParams() {
+	static thread_local std::mt19937_64 gen{ std::random_device{}() };
+	return itemTypes().sample(gen);
+}
+
+// Pick random shopkeeper parameters, as used by /api/shopkeeper/random
+static json randomShopkeeperParams() {
+    static thread_local std::mt19937_64 gen{ std::random_device{}() };
+    std::vector<std::string> races = {
+        "Aarakocra","Aasimar","Air Genasi","Bugbear","Centaur","Changeling","Deep Gnome","Duergar","Dragonborn",
+        "Dwarf","Earth Genasi","Eladrin","Elf","Fairy","Firbolg","Fire Genasi","Githyanki","Githzerai","Gnome",
+        "Goliath","Half-Elf","Halfling","Half-Orc","Harengon","Hobgoblin","Human","Kenku","Kobold","Lizardfolk",
+        "Minotaur","Orc","Satyr","Sea Elf","Shadar-kai","Shifter","Tabaxi","Tiefling","Tortle","Triton",
+        "Water Genasi","Yuan-ti"
+    };
+    std::uniform_int_distribution<> dR(0, (int)races.size()-1);
+
+    std::vector<std::string> settlements{"Outpost","Village","Town","City"};
+    std::uniform_int_distribution<> dS(0, (int)settlements.size()-1);
+
+    std::vector<std::string> shopTypes{
+        "Alchemist","Apostle","Artificer","Apothecary","Blacksmith","Bookstore","Cobbler","Fletcher",
+        "General Store","Haberdashery","Innkeeper","Leatherworker","Pawnshop","Tailor"
+    };
+    std::uniform_int_distribution<> dT(0, (int)shopTypes.size()-1);
+
+    json in;
+    in["name"]           = "";
+    in["race"]           = races[dR(gen)];
+    in["settlementSize"] = settlements[dS(gen)];
+    in["shopType"]       = shopTypes[dT(gen)];
+    in["description"]    = "";
+    return in;
+}
+
+// ————————————————————————————————————————————————
+// Shared cache tier: an optional Redis-protocol server (REDIS_ADDR=host:port)
+// that replicas use as a second-level cache and fleet-wide item pool.
+// Every call has a short timeout (REDIS_TIMEOUT_MS); after a failure the
+// tier is skipped for a second so requests fall back to local state.
+
+struct RespReply {
+	char                   type = 0;   // '+', '-', ':', '$' or '*'
+	bool                   nil  = false;
+	std::string            str;
+	long long              integer = 0;
+	std::vector<RespReply> elements;
+};
+
+class RespClient {
+public:
+	RespClient(std::string host, std::string port, std::chrono::milliseconds timeout, std::string password)
+		: host_(std::move(host)), port_(std::move(port)), timeout_(timeout), password_(std::move(password)) {}
+
+	~RespClient() {
+		for (auto& c : idle_) ::close(c->fd);
+	}
+
+	// Send all commands in one write and read their replies in order.
+	// Error replies are returned as type '-'; I/O failures throw.
+	std::vector<RespReply> pipeline(const std::vector<std::vector<std::string>>& cmds) {
+		if (Clock::now() < downUntil_.load())
+			throw std::runtime_error("Redis unavailable");
+		std::unique_ptr<Conn> conn;
+		try {
+			conn = acquire();
+			std::string out;
+			for (auto& cmd : cmds) encode(cmd, out);
+			sendAll(*conn, out);
+			std::vector<RespReply> replies;
+			for (size_t i = 0; i < cmds.size(); ++i) replies.push_back(readReply(*conn));
+			release(std::move(conn));
+			return replies;
+		} catch (const std::exception&) {
+			if (conn) ::close(conn->fd);
+			downUntil_ = Clock::now() + std::chrono::seconds(1);
+			throw;
+		}
+	}
+
+	RespReply command(const std::vector<std::string>& cmd) { return pipeline({cmd}).at(0); }
+
+private:
+	struct Conn {
+		int         fd;
+		std::string buf;
+		size_t      pos = 0;
+	};
+
+	std::unique_ptr<Conn> acquire() {
+		{
+			std::lock_guard<std::mutex> lk(m_);
+			if (!idle_.empty()) {
+				auto c = std::move(idle_.back());
+				idle_.pop_back();
+				return c;
+			}
+		}
+		auto c = std::make_unique<Conn>();
+		c->fd = connectFd();
+		if (!password_.empty()) {
+			std::string out;
+			encode({"AUTH", password_}, out);
+			try {
+				sendAll(*c, out);
+				RespReply r = readReply(*c);
+				if (r.type == '-') throw std::runtime_error("Redis AUTH failed: " + r.str);
+			} catch (...) {
+				::close(c->fd);
+				throw;
+			}
+		}
+		return c;
+	}
+
+	void release(std::unique_ptr<Conn> c) {
+		std::lock_guard<std::mutex> lk(m_);
+		if (idle_.size() < 16) idle_.push_back(std::move(c));
+		else ::close(c->fd);
+	}
+
+	int connectFd() {
+		addrinfo hints{}, *res = nullptr;
+		hints.ai_family   = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(host_.c_str(), port_.c_str(), &hints, &res) != 0 || !res)
+			throw std::runtime_error("Cannot resolve Redis host " + host_);
+		int fd = ::socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+		if (fd < 0) { freeaddrinfo(res); throw std::runtime_error("socket() failed"); }
+		// Non-blocking connect so the timeout applies to it too
+		int flags = fcntl(fd, F_GETFL, 0);
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+		int rc = ::connect(fd, res->ai_addr, res->ai_addrlen);
+		freeaddrinfo(res);
+		if (rc < 0 && errno != EINPROGRESS) { ::close(fd); throw std::runtime_error("Redis connect failed"); }
+		if (rc < 0) {
+			pollfd p{fd, POLLOUT, 0};
+			int err = 0;
+			socklen_t len = sizeof(err);
+			if (poll(&p, 1, (int)timeout_.count()) != 1
+				|| getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+			{
+				::close(fd);
+				throw std::runtime_error("Redis connect timed out");
+			}
+		}
+		fcntl(fd, F_SETFL, flags);
+		timeval tv{ (time_t)(timeout_.count() / 1000), (suseconds_t)((timeout_.count() % 1000) * 1000) };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		return fd;
+	}
+
+	static void encode(const std::vector<std::string>& cmd, std::string& out) {
+		out += "*" + std::to_string(cmd.size()) + "\r\n";
+		for (auto& arg : cmd) {
+			out += "$" + std::to_string(arg.size()) + "\r\n";
+			out += arg;
+			out += "\r\n";
+		}
+	}
+
+	static void sendAll(Conn& c, const std::string& data) {
+		size_t sent = 0;
+		while (sent < data.size()) {
+			ssize_t n = ::send(c.fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+			if (n <= 0) throw std::runtime_error("Redis write failed");
+			sent += (size_t)n;
+		}
+	}
+
+	// Make at least `n` unread bytes available in the buffer
+	static void fill(Conn& c, size_t n) {
+		if (c.pos > 0 && c.pos == c.buf.size()) { c.buf.clear(); c.pos = 0; }
+		while (c.buf.size() - c.pos < n) {
+			char tmp[4096];
+			ssize_t got = ::recv(c.fd, tmp, sizeof(tmp), 0);
+			if (got <= 0) throw std::runtime_error("Redis read failed or timed out");
+			c.buf.append(tmp, (size_t)got);
+		}
+	}
+
+	static std::string readLine(Conn& c) {
+		for (;;) {
+			size_t eol = c.buf.find("\r\n", c.pos);
+			if (eol != std::string::npos) {
+				std::string line = c.buf.substr(c.pos, eol - c.pos);
+				c.pos = eol + 2;
+				return line;
+			}
+			fill(c, c.buf.size() - c.pos + 1);
+		}
+	}
+
+	static RespReply readReply(Conn& c) {
+		std::string line = readLine(c);
+		if (line.empty()) throw std::runtime_error("Malformed Redis reply");
+		RespReply r;
+		r.type = line[0];
+		std::string rest = line.substr(1);
+		switch (r.type) {
+		case '+': case '-':
+			r.str = rest;
+			break;
+		case ':':
+			r.integer = std::stoll(rest);
+			break;
+		case '$': {
+			long long len = std::stoll(rest);
+			if (len < 0) { r.nil = true; break; }
+			fill(c, (size_t)len + 2);
+			r.str = c.buf.substr(c.pos, (size_t)len);
+			c.pos += (size_t)len + 2;
+			break;
+		}
+		case '*': {
+			long long count = std::stoll(rest);
+			if (count < 0) { r.nil = true; break; }
+			for (long long i = 0; i < count; ++i) r.elements.push_back(readReply(c));
+			break;
+		}
+		default:
+			throw std::runtime_error("Unknown Redis reply type");
+		}
+		return r;
+	}
+
+	std::string                        host_, port_;
+	std::chrono::milliseconds          timeout_;
+	std::string                        password_;
+	std::mutex                         m_;
+	std::vector<std::unique_ptr<Conn>> idle_;
+	std::atomic<Clock::time_point>     downUntil_{Clock::time_point{}};
+};
+
+// Cache variants live in a list per normalized key, pools in one list per kind.
+// Every method swallows tier failures, which read as misses.
+class SharedTier {
+public:
+	SharedTier(std::unique_ptr<RespClient> client, std::string prefix)
+		: client_(std::move(client)), prefix_(std::move(prefix)) {}
+
+	// Serialized variants for each key, fetched in one pipelined round trip
+	std::vector<std::vector<std::string>> getVariants(const std::vector<std::string>& canonicals) {
+		std::vector<std::vector<std::string>> out(canonicals.size());
+		std::vector<std::vector<std::string>> cmds;
+		for (auto& c : canonicals) cmds.push_back({"LRANGE", prefix_ + "cache:" + c, "0", "-1"});
+		try {
+			auto replies = client_->pipeline(cmds);
+			for (size_t i = 0; i < replies.size(); ++i)
+				for (auto& e : replies[i].elements)
+					if (!e.str.empty() && e.str[0] == '{') out[i].push_back(std::move(e.str));
+		} catch (const std::exception&) { errors_++; }
+		return out;
+	}
+
+	// Append a serialized variant, keep the first `variants` and (re)arm the TTL
+	void addVariant(const std::string& canonical, const std::string& body, size_t variants, std::chrono::seconds ttl) {
+		std::string key = prefix_ + "cache:" + canonical;
+		try {
+			client_->pipeline({
+				{"RPUSH",  key, body},
+				{"LTRIM",  key, "0", std::to_string(variants - 1)},
+				{"EXPIRE", key, std::to_string(ttl.count())}
+			});
+		} catch (const std::exception&) { errors_++; }
+	}
+
+	std::optional<json> popPool(const std::string& name) {
+		try {
+			RespReply r = client_->command({"LPOP", prefix_ + "pool:" + name});
+			if (r.type != '$' || r.nil) return std::nullopt;
+			json v = json::parse(r.str, nullptr, false);
+			if (v.is_object()) return v;
+		} catch (const std::exception&) { errors_++; }
+		return std::nullopt;
+	}
+
+	// -1 when the tier cannot be reached
+	long long poolSize(const std::string& name) {
+		try {
+			RespReply r = client_->command({"LLEN", prefix_ + "pool:" + name});
+			if (r.type == ':') return r.integer;
+		} catch (const std::exception&) { errors_++; }
+		return -1;
+	}
+
+	void pushPool(const std::string& name, const json& item) {
+		try { client_->command({"RPUSH", prefix_ + "pool:" + name, item.dump()}); }
+		catch (const std::exception&) { errors_++; }
+	}
+
+	uint64_t errors() const { return errors_.load(); }
+
+private:
+	std::unique_ptr<RespClient> client_;
+	std::string                 prefix_;
+	std::atomic<uint64_t>       errors_{0};
+};
+
+// Built from REDIS_ADDR, REDIS_PASSWORD, REDIS_TIMEOUT_MS and REDIS_PREFIX;
+// null when REDIS_ADDR is unset
+static std::shared_ptr<SharedTier> sharedTierFromEnv() {
+	const char* addr = std::getenv("REDIS_ADDR");
+	if (!addr || !*addr) return nullptr;
+	std::string a = addr;
+	auto colon = a.rfind(':');
+	std::string host = colon == std::string::npos ? a : a.substr(0, colon);
+	std::string port = colon == std::string::npos ? "6379" : a.substr(colon + 1);
+	const char* pw     = std::getenv("REDIS_PASSWORD");
+	const char* prefix = std::getenv("REDIS_PREFIX");
+	return std::make_shared<SharedTier>(
+		std::make_unique<RespClient>(host, port,
+			std::chrono::milliseconds((long)envDouble("REDIS_TIMEOUT_MS", 50)), pw ? pw : ""),
+		prefix ? prefix : "dnd:");
+}
+
+// ————————————————————————————————————————————————
+// Exact-match response cache. Keys are a hash of the normalized request
+// parameters; each key holds up to `variants` generated responses, and only
+// once it is full are requests answered from it (with a random variant), so
+// repeated requests still vary. Variants are kept serialized, with a strong
+// ETag, so a hit costs no JSON work. Entries expire `ttl` after their first fill.
+// The cache is split into lock-striped shards that together hold at most
+// `maxBytes` of keys and serialized responses; W-TinyLFU admission keeps the
+// popular tuples resident against a long tail of one-off requests. With a
+// shared tier, local misses are looked up there and new variants are written
+// through.
+
+// Enumerated parameters compare case-insensitively, free text only has its
+// whitespace collapsed; empty values are dropped
+static std::string canonicalParams(const std::string& route, const json& in) {
+	static const std::set<std::string> enumerated = {
+		"type", "handedness", "subtype", "rarity", "clothingPiece",
+		"race", "settlementSize", "shopType"
+	};
+	json norm = json::object();   // keys are kept sorted, so dump() is canonical
+	for (auto& [k, v] : in.items()) {
+		if (!v.is_string()) continue;
+		std::string val;
+		bool space = false;
+		for (char c : trim(v.get<std::string>())) {
+			if (std::isspace((unsigned char)c)) { space = true; continue; }
+			if (space) { val.push_back(' '); space = false; }
+			val.push_back(enumerated.count(k) ? (char)std::tolower((unsigned char)c) : c);
+		}
+		if (!val.empty()) norm[k] = val;
+	}
+	return route + "|" + norm.dump();
+}
+
+// 64-bit FNV-1a
+static uint64_t fnv1a(const std::string& s) {
+	uint64_t h = 1469598103934665603ull;
+	for (unsigned char c : s) { h ^= c; h *= 1099511628211ull; }
+	return h;
+}
+
+// If-None-Match holds "*" or a comma-separated list of (possibly weak) ETags
+static bool etagMatches(const std::string& ifNoneMatch, const std::string& etag) {
+	std::stringstream ss(ifNoneMatch);
+	std::string tag;
+	while (std::getline(ss, tag, ',')) {
+		tag = trim(tag);
+		if (tag.rfind("W/", 0) == 0) tag = tag.substr(2);
+		if (tag == "*" || tag == etag) return true;
+	}
+	return false;
+}
+
+class ResponseCache {
+public:
+	// A response body ready to send, with its strong ETag
+	struct Body {
+		std::string bytes;
+		std::string etag;
+	};
+	using BodyPtr = std::shared_ptr<const Body>;
+
+	static BodyPtr makeBody(std::string bytes) {
+		char tag[20];
+		std::snprintf(tag, sizeof(tag), "\"%016llx\"", (unsigned long long)fnv1a(bytes));
+		return std::make_shared<const Body>(Body{std::move(bytes), tag});
+	}
+	static BodyPtr makeBody(const json& item) { return makeBody(item.dump()); }
+
+	// A key and its variants, for bulk warm-up
+	struct WarmEntry {
+		std::string          canonical;
+		std::vector<BodyPtr> variants;
+		Clock::time_point    created = Clock::now();
+	};
+
+	ResponseCache(size_t maxBytes, size_t shards, size_t variants, std::chrono::seconds ttl)
+		: maxBytes_(maxBytes), variants_(std::max<size_t>(variants, 1)), ttl_(ttl),
+		  shards_(std::max<size_t>(shards, 1))
+	{
+		for (auto& sh : shards_) sh.setCapacity(maxBytes_ / shards_.size());
+	}
+
+	size_t variants() const { return variants_; }
+
+	void setShared(std::shared_ptr<SharedTier> shared) { shared_ = std::move(shared); }
+
+	// Hit only when the key holds its full set of variants. A variant matching
+	// `ifNoneMatch` is preferred, so a revalidating client can get a 304.
+	bool get(const std::string& canonical, BodyPtr& out, const std::string& ifNoneMatch = "") {
+		uint64_t h = fnv1a(canonical);
+		Shard& sh = shardFor(h);
+		{
+			std::lock_guard<std::mutex> lk(sh.m);
+			sh.sketch.increment(h);
+			Entry* e = sh.find(canonical, h, ttl_);
+			if (e && e->variants.size() >= variants_) {
+				sh.touch(*e);
+				out = pick(sh, e->variants, ifNoneMatch);
+				sh.hits++;
+				return true;
+			}
+			if (!shared_) { sh.misses++; return false; }
+		}
+		auto remote = shared_->getVariants({canonical});
+		if (remote[0].size() < variants_) {
+			std::lock_guard<std::mutex> lk(sh.m);
+			sh.misses++;
+			return false;
+		}
+		std::vector<BodyPtr> bodies;
+		for (size_t i = 0; i < variants_; ++i) bodies.push_back(makeBody(std::move(remote[0][i])));
+		std::lock_guard<std::mutex> lk(sh.m);
+		out = pick(sh, bodies, ifNoneMatch);
+		sh.install(canonical, h, std::move(bodies), Clock::now(), false);
+		sh.sharedHits++;
+		return true;
+	}
+
+	// True while the key is missing or still collecting variants
+	bool needsFill(const std::string& canonical) {
+		uint64_t h = fnv1a(canonical);
+		Shard& sh = shardFor(h);
+		std::lock_guard<std::mutex> lk(sh.m);
+		Entry* e = sh.find(canonical, h, ttl_);
+		return !e || e->variants.size() < variants_;
+	}
+
+	// Pull any keys another replica has already filled into the local cache,
+	// in one round trip
+	void prefetch(const std::vector<std::string>& canonicals) {
+		if (!shared_ || canonicals.empty()) return;
+		auto remote = shared_->getVariants(canonicals);
+		std::vector<WarmEntry> found;
+		for (size_t i = 0; i < canonicals.size(); ++i) {
+			if (remote[i].size() < variants_) continue;
+			WarmEntry w{canonicals[i], {}};
+			for (auto& b : remote[i]) w.variants.push_back(makeBody(std::move(b)));
+			found.push_back(std::move(w));
+		}
+		for (auto& [shard, n] : warmInto(found, true)) shards_[shard].sharedHits += n;
+	}
+
+	// `share` = false keeps the variant local
+	void put(const std::string& canonical, BodyPtr body, bool share = true) {
+		uint64_t h = fnv1a(canonical);
+		Shard& sh = shardFor(h);
+		{
+			std::lock_guard<std::mutex> lk(sh.m);
+			Entry* e = sh.find(canonical, h, ttl_);
+			if (!e) {
+				sh.install(canonical, h, {body}, Clock::now(), false);
+			} else {
+				if (e->variants.size() >= variants_) return;
+				e->variants.push_back(body);
+				sh.grow(*e, bodyBytes(*body));
+			}
+			sh.fills++;
+		}
+		if (share && shared_) shared_->addVariant(canonical, body->bytes, variants_, ttl_);
+	}
+
+	// Bulk warm-up (archive replay, snapshot restore): one lock per shard, and
+	// entries go straight into the main region while it has room
+	size_t warm(std::vector<WarmEntry> entries) {
+		size_t n = 0;
+		for (auto& [shard, count] : warmInto(entries, false)) n += count;
+		return n;
+	}
+
+	// Live entries, hottest first, for the warm-restart snapshot
+	json snapshot() const {
+		json out = json::array();
+		auto now = Clock::now();
+		for (auto& sh : shards_) {
+			std::lock_guard<std::mutex> lk(sh.m);
+			for (auto* region : {&sh.protected_, &sh.probation, &sh.window})
+				for (uint64_t h : *region) {
+					const Entry& e = sh.map.at(h);
+					if (now - e.created > ttl_) continue;
+					json variants = json::array();
+					for (auto& v : e.variants) variants.push_back(v->bytes);
+					out.push_back({
+						{"key",      e.canonical},
+						{"created",  std::chrono::duration_cast<std::chrono::seconds>(e.created.time_since_epoch()).count()},
+						{"variants", variants}
+					});
+				}
+		}
+		return out;
+	}
+
+	void restore(const json& entries) {
+		std::vector<WarmEntry> warmed;
+		for (auto& e : entries) {
+			Clock::time_point created{std::chrono::seconds(e.at("created").get<int64_t>())};
+			WarmEntry w{e.at("key"), {}, created};
+			for (auto& v : e.at("variants")) w.variants.push_back(makeBody(v.get<std::string>()));
+			warmed.push_back(std::move(w));
+		}
+		warm(std::move(warmed));
+	}
+
+	json stats() const {
+		json perShard = json::array();
+		uint64_t keys = 0, bytes = 0, hits = 0, misses = 0, fills = 0, evictions = 0,
+				 rejections = 0, expirations = 0, sharedHits = 0;
+		for (auto& sh : shards_) {
+			std::lock_guard<std::mutex> lk(sh.m);
+			keys += sh.map.size();       bytes += sh.bytes();
+			hits += sh.hits;             misses += sh.misses;
+			fills += sh.fills;           evictions += sh.evictions;
+			rejections += sh.rejections; expirations += sh.expirations;
+			sharedHits += sh.sharedHits;
+			perShard.push_back({
+				{"keys",       sh.map.size()},
+				{"bytes",      sh.bytes()},
+				{"evictions",  sh.evictions},
+				{"rejections", sh.rejections}
+			});
+		}
+		return {
+			{"keys",         keys},
+			{"bytes",        bytes},
+			{"maxBytes",     maxBytes_},
+			{"variants",     variants_},
+			{"ttlSeconds",   ttl_.count()},
+			{"hits",         hits},
+			{"misses",       misses},
+			{"fills",        fills},
+			{"evictions",    evictions},
+			{"rejections",   rejections},
+			{"expirations",  expirations},
+			{"shards",       perShard},
+			{"shared",       shared_ != nullptr},
+			{"sharedHits",   sharedHits},
+			{"sharedErrors", shared_ ? shared_->errors() : 0}
+		};
+	}
+
+private:
+	enum Region : uint8_t { WINDOW, PROBATION, PROTECTED };
+
+	struct Entry {
+		std::string                   canonical;
+		std::vector<BodyPtr>          variants;
+		Clock::time_point             created;
+		size_t                        bytes;
+		Region                        region;
+		std::list<uint64_t>::iterator pos;
+	};
+
+	// Count-min sketch of access frequency (4 rows, counters saturate at 15);
+	// every counter is halved after 10 × width increments so old popularity fades
+	class FrequencySketch {
+	public:
+		void resize(size_t entries) {
+			width_ = 64;
+			while (width_ < entries && width_ < (1u << 20)) width_ <<= 1;
+			table_.assign(4 * width_, 0);
+			additions_ = 0;
+		}
+
+		void increment(uint64_t h) {
+			bool added = false;
+			for (size_t i = 0; i < 4; ++i) {
+				uint8_t& c = table_[i * width_ + index(h, i)];
+				if (c < 15) { c++; added = true; }
+			}
+			if (added && ++additions_ >= 10 * width_) {
+				for (auto& c : table_) c >>= 1;
+				additions_ /= 2;
+			}
+		}
+
+		uint8_t estimate(uint64_t h) const {
+			uint8_t m = 15;
+			for (size_t i = 0; i < 4; ++i) m = std::min(m, table_[i * width_ + index(h, i)]);
+			return m;
+		}
+
+	private:
+		size_t index(uint64_t h, size_t row) const {
+			static const uint64_t seeds[4] = {
+				0xc3a5c85c97cb3127ull, 0xb492b66fbe98f273ull, 0x9ae16a3b2f90404full, 0xcbf29ce484222325ull
+			};
+			uint64_t x = (h ^ seeds[row]) * 0x9e3779b97f4a7c15ull;
+			return (size_t)(x >> 32) & (width_ - 1);
+		}
+
+		std::vector<uint8_t> table_;
+		size_t               width_     = 64;
+		size_t               additions_ = 0;
+	};
+
+	// One lock stripe: a small LRU admission window in front of a segmented
+	// LRU main region (probation + protected). Keys evicted from the window
+	// only enter the main region if they are used more often than its victim.
+	struct Shard {
+		mutable std::mutex                  m;
+		std::unordered_map<uint64_t, Entry> map;
+		std::list<uint64_t>                 window, probation, protected_;
+		size_t windowBytes = 0, probationBytes = 0, protectedBytes = 0;
+		size_t windowMax = 0, mainMax = 0, protectedMax = 0;
+		FrequencySketch                     sketch;
+		std::mt19937_64                     gen{ std::random_device{}() };
+		uint64_t hits = 0, misses = 0, fills = 0, evictions = 0, rejections = 0,
+				 expirations = 0, sharedHits = 0;
+
+		// Window 1% of the stripe, protected 80% of the main region
+		void setCapacity(size_t bytes) {
+			windowMax    = std::max<size_t>(bytes / 100, 1);
+			mainMax      = bytes - std::min(bytes, windowMax);
+			protectedMax = mainMax / 5 * 4;
+			sketch.resize(bytes / 1024);   // ~1 KB per response
+		}
+
+		size_t bytes() const { return windowBytes + probationBytes + protectedBytes; }
+
+		std::list<uint64_t>& list(Region r) {
+			return r == WINDOW ? window : r == PROBATION ? probation : protected_;
+		}
+		size_t& regionBytes(Region r) {
+			return r == WINDOW ? windowBytes : r == PROBATION ? probationBytes : protectedBytes;
+		}
+
+		// Drops the entry if it has expired
+		Entry* find(const std::string& canonical, uint64_t h, std::chrono::seconds ttl) {
+			auto it = map.find(h);
+			if (it == map.end() || it->second.canonical != canonical) return nullptr;
+			if (Clock::now() - it->second.created > ttl) {
+				erase(it->second);
+				expirations++;
+				return nullptr;
+			}
+			return &it->second;
+		}
+
+		void link(Entry& e, Region r) {
+			e.region = r;
+			list(r).push_front(fnv1a(e.canonical));
+			e.pos = list(r).begin();
+			regionBytes(r) += e.bytes;
+		}
+
+		void unlink(Entry& e) {
+			list(e.region).erase(e.pos);
+			regionBytes(e.region) -= e.bytes;
+		}
+
+		void erase(Entry& e) {
+			unlink(e);
+			map.erase(fnv1a(e.canonical));
+		}
+
+		void touch(Entry& e) {
+			Region to = e.region == WINDOW ? WINDOW : PROTECTED;
+			unlink(e);
+			link(e, to);
+			balance();
+		}
+
+		void grow(Entry& e, size_t delta) {
+			e.bytes += delta;
+			regionBytes(e.region) += delta;
+			balance();
+		}
+
+		// New keys start in the window (or, for warm-up, directly in probation
+		// while the main region has room)
+		void install(const std::string& canonical, uint64_t h, std::vector<BodyPtr> variants,
+					 Clock::time_point created, bool toMain)
+		{
+			auto old = map.find(h);
+			if (old != map.end()) erase(old->second);   // hash collision or refresh
+			size_t bytes = sizeof(Entry) + 2 * sizeof(void*) + canonical.size();
+			for (auto& v : variants) bytes += bodyBytes(*v);
+			Entry& e = map.emplace(h, Entry{canonical, std::move(variants), created, bytes, WINDOW, {}}).first->second;
+			link(e, toMain && probationBytes + protectedBytes + bytes <= mainMax ? PROBATION : WINDOW);
+			balance();
+		}
+
+		// Restore the region limits after an insert, promotion or growth
+		void balance() {
+			while (protectedBytes > protectedMax) {
+				Entry& e = map.at(protected_.back());
+				unlink(e);
+				link(e, PROBATION);
+			}
+			while (windowBytes > windowMax && !window.empty()) {
+				Entry& cand = map.at(window.back());
+				unlink(cand);
+				admit(cand);
+			}
+			while (probationBytes + protectedBytes > mainMax) evictMain();
+		}
+
+		// TinyLFU: a window candidate replaces main-region victims only while
+		// it is more popular than each of them
+		void admit(Entry& cand) {
+			if (cand.bytes > mainMax) { reject(cand); return; }
+			uint8_t freq = sketch.estimate(fnv1a(cand.canonical));
+			while (probationBytes + protectedBytes + cand.bytes > mainMax) {
+				auto& victims = probation.empty() ? protected_ : probation;
+				if (sketch.estimate(victims.back()) >= freq) { reject(cand); return; }
+				evictMain();
+			}
+			link(cand, PROBATION);
+		}
+
+		void reject(Entry& cand) {
+			map.erase(fnv1a(cand.canonical));
+			rejections++;
+			evictions++;
+		}
+
+		void evictMain() {
+			auto& victims = probation.empty() ? protected_ : probation;
+			erase(map.at(victims.back()));
+			evictions++;
+		}
+	};
+
+	Shard& shardFor(uint64_t h) { return shards_[(h >> 48) % shards_.size()]; }
+
+	// Bytes held by one cached body, including its control block
+	static size_t bodyBytes(const Body& b) {
+		return sizeof(Body) + 2 * sizeof(void*) + b.bytes.capacity() + b.etag.capacity();
+	}
+
+	// Must be called with the shard's lock held
+	static BodyPtr pick(Shard& sh, const std::vector<BodyPtr>& variants, const std::string& ifNoneMatch) {
+		if (!ifNoneMatch.empty())
+			for (auto& v : variants)
+				if (etagMatches(ifNoneMatch, v->etag)) return v;
+		std::uniform_int_distribution<size_t> d(0, variants.size() - 1);
+		return variants[d(sh.gen)];
+	}
+
+	// Installs entries shard by shard; returns installed counts per shard index
+	std::map<size_t, size_t> warmInto(std::vector<WarmEntry>& entries, bool onlyIfMissing) {
+		std::map<size_t, std::vector<WarmEntry*>> byShard;
+		for (auto& e : entries) {
+			uint64_t h = fnv1a(e.canonical);
+			byShard[(h >> 48) % shards_.size()].push_back(&e);
+		}
+		std::map<size_t, size_t> installed;
+		auto now = Clock::now();
+		for (auto& [idx, list] : byShard) {
+			Shard& sh = shards_[idx];
+			std::lock_guard<std::mutex> lk(sh.m);
+			for (WarmEntry* e : list) {
+				if (now - e->created > ttl_ || e->variants.empty()) continue;
+				uint64_t h = fnv1a(e->canonical);
+				Entry* cur = sh.find(e->canonical, h, ttl_);
+				if (onlyIfMissing && cur && cur->variants.size() >= variants_) continue;
+				if (e->variants.size() > variants_) e->variants.resize(variants_);
+				sh.sketch.increment(h);
+				sh.install(e->canonical, h, std::move(e->variants), e->created, true);
+				installed[idx]++;
+			}
+		}
+		return installed;
+	}
+
+	size_t                      maxBytes_;
+	size_t                      variants_;
+	std::chrono::seconds        ttl_;
+	std::vector<Shard>          shards_;
+	std::shared_ptr<SharedTier> shared_;
+};
+
+// ?nocache=1 or Cache-Control: no-cache skips the response cache
+static bool cacheOptOut(const crow::request& req) {
+	if (req.url_params.get("nocache")) return true;
+	return req.get_header_value("Cache-Control").find("no-cache") != std::string::npos;
+}
+
+// Send a serialized body with its ETag, or 304 when the client already has it.
+// Cacheable responses may be kept by clients and CDNs for HTTP_MAX_AGE_SECONDS.
+static crow::response bodyResponse(const crow::request& req, const ResponseCache::Body& body, bool cacheable) {
+	static const long maxAge = (long)envDouble("HTTP_MAX_AGE_SECONDS", 60);
+	std::string inm = req.get_header_value("If-None-Match");
+	crow::response res;
+	if (!inm.empty() && etagMatches(inm, body.etag)) {
+		res.code = 304;
+	} else {
+		res.body = body.bytes;
+		res.set_header("Content-Type","application/json");
+	}
+	res.set_header("ETag", body.etag);
+	res.set_header("Cache-Control", cacheable ? "public, max-age=" + std::to_string(maxAge) : "no-store");
+	return res;
+}
+
+// ————————————————————————————————————————————————
+// Peer ring: replicas listed in PEERS (comma-separated base URLs, including
+// this node's own PEER_SELF) share a consistent-hash ring. Each normalized
+// key has one owner that generates and caches it; other nodes forward the
+// request there and fall back to serving it themselves if the owner fails.
+
+class PeerRing {
+public:
+	PeerRing(std::vector<std::string> peers, std::string self, size_t vnodes,
+			 std::chrono::milliseconds timeout, std::chrono::seconds retry)
+		: peers_(std::move(peers)), self_(std::move(self)), timeout_(timeout), retry_(retry),
+		  downUntil_(peers_.size())
+	{
+		for (size_t i = 0; i < peers_.size(); ++i)
+			for (size_t v = 0; v < vnodes; ++v)
+				ring_[fnv1a(peers_[i] + "#" + std::to_string(v))] = i;
+	}
+
+	bool enabled() const { return peers_.size() > 1; }
+
+	// Owner's base URL, or nullopt when this node owns the key (or the owner
+	// recently failed)
+	std::optional<std::string> ownerOf(const std::string& canonical) const {
+		if (!enabled()) return std::nullopt;
+		auto it = ring_.lower_bound(fnv1a(canonical));
+		if (it == ring_.end()) it = ring_.begin();
+		const std::string& owner = peers_[it->second];
+		if (owner == self_) return std::nullopt;
+		std::lock_guard<std::mutex> lk(m_);
+		if (Clock::now() < downUntil_[it->second]) return std::nullopt;
+		return owner;
+	}
+
+	// Replay the request on the owner; nullopt sends it down the local path
+	std::optional<crow::response> forward(const std::string& owner, const crow::request& req) {
+		cpr::Header headers{{"X-Peer-Forward", self_}};
+		for (const char* h : {"Cache-Control", "If-None-Match"}) {
+			std::string v = req.get_header_value(h);
+			if (!v.empty()) headers[h] = v;
+		}
+		cpr::Response r = cpr::Get(cpr::Url{owner + req.raw_url}, headers, cpr::Timeout{timeout_});
+		if (r.error || (r.status_code != 200 && r.status_code != 304)) {
+			std::lock_guard<std::mutex> lk(m_);
+			for (size_t i = 0; i < peers_.size(); ++i)
+				if (peers_[i] == owner) downUntil_[i] = Clock::now() + retry_;
+			forwardErrors_++;
+			return std::nullopt;
+		}
+		crow::response res((int)r.status_code, r.text);
+		if (r.status_code == 200) res.set_header("Content-Type", "application/json");
+		for (const char* h : {"ETag", "Cache-Control", "X-Cache", "X-Item-Id",
+							  "X-Fallback", "X-Fallback-Reason", "X-Fallback-Score"})
+			if (r.header.count(h)) res.set_header(h, r.header[h]);
+		res.set_header("X-Peer", owner);
+		forwarded_++;
+		return res;
+	}
+
+	// Requests already forwarded by a peer are always served locally
+	static bool fromPeer(const crow::request& req) {
+		return !req.get_header_value("X-Peer-Forward").empty();
+	}
+
+	json stats() const {
+		return {
+			{"peers",         peers_},
+			{"self",          self_},
+			{"forwarded",     forwarded_.load()},
+			{"forwardErrors", forwardErrors_.load()}
+		};
+	}
+
+private:
+	std::vector<std::string>       peers_;
+	std::string                    self_;
+	std::chrono::milliseconds      timeout_;
+	std::chrono::seconds           retry_;
+	std::map<uint64_t, size_t>     ring_;
+	mutable std::mutex             m_;
+	std::vector<Clock::time_point> downUntil_;
+	std::atomic<uint64_t>          forwarded_{0}, forwardErrors_{0};
+};
+
+// Built from PEERS, PEER_SELF, PEER_VNODES, PEER_TIMEOUT_MS and
+// PEER_RETRY_SECONDS; a single-node ring (forwarding off) when unset
+static std::unique_ptr<PeerRing> peerRingFromEnv() {
+	std::vector<std::string> peers;
+	const char* list = std::getenv("PEERS");
+	const char* self = std::getenv("PEER_SELF");
+	if (list) {
+		std::stringstream ss(list);
+		std::string p;
+		while (std::getline(ss, p, ',')) {
+			p = trim(p);
+			while (!p.empty() && p.back() == '/') p.pop_back();
+			if (!p.empty()) peers.push_back(p);
+		}
+	}
+	std::string me = self ? trim(self) : "";
+	while (!me.empty() && me.back() == '/') me.pop_back();
+	if (!peers.empty() && std::find(peers.begin(), peers.end(), me) == peers.end()) {
+		std::cerr << "PEER_SELF is not in PEERS; peer forwarding disabled\n";
+		peers.clear();
+	}
+	return std::make_unique<PeerRing>(peers, me,
+		(size_t)envDouble("PEER_VNODES", 64),
+		std::chrono::milliseconds((long)envDouble("PEER_TIMEOUT_MS", 30000)),
+		std::chrono::seconds((long)envDouble("PEER_RETRY_SECONDS", 5)));
+}
+
+// ————————————————————————————————————————————————
+// Request coalescing: concurrent requests with the same normalized parameters
+// attach to one in-flight generation. The leader waits COALESCE_WINDOW_MS for
+// followers, then asks for one candidate per waiter (up to
+// COALESCE_MAX_CANDIDATES) so each gets a distinct response where possible.
+
+class SingleFlight {
+public:
+	// Generates n results (or fewer) for one flight
+	using Generate = std::function<std::vector<json>(size_t n)>;
+
+	SingleFlight(std::chrono::milliseconds window, size_t maxCandidates)
+		: window_(window), maxCandidates_(std::max<size_t>(maxCandidates, 1)) {}
+
+	// Returns this caller's result; *led is set when this caller generated it.
+	// A flight takes joiners until it is full or its leader starts generating,
+	// so every caller gets its own candidate. The leader only waits the window
+	// for followers while another generation of the key is running, i.e. while
+	// requests for it keep arriving.
+	json run(const std::string& key, const Generate& generate, bool* led = nullptr) {
+		std::shared_ptr<Flight> f;
+		size_t slot   = 0;
+		bool   leader = false;
+		bool   wait   = false;
+		{
+			std::lock_guard<std::mutex> lk(m_);
+			auto it = flights_.find(key);
+			if (it != flights_.end()) {
+				f = it->second;
+				std::lock_guard<std::mutex> fl(f->m);
+				slot = f->joined++;
+				if (f->joined >= maxCandidates_) flights_.erase(it);   // full
+				followers_++;
+				f->cv.notify_all();
+			} else {
+				f = std::make_shared<Flight>();
+				if (maxCandidates_ > 1) flights_[key] = f;
+				wait   = generating_.count(key) > 0;
+				leader = true;
+				leaders_++;
+			}
+		}
+		if (led) *led = leader;
+
+		if (leader) {
+			// Wait up to the window for followers, then close the flight
+			if (wait && window_.count() > 0) {
+				std::unique_lock<std::mutex> fl(f->m);
+				f->cv.wait_for(fl, window_, [&]{ return f->joined >= maxCandidates_; });
+			}
+			size_t n;
+			{
+				std::lock_guard<std::mutex> lk(m_);
+				auto it = flights_.find(key);
+				if (it != flights_.end() && it->second == f) flights_.erase(it);   // later arrivals start a new flight
+				generating_[key]++;
+				std::lock_guard<std::mutex> fl(f->m);
+				n = f->joined;
+			}
+			std::vector<json> results;
+			std::string error;
+			try {
+				results = generate(n);
+				if (results.empty()) error = "Generation returned no results";
+			} catch (const std::exception& e) {
+				error = e.what();
+			} catch (...) {
+				error = "Generation failed";
+			}
+			{
+				std::lock_guard<std::mutex> lk(m_);
+				if (--generating_[key] == 0) generating_.erase(key);
+			}
+			std::lock_guard<std::mutex> fl(f->m);
+			f->results = std::move(results);
+			f->error   = std::move(error);
+			f->done    = true;
+			f->cv.notify_all();
+		}
+
+		std::unique_lock<std::mutex> fl(f->m);
+		f->cv.wait(fl, [&]{ return f->done; });
+		if (!f->error.empty()) throw std::runtime_error(f->error);
+		return f->results[slot % f->results.size()];
+	}
+
+	json stats() const {
+		std::lock_guard<std::mutex> lk(m_);
+		return {
+			{"inFlight",  flights_.size()},
+			{"leaders",   leaders_},
+			{"followers", followers_}
+		};
+	}
+
+private:
+	struct Flight {
+		std::mutex              m;
+		std::condition_variable cv;
+		size_t                  joined = 1;
+		bool                    done   = false;
+		std::vector<json>       results;
+		std::string             error;
+	};
+
+	std::chrono::milliseconds                                window_;
+	size_t                                                   maxCandidates_;
+	mutable std::mutex                                       m_;
+	std::unordered_map<std::string, std::shared_ptr<Flight>> flights_;      // open to joiners
+	std::unordered_map<std::string, int>                     generating_;   // closed, still running
+	uint64_t leaders_ = 0, followers_ = 0;
+};
+
+// ————————————————————————————————————————————————
+// Persistent item store: append-only, checksummed segments under
+// ITEM_STORE_DIR (default "store"), each preallocated to ITEM_STORE_SEGMENT_MB
+// and memory-mapped for both appends and reads. Every generated item is
+// recorded with its parameters, provider, model, token usage and latency,
+// indexed by ID and parameter key, and replayed at startup. Past
+// ITEM_STORE_MAX_MB the oldest segment is deleted; segments that cannot be
+// mapped are set aside as .bad and skipped.
+//
+// Record: [magic u32][payload length u32][crc32 u32][reserved u32][id u64]
+//         [JSON payload, zero-padded to 8 bytes]
+// The header is written last, so a torn append leaves a zero magic that
+// ends the replay of that segment.
+
+static uint32_t crc32(const char* data, size_t len) {
+	static const auto table = []{
+		std::array<uint32_t, 256> t{};
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			t[i] = c;
+		}
+		return t;
+	}();
+	uint32_t c = 0xFFFFFFFFu;
+	for (size_t i = 0; i < len; ++i) c = table[(c ^ (unsigned char)data[i]) & 0xFF] ^ (c >> 8);
+	return c ^ 0xFFFFFFFFu;
+}
+
+class ItemStore {
+public:
+	struct Record {
+		uint64_t    id = 0;
+		std::string key;         // canonicalParams() of the request
+		std::string kind;        // "gear" or "shopkeeper"
+		json        params;
+		json        item;
+		std::string provider;
+		std::string model;
+		LlmUsage    usage;
+		double      latencyMs = 0;
+		int64_t     created   = 0;
+	};
+
+	ItemStore(std::string dir, size_t segmentBytes, size_t maxBytes = 0)
+		: dir_(std::move(dir)), segmentBytes_(segmentBytes),
+		  maxBytes_(maxBytes ? std::max(maxBytes, 2 * segmentBytes) : 0) {}
+
+	~ItemStore() {
+		for (auto& seg : segments_) {
+			msync(seg.base, seg.size, MS_SYNC);
+			munmap(seg.base, seg.size);
+			close(seg.fd);
+		}
+	}
+
+	// Map existing segments and rebuild the indexes; calls visit for every
+	// valid record in append order. Segments past the size cap are deleted,
+	// and ones that cannot be mapped are renamed to .bad, oldest first.
+	void open(const std::function<void(const Record&)>& visit) {
+		std::lock_guard<std::mutex> lk(m_);
+		std::filesystem::create_directories(dir_);
+		std::vector<std::string> names;
+		for (auto& e : std::filesystem::directory_iterator(dir_)) {
+			std::string n = e.path().filename().string();
+			if (n.rfind("seg-", 0) == 0 && n.size() > 8 && n.compare(n.size() - 4, 4, ".dat") == 0) {
+				names.push_back(n);
+				nextSegment_ = std::max(nextSegment_, (size_t)std::strtoull(n.c_str() + 4, nullptr, 10) + 1);
+			}
+		}
+		std::sort(names.begin(), names.end());
+
+		// Newest segments first up to the cap, leaving room for the next one
+		size_t keepFrom = 0, bytes = segmentBytes_;
+		for (size_t i = names.size(); i-- > 0; ) {
+			std::error_code ec;
+			bytes += (size_t)std::filesystem::file_size(dir_ + "/" + names[i], ec);
+			if (maxBytes_ && bytes > maxBytes_) { keepFrom = i + 1; break; }
+		}
+		for (size_t i = 0; i < names.size(); ++i) {
+			std::string path = dir_ + "/" + names[i];
+			if (i < keepFrom) {
+				std::cerr << "Item store: " << path << " is past ITEM_STORE_MAX_MB, deleted\n";
+				std::filesystem::remove(path);
+				continue;
+			}
+			try {
+				mapSegment(path, 0);
+			} catch (const std::exception& e) {
+				std::cerr << "Item store: " << e.what() << ", set aside as .bad\n";
+				std::error_code ec;
+				std::filesystem::rename(path, path + ".bad", ec);
+				continue;
+			}
+			replaySegment(segments_.size() - 1, visit);
+		}
+		if (segments_.empty()) newSegment();
+	}
+
+	// Append a record, assigning and returning its ID
+	uint64_t append(Record rec) {
+		std::lock_guard<std::mutex> lk(m_);
+		if (segments_.empty()) throw std::runtime_error("Item store is not open");
+		rec.id = nextId_++;
+		std::string payload = toJson(rec).dump();
+		size_t need = HEADER + pad8(payload.size());
+		if (need > segmentBytes_) throw std::runtime_error("Item too large for a store segment");
+		if (segments_.back().used + need > segments_.back().size) newSegment();
+
+		Segment& seg = segments_.back();
+		char* p = seg.base + seg.used;
+		std::memcpy(p + HEADER, payload.data(), payload.size());
+		uint32_t hdr[4] = {MAGIC, (uint32_t)payload.size(), crc32(payload.data(), payload.size()), 0};
+		std::memcpy(p + 16, &rec.id, 8);
+		std::memcpy(p, hdr, 16);
+		msync(pageAlign(p), (p + need) - pageAlign(p), MS_ASYNC);
+
+		index(rec, dropped_ + segments_.size() - 1, seg.used);
+		seg.used += need;
+		return rec.id;
+	}
+
+	std::optional<Record> get(uint64_t id) const {
+		std::lock_guard<std::mutex> lk(m_);
+		auto it = byId_.find(id);
+		if (it == byId_.end()) return std::nullopt;
+		return readAt(it->second.first, it->second.second);
+	}
+
+	// The archived item whose parameters are closest to `params`, scored by
+	// weighted matches over the fields below; fields missing from `params`
+	// match anything. Only items of the requested type (shopType for
+	// shopkeepers) qualify, and only with a score of at least minScore.
+	// Ties go to the newest record. Each distinct combination of fields is
+	// scored once, so the cost does not grow with the archive.
+	std::optional<std::pair<Record, double>> nearest(const std::string& kind, const json& params,
+													 double minScore = 0) const {
+		uint8_t k  = kindTag(kind);
+		size_t  tf = typeField(k);
+		std::lock_guard<std::mutex> lk(m_);
+		Fields want{};
+		double total = 0;
+		for (size_t f = 0; f < FIELDS; ++f) {
+			std::string v = fieldValue(params, f);
+			auto it = interned_.find(v);
+			want[f] = v.empty() ? 0 : (it == interned_.end() ? UINT32_MAX : it->second);
+			if (want[f]) total += FIELD_WEIGHTS[f];
+		}
+		uint64_t best = 0;
+		double bestScore = -1;
+		for (auto& [bucket, combos] : byType_) {
+			if ((uint8_t)(bucket >> 32) != k || (want[tf] && (uint32_t)bucket != want[tf])) continue;
+			for (auto& [fields, id] : combos) {
+				double score = 0;
+				for (size_t f = 0; f < FIELDS; ++f)
+					if (want[f] && fields[f] == want[f]) score += FIELD_WEIGHTS[f];
+				if (score > bestScore || (score == bestScore && id > best)) { bestScore = score; best = id; }
+			}
+		}
+		if (!best) return std::nullopt;
+		double score = total > 0 ? bestScore / total : 1.0;
+		if (score < minScore) return std::nullopt;
+		auto loc = byId_.at(best);
+		return std::make_pair(readAt(loc.first, loc.second), score);
+	}
+
+	// IDs stored under a parameter key, oldest first
+	std::vector<uint64_t> idsForKey(const std::string& key) const {
+		std::lock_guard<std::mutex> lk(m_);
+		auto it = byKey_.find(key);
+		return it == byKey_.end() ? std::vector<uint64_t>{} : it->second;
+	}
+
+	static json toJson(const Record& r) {
+		return {
+			{"id",        r.id},
+			{"key",       r.key},
+			{"kind",      r.kind},
+			{"params",    r.params},
+			{"item",      r.item},
+			{"provider",  r.provider},
+			{"model",     r.model},
+			{"usage",     {{"promptTokens", r.usage.promptTokens}, {"outputTokens", r.usage.outputTokens}}},
+			{"latencyMs", r.latencyMs},
+			{"created",   r.created}
+		};
+	}
+
+	json stats() const {
+		std::lock_guard<std::mutex> lk(m_);
+		size_t bytes = 0;
+		for (auto& seg : segments_) bytes += seg.used;
+		return {
+			{"records",  byId_.size()},
+			{"keys",     byKey_.size()},
+			{"segments", segments_.size()},
+			{"bytes",    bytes},
+			{"maxBytes", maxBytes_}
+		};
+	}
+
+private:
+	static constexpr uint32_t MAGIC  = 0x314D5449;   // "ITM1"
+	static constexpr size_t   HEADER = 24;
+
+	// Similarity fields for nearest(); values are interned, 0 means empty
+	static constexpr size_t FIELDS = 8;
+	static constexpr const char* FIELD_NAMES[FIELDS] = {
+		"type", "subtype", "rarity", "handedness", "clothingPiece",
+		"race", "shopType", "settlementSize"
+	};
+	static constexpr double FIELD_WEIGHTS[FIELDS] = {4, 3, 2, 1, 1, 2, 4, 1};
+
+	using Fields = std::array<uint32_t, FIELDS>;
+
+	static uint8_t kindTag(const std::string& kind) { return kind == "gear" ? 1 : kind == "shopkeeper" ? 2 : 0; }
+	// Field a fallback must match exactly: type for gear, shopType for shopkeepers
+	static size_t typeField(uint8_t kind) { return kind == 2 ? 6 : 0; }
+	static uint64_t bucketOf(uint8_t kind, uint32_t type) { return ((uint64_t)kind << 32) | type; }
+
+	static std::string fieldValue(const json& params, size_t f) {
+		if (!params.is_object() || !params.contains(FIELD_NAMES[f]) || !params[FIELD_NAMES[f]].is_string()) return "";
+		std::string v = trim(params[FIELD_NAMES[f]].get<std::string>());
+		for (auto& c : v) c = (char)std::tolower((unsigned char)c);
+		return v;
+	}
+
+	// Must be called with m_ held
+	void index(const Record& rec, size_t segIdx, size_t off) {
+		byId_[rec.id] = {segIdx, off};
+		byKey_[rec.key].push_back(rec.id);
+		if (!rec.item.is_object() || rec.item.empty()) return;
+		uint8_t k = kindTag(rec.kind);
+		Fields fields{};
+		for (size_t f = 0; f < FIELDS; ++f) {
+			std::string v = fieldValue(rec.params, f);
+			if (v.empty()) continue;
+			auto it = interned_.find(v);
+			if (it == interned_.end()) it = interned_.emplace(v, (uint32_t)interned_.size() + 1).first;
+			fields[f] = it->second;
+		}
+		uint64_t& newest = byType_[bucketOf(k, fields[typeField(k)])][fields];
+		newest = std::max(newest, rec.id);
+	}
+
+	struct Segment {
+		int         fd   = -1;
+		char*       base = nullptr;
+		size_t      size = 0;
+		size_t      used = 0;
+		std::string path;
+	};
+
+	static size_t pad8(size_t n) { return (n + 7) & ~(size_t)7; }
+	static char* pageAlign(char* p) {
+		static const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+		return (char*)((uintptr_t)p & ~(page - 1));
+	}
+
+	static Record fromJson(const json& j) {
+		Record r;
+		json usage  = j.value("usage", json::object());
+		r.id        = j.at("id");
+		r.key       = j.at("key");
+		r.kind      = j.at("kind");
+		r.params    = j.at("params");
+		r.item      = j.at("item");
+		r.provider  = j.value("provider", "");
+		r.model     = j.value("model", "");
+		r.usage     = {usage.value("promptTokens", (int64_t)0), usage.value("outputTokens", (int64_t)0)};
+		r.latencyMs = j.value("latencyMs", 0.0);
+		r.created   = j.value("created", (int64_t)0);
+		return r;
+	}
+
+	// Must be called with m_ held
+	void mapSegment(const std::string& path, size_t create) {
+		int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+		if (fd < 0) throw std::runtime_error("Cannot open store segment: " + path);
+		struct stat st{};
+		fstat(fd, &st);
+		size_t size = (size_t)st.st_size;
+		if (create) {
+			if (ftruncate(fd, (off_t)create) != 0) { close(fd); throw std::runtime_error("Cannot size store segment: " + path); }
+			size = create;
+		}
+		// A crash between create and ftruncate leaves an empty file
+		if (size < HEADER) { close(fd); throw std::runtime_error("Empty store segment: " + path); }
+		void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (base == MAP_FAILED) { close(fd); throw std::runtime_error("Cannot map store segment: " + path); }
+		segments_.push_back({fd, (char*)base, size, 0, path});
+	}
+
+	// Must be called with m_ held
+	void newSegment() {
+		while (maxBytes_ && !segments_.empty() && mappedBytes() + segmentBytes_ > maxBytes_) dropOldest();
+		char name[32];
+		std::snprintf(name, sizeof(name), "seg-%08zu.dat", nextSegment_++);
+		mapSegment(dir_ + "/" + name, segmentBytes_);
+	}
+
+	// Must be called with m_ held
+	size_t mappedBytes() const {
+		size_t n = 0;
+		for (auto& seg : segments_) n += seg.size;
+		return n;
+	}
+
+	// Delete the oldest segment and forget its records; must be called with m_ held
+	void dropOldest() {
+		Segment seg = segments_.front();
+		segments_.pop_front();
+		size_t gone = dropped_++;
+		munmap(seg.base, seg.size);
+		close(seg.fd);
+		std::filesystem::remove(seg.path);
+
+		for (auto it = byId_.begin(); it != byId_.end(); )
+			it = it->second.first == gone ? byId_.erase(it) : std::next(it);
+		for (auto it = byKey_.begin(); it != byKey_.end(); ) {
+			auto& ids = it->second;
+			ids.erase(std::remove_if(ids.begin(), ids.end(), [&](uint64_t id){ return !byId_.count(id); }), ids.end());
+			it = ids.empty() ? byKey_.erase(it) : std::next(it);
+		}
+		// Older records share their segment's fate, so a dropped newest means none is left
+		for (auto it = byType_.begin(); it != byType_.end(); ) {
+			auto& combos = it->second;
+			for (auto c = combos.begin(); c != combos.end(); )
+				c = byId_.count(c->second) ? std::next(c) : combos.erase(c);
+			it = combos.empty() ? byType_.erase(it) : std::next(it);
+		}
+	}
+
+	// Must be called with m_ held
+	void replaySegment(size_t idx, const std::function<void(const Record&)>& visit) {
+		Segment& seg = segments_[idx];
+		size_t off = 0;
+		while (off + HEADER <= seg.size) {
+			uint32_t hdr[4];
+			std::memcpy(hdr, seg.base + off, 16);
+			if (hdr[0] != MAGIC || off + HEADER + hdr[1] > seg.size) break;
+			if (crc32(seg.base + off + HEADER, hdr[1]) != hdr[2]) break;
+			Record rec;
+			try { rec = fromJson(json::parse(seg.base + off + HEADER, seg.base + off + HEADER + hdr[1])); }
+			catch (const std::exception& e) {
+				std::cerr << "Item store: unreadable record in " << seg.path << ": " << e.what() << "\n";
+				break;
+			}
+			index(rec, dropped_ + idx, off);
+			nextId_ = std::max(nextId_, rec.id + 1);
+			visit(rec);
+			off += HEADER + pad8(hdr[1]);
+		}
+		seg.used = off;
+	}
+
+	// Must be called with m_ held; segIdx counts dropped segments too
+	Record readAt(size_t segIdx, size_t off) const {
+		const Segment& seg = segments_[segIdx - dropped_];
+		uint32_t len;
+		std::memcpy(&len, seg.base + off + 4, 4);
+		return fromJson(json::parse(seg.base + off + HEADER, seg.base + off + HEADER + len));
+	}
+
+	std::string                                               dir_;
+	size_t                                                    segmentBytes_;
+	size_t                                                    maxBytes_;      // 0 = no cap
+	mutable std::mutex                                        m_;
+	std::deque<Segment>                                       segments_;
+	size_t                                                    dropped_     = 0;   // segments deleted so far
+	size_t                                                    nextSegment_ = 1;   // file number
+	std::unordered_map<uint64_t, std::pair<size_t, size_t>>  byId_;
+	std::unordered_map<std::string, std::vector<uint64_t>>    byKey_;
+	std::unordered_map<uint64_t, std::map<Fields, uint64_t>> byType_;   // bucketOf(kind, type) -> fields -> newest ID
+	std::unordered_map<std::string, uint32_t>                 interned_;
+	uint64_t                                                  nextId_ = 1;
+};
+
+// Build a store record for a live generation
+static ItemStore::Record storeRecord(const std::string& kind,
+									 const std::string& key,
+									 const json& params,
+									 const json& item,
+									 const LlmResult& meta)
+{
+	ItemStore::Record r;
+	r.key       = key;
+	r.kind      = kind;
+	r.params    = params;
+	r.item      = item;
+	r.provider  = meta.provider;
+	r.model     = meta.model;
+	r.usage     = meta.usage;
+	r.latencyMs = meta.latencyMs;
+	r.created   = (int64_t)Clock::to_time_t(Clock::now());
+	return r;
+}
+
+// ————————————————————————————————————————————————
+// Bulk generation through the provider batch APIs. Job state lives in
+// BULK_DIR/jobs.json (default "bulk"), rewritten on every change, and each
+// finished job's items go to the item store. A background thread polls
+// running jobs every BULK_POLL_SECONDS (default 60).
+
+struct BulkJob {
+	std::string       id;
+	std::string       kind;       // "gear" or "shopkeeper"
+	std::string       provider;
+	std::string       model;
+	std::string       remoteId;
+	std::string       state;      // running | failed | ingested
+	std::string       detail;
+	std::vector<json> params;
+	size_t            ingested = 0;
+	int64_t           created  = 0;
+};
+
+static std::map<std::string, BulkJob> bulk_jobs;
+static std::mutex                     bulk_mutex;
+
+static std::string bulkDir() {
+	const char* d = std::getenv("BULK_DIR");
+	return d ? d : "bulk";
+}
+
+static json bulkJobJson(const BulkJob& j, bool withParams) {
+	json out = {
+		{"id",       j.id},
+		{"kind",     j.kind},
+		{"provider", j.provider},
+		{"model",    j.model},
+		{"remoteId", j.remoteId},
+		{"state",    j.state},
+		{"detail",   j.detail},
+		{"count",    j.params.size()},
+		{"ingested", j.ingested},
+		{"created",  j.created}
+	};
+	if (withParams) out["params"] = j.params;
+	return out;
+}
+
+// Must be called with bulk_mutex held
+static void saveBulkJobs() {
+	json all = json::array();
+	for (auto& [id, j] : bulk_jobs) all.push_back(bulkJobJson(j, true));
+	std::filesystem::create_directories(bulkDir());
+	std::string path = bulkDir() + "/jobs.json";
+	{
+		std::ofstream out(path + ".tmp");
+		out << all.dump();
+	}
+	std::filesystem::rename(path + ".tmp", path);
+}
+
+static void loadBulkJobs() {
+	std::string path = bulkDir() + "/jobs.json";
+	if (!std::filesystem::exists(path)) return;
+	std::lock_guard<std::mutex> lk(bulk_mutex);
+	for (auto& j : loadJSON(path)) {
+		BulkJob b;
+		b.id       = j.at("id");
+		b.kind     = j.at("kind");
+		b.provider = j.at("provider");
+		b.model    = j.at("model");
+		b.remoteId = j.value("remoteId", "");
+		b.state    = j.value("state", "running");
+		b.detail   = j.value("detail", "");
+		b.params   = j.at("params").get<std::vector<json>>();
+		b.ingested = j.value("ingested", (size_t)0);
+		b.created  = j.value("created", (int64_t)0);
+		bulk_jobs[b.id] = std::move(b);
+	}
+}
+
+// A bulk shopkeeper's stock, seeded by its place in the job so ingestion
+// rebuilds the stock its prompt was written around
+static std::vector<std::string> bulkShopStock(const BulkJob& job, size_t idx) {
+	if (!shopCataloged(job.params[idx].value("shopType", ""))) return {};
+	return sampleShopStock(job.params[idx], fnv1a(job.id + "#" + std::to_string(idx)));
+}
+
+// Same prompts and output budgets as the synchronous routes. Local names are
+// seeded by the item's place in the job, so polling rebuilds the exact
+// prompts that were submitted and results match up with them.
+static std::vector<LlmRequest> bulkRequests(const BulkJob& job) {
+	std::vector<LlmRequest> reqs;
+	for (size_t i = 0; i < job.params.size(); ++i) {
+		const json& p = job.params[i];
+		const uint64_t seed = fnv1a(job.id + "#" + std::to_string(i));
+		LlmRequest r;
+		r.prompt    = (job.kind == "gear") ? buildGearPrompt(withLocalNames(p, "gear", 1, seed))
+											 : buildShopkeeperPrompt(withLocalNames(p, "shopkeeper", 1, seed), bulkShopStock(job, i));
+		r.model     = job.model;
+		r.maxTokens = (job.kind == "gear") ? gearMaxTokens(p) : 1024;
+		reqs.push_back(std::move(r));
+	}
+	return reqs;
+}
+
+static BulkJob submitBulkJob(const std::string& kind,
+							 std::vector<json> params,
+							 const ModelChoice& choice)
+{
+	static std::atomic<uint64_t> seq{0};
+	BulkJob job;
+	job.created  = (int64_t)Clock::to_time_t(Clock::now());
+	job.id       = "bulk-" + std::to_string(job.created) + "-" + std::to_string(seq++);
+	job.kind     = kind;
+	job.provider = choice.provider;
+	job.model    = choice.model;
+	job.params   = std::move(params);
+	job.remoteId = findProvider(job.provider)->submitBatch(job.id, bulkRequests(job));
+	job.state    = "running";
+
+	std::lock_guard<std::mutex> lk(bulk_mutex);
+	bulk_jobs[job.id] = job;
+	saveBulkJobs();
+	return job;
+}
+
+// Record a finished job's items in the item store
+static size_t ingestBulkResults(ItemStore& store,
+								const BulkJob& job,
+								const std::vector<std::pair<size_t, std::string>>& results)
+{
+	size_t n = 0;
+	for (auto& [idx, text] : results) {
+		json item = extractJsonObject(text);
+		if (!item.is_object() || item.empty()) continue;
+		if (job.kind == "gear") {
+			applySrdStats(job.params[idx], item);
+			if (!itemTypes().of(job.params[idx].value("type", "")).validate(item)) continue;
+			adjustWeight(item);
+		} else {
+			applyShopStock(item, bulkShopStock(job, idx));
+		}
+		LlmResult meta;
+		meta.provider = job.provider;
+		meta.model    = job.model;
+		store.append(storeRecord(job.kind, canonicalParams(job.kind, job.params[idx]),
+								 job.params[idx], item, meta));
+		++n;
+	}
+	return n;
+}
+
+// One pass over running jobs; network calls happen outside the lock
+static void pollBulkJobs(ItemStore& store) {
+	std::vector<BulkJob> running;
+	{
+		std::lock_guard<std::mutex> lk(bulk_mutex);
+		for (auto& [id, j] : bulk_jobs)
+			if (j.state == "running") running.push_back(j);
+	}
+	for (auto& job : running) {
+		try {
+			auto provider = findProvider(job.provider);
+			BatchStatus st = provider->pollBatch(job.remoteId);
+			job.detail = st.detail;
+			if (st.state == "succeeded") {
+				job.ingested = ingestBulkResults(store, job, provider->fetchBatch(st, bulkRequests(job)));
+				job.state    = "ingested";
+			} else if (st.state == "failed") {
+				job.state = "failed";
+			}
+		} catch (const std::exception& e) {
+			job.detail = e.what();   // transient, retried on the next pass
+		}
+		std::lock_guard<std::mutex> lk(bulk_mutex);
+		bulk_jobs[job.id] = job;
+		saveBulkJobs();
+	}
+}
+
+// Polls running jobs every BULK_POLL_SECONDS
+class BulkPoller {
+public:
+	explicit BulkPoller(ItemStore& store)
+		: store_(store), interval_(std::chrono::seconds((long)envDouble("BULK_POLL_SECONDS", 60))) {}
+
+	~BulkPoller() { stop(); }
+
+	void start() { thread_ = std::thread([this]{ work(); }); }
+
+	// Returns once the worker has exited, so the store can go
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lk(m_);
+			stopped_ = true;
+			cv_.notify_all();
+		}
+		if (thread_.joinable()) thread_.join();
+	}
+
+private:
+	void work() {
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lk(m_);
+				if (cv_.wait_for(lk, interval_, [&]{ return stopped_; })) return;
+			}
+			pollBulkJobs(store_);
+		}
+	}
+
+	ItemStore&              store_;
+	std::chrono::seconds    interval_;
+	std::mutex              m_;
+	std::condition_variable cv_;
+	bool                    stopped_ = false;
+	std::thread             thread_;
+};
+
+// ————————————————————————————————————————————————
+// Demand-adaptive pre-generation. A Space-Saving sketch tracks the most
+// requested /api/gear parameter tuples (plain ones, without a name or
+// description); while upstream is idle, a background thread fills the
+// response cache for the top tuples so matching requests are served at once.
+
+class HeavyHitters {
+public:
+	struct Counter {
+		std::string canonical;
+		json        params;
+		uint64_t    count = 0;
+		uint64_t    error = 0;   // overestimate inherited from the evicted counter
+	};
+
+	explicit HeavyHitters(size_t capacity) : capacity_(std::max<size_t>(capacity, 1)) {}
+
+	void record(const std::string& canonical, const json& params) {
+		std::lock_guard<std::mutex> lk(m_);
+		auto it = index_.find(canonical);
+		if (it != index_.end()) { counters_[it->second].count++; return; }
+		if (counters_.size() < capacity_) {
+			index_[canonical] = counters_.size();
+			counters_.push_back({canonical, params, 1, 0});
+			return;
+		}
+		// Replace the smallest counter, which becomes this tuple's error bound
+		size_t min = 0;
+		for (size_t i = 1; i < counters_.size(); ++i)
+			if (counters_[i].count < counters_[min].count) min = i;
+		Counter& c = counters_[min];
+		index_.erase(c.canonical);
+		index_[canonical] = min;
+		c = {canonical, params, c.count + 1, c.count};
+	}
+
+	// Halve every count so old popularity fades
+	void decay() {
+		std::lock_guard<std::mutex> lk(m_);
+		for (auto& c : counters_) { c.count /= 2; c.error /= 2; }
+	}
+
+	json snapshot() const {
+		std::lock_guard<std::mutex> lk(m_);
+		json out = json::array();
+		for (auto& c : counters_)
+			out.push_back({{"key", c.canonical}, {"params", c.params}, {"count", c.count}, {"error", c.error}});
+		return out;
+	}
+
+	void restore(const json& counters) {
+		std::lock_guard<std::mutex> lk(m_);
+		counters_.clear();
+		index_.clear();
+		for (auto& c : counters) {
+			if (counters_.size() >= capacity_) break;
+			index_[c.at("key").get<std::string>()] = counters_.size();
+			counters_.push_back({c.at("key"), c.at("params"), c.at("count"), c.at("error")});
+		}
+	}
+
+	std::vector<Counter> top(size_t n) const {
+		std::lock_guard<std::mutex> lk(m_);
+		std::vector<Counter> out = counters_;
+		std::sort(out.begin(), out.end(), [](const Counter& a, const Counter& b) { return a.count > b.count; });
+		if (out.size() > n) out.resize(n);
+		return out;
+	}
+
+private:
+	size_t                                  capacity_;
+	mutable std::mutex                      m_;
+	std::vector<Counter>                    counters_;
+	std::unordered_map<std::string, size_t> index_;
+};
+
+struct PregenStats {
+	std::atomic<uint64_t> generated{0};
+	std::atomic<uint64_t> errors{0};
+	std::atomic<uint64_t> skippedBusy{0};
+};
+
+// Every PREGEN_INTERVAL_MS, if fewer than PREGEN_MAX_IN_FLIGHT upstream calls
+// are running, generate one variant for the most popular of the top
+// PREGEN_TOP_K tuples that still needs filling. PREGEN_PER_MINUTE caps spend;
+// counts are halved every PREGEN_DECAY_SECONDS.
+class Pregenerator {
+public:
+	Pregenerator(HeavyHitters& hot, ResponseCache& cache, ItemStore& store, PregenStats& stats)
+		: hot_(hot), cache_(cache), store_(store), stats_(stats),
+		  interval_(std::chrono::milliseconds((long)envDouble("PREGEN_INTERVAL_MS", 2000))),
+		  maxInFlight_((int)envDouble("PREGEN_MAX_IN_FLIGHT", 2)),
+		  topK_((size_t)envDouble("PREGEN_TOP_K", 16)),
+		  perMinute_((int)envDouble("PREGEN_PER_MINUTE", 10)),
+		  decay_(std::chrono::seconds((long)envDouble("PREGEN_DECAY_SECONDS", 3600))) {}
+
+	~Pregenerator() { stop(); }
+
+	void start() {
+		if (perMinute_ <= 0) return;
+		thread_ = std::thread([this]{ work(); });
+	}
+
+	// Returns once the worker has exited, so the caches it fills can go
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lk(m_);
+			stopped_ = true;
+			cv_.notify_all();
+		}
+		if (thread_.joinable()) thread_.join();
+	}
+
+private:
+	void work() {
+		auto windowStart = Clock::now();
+		auto lastDecay   = Clock::now();
+		int  used        = 0;
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lk(m_);
+				if (cv_.wait_for(lk, interval_, [&]{ return stopped_; })) return;
+			}
+			auto now = Clock::now();
+			if (now - lastDecay > decay_) { hot_.decay(); lastDecay = now; }
+			if (now - windowStart > std::chrono::minutes(1)) { windowStart = now; used = 0; }
+			if (used >= perMinute_) continue;
+			if (upstream_in_flight.load() >= maxInFlight_) { stats_.skippedBusy++; continue; }
+
+			auto top = hot_.top(topK_);
+			std::vector<std::string> wanted;
+			for (auto& c : top)
+				if (c.count >= 2 && cache_.needsFill(c.canonical)) wanted.push_back(c.canonical);
+			cache_.prefetch(wanted);   // another replica may already have them
+			for (auto& c : top) {
+				if (c.count < 2 || !cache_.needsFill(c.canonical)) continue;
+				used++;
+				try {
+					LlmResult meta;
+					json out = queryGemini(c.params, "gear/pregen", &meta);
+					adjustWeight(out);
+					cache_.put(c.canonical, ResponseCache::makeBody(out));
+					store_.append(storeRecord("gear", c.canonical, c.params, out, meta));
+					stats_.generated++;
+				} catch (const std::exception& e) {
+					stats_.errors++;
+					std::cerr << "Pre-generation failed: " << e.what() << "\n";
+				}
+				break;
+			}
+		}
+	}
+
+	HeavyHitters&             hot_;
+	ResponseCache&            cache_;
+	ItemStore&                store_;
+	PregenStats&              stats_;
+	std::chrono::milliseconds interval_;
+	int                       maxInFlight_;
+	size_t                    topK_;
+	int                       perMinute_;
+	std::chrono::seconds      decay_;
+	std::mutex                m_;
+	std::condition_variable   cv_;
+	bool                      stopped_ = false;
+	std::thread               thread_;
+};
+
+// ————————————————————————————————————————————————
+// Pre-generated item pools behind the random routes. Worker threads keep
+// each pool at its target depth and refill it as items are popped; a route
+// only falls back to a live generation when its pool is empty. With a shared
+// tier, refills take spare items from a fleet-wide list first, and idle
+// workers keep that list topped up to `sharedDepth`.
+
+class ItemPool {
+public:
+	ItemPool(std::string name, size_t depth, std::function<json()> generate)
+		: name_(std::move(name)), depth_(depth), generate_(std::move(generate)) {}
+
+	~ItemPool() { stop(); }
+
+	void start(int workers) {
+		if (depth_ == 0) return;
+		for (int i = 0; i < workers; ++i) threads_.emplace_back([this]{ work(); });
+	}
+
+	// Call before start()
+	void setShared(std::shared_ptr<SharedTier> shared, size_t sharedDepth) {
+		shared_      = std::move(shared);
+		sharedDepth_ = sharedDepth;
+	}
+
+	// Returns once the workers have exited, so what generate touches can go
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lk(m_);
+			stopped_ = true;
+			cv_.notify_all();
+		}
+		for (auto& t : threads_) if (t.joinable()) t.join();
+	}
+
+	std::optional<json> pop() {
+		{
+			std::lock_guard<std::mutex> lk(m_);
+			if (!items_.empty()) {
+				json out = std::move(items_.front());
+				items_.pop_front();
+				hits_++;
+				cv_.notify_one();
+				return out;
+			}
+		}
+		auto out = shared_ && sharedDepth_ ? shared_->popPool(name_) : std::nullopt;
+		std::lock_guard<std::mutex> lk(m_);
+		if (out) sharedHits_++;
+		else     misses_++;
+		return out;
+	}
+
+	json snapshot() const {
+		std::lock_guard<std::mutex> lk(m_);
+		return json(items_);
+	}
+
+	// Refill from a snapshot, up to the pool's depth; call before start()
+	void restore(const json& items) {
+		std::lock_guard<std::mutex> lk(m_);
+		for (auto& item : items) {
+			if (items_.size() >= depth_) break;
+			if (item.is_object() && !item.empty()) items_.push_back(item);
+		}
+	}
+
+	json stats() const {
+		std::lock_guard<std::mutex> lk(m_);
+		return {
+			{"size",      items_.size()},
+			{"depth",     depth_},
+			{"hits",      hits_},
+			{"misses",    misses_},
+			{"generated", generated_},
+			{"errors",    errors_},
+			{"sharedDepth",  shared_ ? sharedDepth_ : 0},
+			{"sharedHits",   sharedHits_},
+			{"sharedTaken",  sharedTaken_},
+			{"sharedPushed", sharedPushed_}
+		};
+	}
+
+private:
+	// Refill loop; backs off exponentially (up to a minute) while generation fails
+	void work() {
+		auto backoff = std::chrono::seconds(1);
+		bool sharing = shared_ && sharedDepth_;
+		for (;;) {
+			bool local;
+			{
+				std::unique_lock<std::mutex> lk(m_);
+				auto needed = [&]{ return stopped_ || items_.size() + inFlight_ < depth_; };
+				if (sharing) cv_.wait_for(lk, std::chrono::seconds(1), needed);
+				else         cv_.wait(lk, needed);
+				if (stopped_) return;
+				local = items_.size() + inFlight_ < depth_;
+				if (local) inFlight_++;
+			}
+			std::optional<json> item;
+			if (local && sharing) {
+				item = shared_->popPool(name_);
+				if (item) {
+					std::lock_guard<std::mutex> lk(m_);
+					inFlight_--;
+					items_.push_back(std::move(*item));
+					sharedTaken_++;
+					continue;
+				}
+			}
+			// Local pool is full: top up the fleet-wide list instead
+			if (!local) {
+				long long size = shared_->poolSize(name_);
+				if (size < 0 || (size_t)size >= sharedDepth_) continue;
+			}
+			try {
+				item = generate_();
+			} catch (const std::exception& e) {
+				std::cerr << "Pool " << name_ << " refill failed: " << e.what() << "\n";
+			}
+			bool ok = item && item->is_object() && !item->empty();
+			if (ok && !local) shared_->pushPool(name_, *item);
+			{
+				std::lock_guard<std::mutex> lk(m_);
+				if (local) inFlight_--;
+				if (ok) {
+					if (local) items_.push_back(std::move(*item));
+					else       sharedPushed_++;
+					generated_++;
+					backoff = std::chrono::seconds(1);
+					continue;
+				}
+				errors_++;
+			}
+			{
+				std::unique_lock<std::mutex> lk(m_);
+				if (cv_.wait_for(lk, backoff, [&]{ return stopped_; })) return;
+			}
+			backoff = std::min(backoff * 2, std::chrono::seconds(60));
+		}
+	}
+
+	std::string             name_;
+	size_t                  depth_;
+	std::function<json()>   generate_;
+	mutable std::mutex      m_;
+	std::condition_variable cv_;
+	std::deque<json>        items_;
+	size_t                  inFlight_ = 0;
+	bool                    stopped_  = false;
+	std::shared_ptr<SharedTier> shared_;
+	size_t                  sharedDepth_ = 0;
+	std::vector<std::thread> threads_;
+	uint64_t hits_ = 0, misses_ = 0, generated_ = 0, errors_ = 0;
+	uint64_t sharedHits_ = 0, sharedTaken_ = 0, sharedPushed_ = 0;
+};
+
+// ————————————————————————————————————————————————
+// Shopkeeper item prefetch: once a shopkeeper is served, the gear entries in
+// its ItemsList are generated in the background (one worker, and only while
+// fewer than SHOP_PREFETCH_MAX_IN_FLIGHT upstream calls are running) into a
+// short-lived cache keyed by the shopkeeper's response ID, so a click on a
+// listed item is answered without waiting for a fresh generation.
+
+// Stable ID for a response body: FNV-1a of its bytes as 16 hex digits
+static std::string responseId(const std::string& bytes) {
+	char id[17];
+	std::snprintf(id, sizeof(id), "%016llx", (unsigned long long)fnv1a(bytes));
+	return id;
+}
+
+// "Longsword (15 gp)" → {"Longsword", 15.0}; price in gp, 0 when missing
+static std::vector<std::pair<std::string, double>> parseItemsList(const json& shopkeeper) {
+	std::vector<std::string> entries;
+	json list = shopkeeper.value("ItemsList", json());
+	if (list.is_string()) {
+		json parsed = json::parse(list.get<std::string>(), nullptr, false);
+		if (parsed.is_array()) list = parsed;
+	}
+	if (list.is_array()) {
+		for (auto& e : list) if (e.is_string()) entries.push_back(e.get<std::string>());
+	} else if (list.is_string()) {
+		std::stringstream ss(list.get<std::string>());
+		std::string e;
+		while (std::getline(ss, e, ',')) entries.push_back(e);
+	}
+
+	static const std::map<std::string, double> toGp = {
+		{"cp", 0.01}, {"sp", 0.1}, {"ep", 0.5}, {"gp", 1}, {"pp", 10}
+	};
+	std::vector<std::pair<std::string, double>> out;
+	for (auto& raw : entries) {
+		std::string e = trim(raw);
+		double gp = 0;
+		auto open = e.rfind('(');
+		if (open != std::string::npos && e.back() == ')') {
+			std::string price = e.substr(open + 1, e.size() - open - 2);
+			std::string digits, unit;
+			for (char c : price) {
+				if (std::isdigit((unsigned char)c) || c == '.') digits.push_back(c);
+				else if (std::isalpha((unsigned char)c)) unit.push_back((char)std::tolower((unsigned char)c));
+			}
+			auto u = toGp.find(unit);
+			if (!digits.empty() && u != toGp.end()) {
+				gp = std::atof(digits.c_str()) * u->second;
+				e  = trim(e.substr(0, open));
+			}
+		}
+		if (!e.empty()) out.push_back({e, gp});
+	}
+	return out;
+}
+
+// /api/gear parameters for a listed item, or null when it is not gear the
+// generator knows (weapons, armor and clothing, jewelry). The listing is
+// classified by its head noun, the last whole word before any "of" or comma,
+// so "Crossbow Bolt Case" is a case and "Ring of Warmth" a ring. Ammunition
+// ("Arrows (20)", "Sling Bullets (20)") is not gear the generator makes.
+static json gearParamsForListing(const std::string& name, double gp, const std::string& shopType) {
+	static const std::unordered_map<std::string, std::string> nouns = [] {
+		std::unordered_map<std::string, std::string> m;
+		for (const char* w : {
+			"sword", "longsword", "shortsword", "greatsword", "axe", "handaxe", "battleaxe", "greataxe",
+			"dagger", "mace", "spear", "bow", "longbow", "shortbow", "crossbow", "hammer", "warhammer",
+			"flail", "halberd", "glaive", "pike", "lance", "rapier", "scimitar", "sickle", "club",
+			"greatclub", "staff", "quarterstaff", "trident", "whip", "javelin", "sling", "dart",
+			"morningstar", "maul", "blade"})
+			m[w] = "Weapon";
+		for (const char* w : {
+			"armor", "mail", "chainmail", "plate", "shield", "helm", "helmet", "boots", "cloak", "robe",
+			"gloves", "gauntlets", "hat", "hood", "cap", "tunic", "vest", "coat", "shirt", "breastplate",
+			"bracers", "belt", "shoes", "trousers"})
+			m[w] = "Armor";
+		for (const char* w : {
+			"ring", "amulet", "necklace", "pendant", "bracelet", "earring", "circlet", "brooch", "locket", "torc"})
+			m[w] = "Jewelry";
+		return m;
+	}();
+
+	// Words of the head phrase, lowercased
+	std::vector<std::string> words;
+	std::string word;
+	for (size_t i = 0; i <= name.size(); ++i) {
+		char c = i < name.size() ? name[i] : ' ';
+		if (std::isalpha((unsigned char)c)) { word.push_back((char)std::tolower((unsigned char)c)); continue; }
+		if (word == "of" && !words.empty()) break;
+		if (!word.empty()) words.push_back(word);
+		word.clear();
+		if (c == ',' && !words.empty()) break;
+	}
+	auto lookup = [&](const std::string& w) -> std::string {
+		auto it = nouns.find(w);
+		if (it == nouns.end() && w.size() > 3 && w.back() == 's') it = nouns.find(w.substr(0, w.size() - 1));   // "Arrows"
+		return it == nouns.end() ? "" : it->second;
+	};
+
+	const bool clothier = shopType == "Tailor" || shopType == "Haberdashery" || shopType == "Cobbler";
+	std::string type = words.empty() ? "" : lookup(words.back());
+	if (type.empty() && clothier) type = "Armor";
+	if (type.empty()) return nullptr;
+
+	// DMG price bands by rarity
+	std::string rarity = gp <= 100 ? "Common" : gp <= 500 ? "Uncommon" : gp <= 5000 ? "Rare"
+					   : gp <= 50000 ? "Very Rare" : "Legendary";
+	json in = {{"name", name}, {"type", type}, {"rarity", rarity}};
+	if (gp > 0) {
+		std::ostringstream d;
+		bool vowel = !shopType.empty() && std::strchr("AEIOUaeiou", shopType[0]);
+		d << "Sold by " << (vowel ? "an " : "a ") << shopType << " for " << gp << " gp; its Cost should match.";
+		in["description"] = d.str();
+	}
+
+	// The SRD subtype the head phrase names, so srdCovers() fixes the
+	// mechanics: "Longsword", "Hand Crossbow", "Chain Mail", "Leather Boots"
+	// (a piece of a Light set), "Winter Boots" (clothes)
+	auto tail = [&](size_t k) {
+		std::string out;
+		for (size_t i = words.size() - std::min(k, words.size()); i < words.size(); ++i)
+			out += (out.empty() ? "" : " ") + words[i];
+		return out;
+	};
+	if (type == "Weapon") {
+		const SrdWeapon* w = words.size() > 1 ? findSrdWeapon(tail(2)) : nullptr;
+		if (!w) w = findSrdWeapon(tail(1));
+		if (w) {
+			in["subtype"]    = w->name;
+			in["handedness"] = w->handedness;
+		}
+	} else if (type == "Armor") {
+		static const std::unordered_map<std::string, std::string> pieces = {
+			{"helm", "Helmet"}, {"helmet", "Helmet"}, {"gauntlets", "Gauntlets"}, {"gloves", "Gauntlets"},
+			{"boots", "Boots"}, {"shoes", "Boots"}, {"cloak", "Cloak"}, {"hat", "Hat"}, {"hood", "Hat"}, {"cap", "Hat"}};
+		static const std::set<std::string> clothes = {"robe", "tunic", "vest", "coat", "shirt", "trousers"};
+		const SrdArmor* body = nullptr;
+		for (auto& a : SRD_ARMOR)
+			for (size_t k = 1; k <= std::min<size_t>(3, words.size()); ++k)
+				if (srdNameMatches(a.name, tail(k))) body = &a;
+		std::string last = tail(1);
+		if (last.size() > 3 && last.back() == 's' && !pieces.count(last)) last.pop_back();   // "Helmets"
+		auto piece = pieces.find(last);
+		if (body) {
+			in["subtype"] = body->category;
+		} else if (piece != pieces.end()) {
+			// An armor set's material before the piece ("Chain Gauntlets"), otherwise clothing
+			std::string category = "Clothes";
+			for (size_t i = 0; i + 1 < words.size() && category == "Clothes"; ++i)
+				for (auto& a : SRD_ARMOR)
+					if (std::strcmp(a.category, "Shield") && srdNameMatches(a.material, words[i])) { category = a.category; break; }
+			in["subtype"]       = category;
+			in["clothingPiece"] = piece->second;
+		} else if (clothier || clothes.count(last)) {
+			in["subtype"] = "Clothes";
+		}
+	}
+	return in;
+}
+
+class ShopPrefetch {
+public:
+	ShopPrefetch(std::function<json(const json&, uint64_t*)> generate,
+				 size_t maxSets, std::chrono::seconds ttl, int maxInFlight)
+		: generate_(std::move(generate)), maxSets_(maxSets), ttl_(ttl), maxInFlight_(maxInFlight) {}
+
+	~ShopPrefetch() { stop(); }
+
+	void start() {
+		if (maxSets_ == 0) return;
+		thread_ = std::thread([this]{ work(); });
+	}
+
+	// Returns once the worker has exited
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lk(m_);
+			stopped_ = true;
+			cv_.notify_all();
+		}
+		if (thread_.joinable()) thread_.join();
+	}
+
+	// Queue the shopkeeper's listed gear under its response ID (once per ID)
+	void offer(const std::string& id, const std::string& shopkeeperBody) {
+		if (maxSets_ == 0) return;
+		{
+			std::lock_guard<std::mutex> lk(m_);
+			expire();
+			if (sets_.count(id)) return;
+		}
+		json shopkeeper = json::parse(shopkeeperBody, nullptr, false);
+		if (!shopkeeper.is_object()) return;
+		std::string shopType = shopkeeper.value("ShopType", "");
+		auto set = std::make_shared<Set>();
+		set->created = Clock::now();
+		for (auto& [name, gp] : parseItemsList(shopkeeper)) {
+			auto slot = std::make_shared<Slot>();
+			slot->name   = name;
+			slot->params = gearParamsForListing(name, gp, shopType);
+			slot->state  = slot->params.is_null() ? Slot::NOT_GEAR : Slot::QUEUED;
+			set->slots.push_back(slot);
+		}
+		std::lock_guard<std::mutex> lk(m_);
+		if (!sets_.emplace(id, set).second) return;
+		order_.push_back(id);
+		while (sets_.size() > maxSets_) {
+			sets_.erase(order_.front());
+			order_.pop_front();
+		}
+		for (auto& slot : set->slots) if (slot->state == Slot::QUEUED) { queue_.push_back(slot); queued_++; }
+		cv_.notify_all();
+	}
+
+	enum class Lookup { READY, WAITED, LIVE, NOT_GEAR, UNKNOWN };
+
+	// The detailed item for entry `index`: prefetched, awaited if it is being
+	// generated right now, or generated live
+	Lookup get(const std::string& id, size_t index, json& item, uint64_t& itemId) {
+		std::shared_ptr<Slot> slot;
+		{
+			std::unique_lock<std::mutex> lk(m_);
+			expire();
+			auto it = sets_.find(id);
+			if (it == sets_.end() || index >= it->second->slots.size()) return Lookup::UNKNOWN;
+			slot = it->second->slots[index];
+			if (slot->state == Slot::NOT_GEAR) return Lookup::NOT_GEAR;
+			bool waited = false;
+			if (slot->state == Slot::RUNNING) {
+				waited = true;
+				cv_.wait(lk, [&]{ return slot->state != Slot::RUNNING; });
+			}
+			if (slot->state == Slot::READY) {
+				item   = slot->item;
+				itemId = slot->itemId;
+				if (!slot->served) { slot->served = true; (waited ? waitHits_ : hits_)++; }
+				return waited ? Lookup::WAITED : Lookup::READY;
+			}
+			slot->state = Slot::RUNNING;   // claim it from the queue
+			misses_++;
+		}
+		try {
+			item = generate_(slot->params, &itemId);
+		} catch (...) {
+			std::lock_guard<std::mutex> lk(m_);
+			slot->state = Slot::FAILED;
+			cv_.notify_all();
+			throw;
+		}
+		std::lock_guard<std::mutex> lk(m_);
+		slot->state  = Slot::READY;
+		slot->item   = item;
+		slot->itemId = itemId;
+		slot->served = true;
+		cv_.notify_all();
+		return Lookup::LIVE;
+	}
+
+	json stats() const {
+		std::lock_guard<std::mutex> lk(m_);
+		return {
+			{"sets",        sets_.size()},
+			{"queued",      queued_},
+			{"queueDepth",  queue_.size()},
+			{"generated",   generated_},
+			{"errors",      errors_},
+			{"hits",        hits_},
+			{"waitHits",    waitHits_},
+			{"misses",      misses_}
+		};
+	}
+
+private:
+	struct Slot {
+		enum State { QUEUED, RUNNING, READY, FAILED, NOT_GEAR };
+		std::string name;
+		json        params;
+		State       state  = QUEUED;
+		json        item;
+		uint64_t    itemId = 0;
+		bool        served = false;
+	};
+	struct Set {
+		Clock::time_point                  created;
+		std::vector<std::shared_ptr<Slot>> slots;
+	};
+
+	// Must be called with m_ held
+	void expire() {
+		auto now = Clock::now();
+		while (!order_.empty()) {
+			auto it = sets_.find(order_.front());
+			if (it != sets_.end() && now - it->second->created <= ttl_) break;
+			if (it != sets_.end()) sets_.erase(it);
+			order_.pop_front();
+		}
+	}
+
+	// Low priority: yields whenever live traffic keeps upstream busy
+	void work() {
+		for (;;) {
+			std::shared_ptr<Slot> slot;
+			{
+				std::unique_lock<std::mutex> lk(m_);
+				cv_.wait(lk, [&]{ return stopped_ || !queue_.empty(); });
+				if (stopped_) return;
+				slot = queue_.front();
+				queue_.pop_front();
+				if (slot->state != Slot::QUEUED || slot.use_count() == 1) continue;   // claimed or expired
+			}
+			{
+				// Live traffic has no notification, so it is re-checked every 200 ms
+				std::unique_lock<std::mutex> lk(m_);
+				while (upstream_in_flight.load() >= maxInFlight_)
+					if (cv_.wait_for(lk, std::chrono::milliseconds(200), [&]{ return stopped_; })) return;
+				if (slot->state != Slot::QUEUED) continue;
+				slot->state = Slot::RUNNING;
+			}
+			json item;
+			uint64_t itemId = 0;
+			bool ok = true;
+			try {
+				item = generate_(slot->params, &itemId);
+			} catch (const std::exception& e) {
+				ok = false;
+				std::cerr << "Shop prefetch of " << slot->name << " failed: " << e.what() << "\n";
+			}
+			std::lock_guard<std::mutex> lk(m_);
+			slot->state = ok ? Slot::READY : Slot::FAILED;
+			if (ok) { slot->item = std::move(item); slot->itemId = itemId; generated_++; }
+			else    errors_++;
+			cv_.notify_all();
+		}
+	}
+
+	std::function<json(const json&, uint64_t*)> generate_;
+	size_t                                       maxSets_;
+	std::chrono::seconds                         ttl_;
+	int                                          maxInFlight_;
+	mutable std::mutex                           m_;
+	std::condition_variable                      cv_;
+	std::unordered_map<std::string, std::shared_ptr<Set>> sets_;
+	std::deque<std::string>                      order_;
+	std::deque<std::shared_ptr<Slot>>            queue_;
+	bool                                         stopped_ = false;
+	std::thread                                  thread_;
+	uint64_t queued_ = 0, generated_ = 0, errors_ = 0, hits_ = 0, waitHits_ = 0, misses_ = 0;
+};
+
+// ————————————————————————————————————————————————
+// Predictive prefetch: a first-order Markov model over each client session's
+// consecutive requests (X-Session-Id, else the client address). Each state is
+// a normalized cache key or a random route. When the likeliest successor of
+// the current state is confident enough and still needs cache variants, one
+// generation for it is queued and run on idle quota. Prefetches requested
+// again within PREDICT_WINDOW_SECONDS count as hits, the rest as waste.
+
+class SessionPredictor {
+public:
+	struct Config {
+		size_t               maxSessions  = 10000;
+		size_t               maxStates    = 4096;
+		std::chrono::seconds sessionTtl{1800};
+		std::chrono::seconds window{600};
+		double               minProb      = 0.3;
+		uint32_t             minCount     = 3;
+		int                  perMinute    = 10;
+		int                  maxInFlight  = 2;
+	};
+
+	SessionPredictor(Config cfg,
+					 std::function<bool(const std::string&)> needsFill,
+					 std::function<void(const std::string&, const json&)> fill)
+		: cfg_(cfg), needsFill_(std::move(needsFill)), fill_(std::move(fill)) {}
+
+	~SessionPredictor() { stop(); }
+
+	void start() {
+		if (cfg_.perMinute <= 0) return;
+		thread_ = std::thread([this]{ work(); });
+	}
+
+	// Returns once the worker has exited
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lk(m_);
+			stopped_ = true;
+			cv_.notify_all();
+		}
+		if (thread_.joinable()) thread_.join();
+	}
+
+	// Record that `session` requested `state` (with the parameters that
+	// regenerate it) and queue the likeliest next request if worthwhile
+	void observe(const std::string& session, const std::string& state, const json& params) {
+		if (cfg_.perMinute <= 0) return;
+		std::lock_guard<std::mutex> lk(m_);
+		auto now = Clock::now();
+		settle(now);
+
+		auto out = outstanding_.find(state);
+		if (out != outstanding_.end()) { hits_++; outstanding_.erase(out); }
+
+		if (node(state).params.is_null()) node(state).params = params;
+		auto s = sessions_.find(session);
+		if (s != sessions_.end() && now - s->second.seen <= cfg_.sessionTtl) {
+			Node& prev = node(s->second.state);
+			prev.next[state]++;
+			if (++prev.total > 1024) {
+				// Halve so the model follows changing habits
+				for (auto it = prev.next.begin(); it != prev.next.end();)
+					if ((it->second /= 2) == 0) it = prev.next.erase(it); else ++it;
+				prev.total /= 2;
+			}
+		}
+		if (s == sessions_.end()) {
+			if (sessions_.size() >= cfg_.maxSessions) evictSession();
+			s = sessions_.emplace(session, Session{}).first;
+		}
+		s->second.state = state;
+		s->second.seen  = now;
+
+		// Likeliest successor of the state just requested
+		Node& n = node(state);
+		const std::string* best = nullptr;
+		uint32_t bestCount = 0;
+		for (auto& [next, count] : n.next)
+			if (count > bestCount) { best = &next; bestCount = count; }
+		if (!best || bestCount < cfg_.minCount || bestCount < cfg_.minProb * n.total) return;
+		auto target = nodes_.find(*best);
+		if (target == nodes_.end() || target->second.params.is_null()) return;
+		if (queued_.count(*best) || outstanding_.count(*best)) return;
+		queued_.insert(*best);
+		queue_.push_back({*best, target->second.params});
+		predictions_++;
+		cv_.notify_one();
+	}
+
+	json stats() const {
+		std::lock_guard<std::mutex> lk(m_);
+		uint64_t settled = hits_ + wasted_;
+		return {
+			{"sessions",    sessions_.size()},
+			{"states",      nodes_.size()},
+			{"predictions", predictions_},
+			{"generated",   generated_},
+			{"skipped",     skipped_},
+			{"errors",      errors_},
+			{"pending",     outstanding_.size()},
+			{"hits",        hits_},
+			{"wasted",      wasted_},
+			{"hitRate",     settled ? (double)hits_   / settled : 0.0},
+			{"wasteRatio",  settled ? (double)wasted_ / settled : 0.0}
+		};
+	}
+
+private:
+	struct Node {
+		json                                      params;
+		std::unordered_map<std::string, uint32_t> next;
+		uint32_t                                  total = 0;
+		std::list<std::string>::iterator          pos;   // in stateOrder_
+	};
+	struct Session {
+		std::string       state;
+		Clock::time_point seen;
+	};
+
+	// Must be called with m_ held; bounded by dropping the least recently
+	// used state, so one-off requests don't push out the popular ones
+	Node& node(const std::string& state) {
+		auto it = nodes_.find(state);
+		if (it != nodes_.end()) {
+			stateOrder_.splice(stateOrder_.end(), stateOrder_, it->second.pos);
+			return it->second;
+		}
+		while (nodes_.size() >= cfg_.maxStates && !stateOrder_.empty()) {
+			nodes_.erase(stateOrder_.front());
+			stateOrder_.pop_front();
+		}
+		Node& n = nodes_[state];
+		n.pos = stateOrder_.insert(stateOrder_.end(), state);
+		return n;
+	}
+
+	// Must be called with m_ held
+	void evictSession() {
+		auto oldest = sessions_.begin();
+		for (auto it = sessions_.begin(); it != sessions_.end(); ++it)
+			if (it->second.seen < oldest->second.seen) oldest = it;
+		sessions_.erase(oldest);
+	}
+
+	// Must be called with m_ held; prefetches nobody asked for become waste
+	void settle(Clock::time_point now) {
+		for (auto it = outstanding_.begin(); it != outstanding_.end();) {
+			if (now - it->second > cfg_.window) { wasted_++; it = outstanding_.erase(it); }
+			else ++it;
+		}
+	}
+
+	void work() {
+		auto windowStart = Clock::now();
+		int  used        = 0;
+		for (;;) {
+			std::pair<std::string, json> job;
+			{
+				std::unique_lock<std::mutex> lk(m_);
+				cv_.wait(lk, [&]{ return stopped_ || !queue_.empty(); });
+				if (stopped_) return;
+				job = std::move(queue_.front());
+				queue_.pop_front();
+			}
+			// Idle quota only: wait out the per-minute budget and live traffic
+			// (which has no notification, so it is re-checked every 200 ms)
+			{
+				std::unique_lock<std::mutex> lk(m_);
+				for (;;) {
+					auto now = Clock::now();
+					if (now - windowStart >= std::chrono::minutes(1)) { windowStart = now; used = 0; }
+					if (used < cfg_.perMinute && upstream_in_flight.load() < cfg_.maxInFlight) break;
+					auto until = used < cfg_.perMinute ? now + std::chrono::milliseconds(200)
+													   : windowStart + std::chrono::minutes(1);
+					if (cv_.wait_until(lk, until, [&]{ return stopped_; })) return;
+				}
+			}
+			bool needed = needsFill_(job.first);
+			bool ok     = true;
+			if (needed) {
+				used++;
+				try {
+					fill_(job.first, job.second);
+				} catch (const std::exception& e) {
+					ok = false;
+					std::cerr << "Predictive prefetch failed: " << e.what() << "\n";
+				}
+			}
+			std::lock_guard<std::mutex> lk(m_);
+			queued_.erase(job.first);
+			if (!needed)  skipped_++;
+			else if (!ok) errors_++;
+			else { generated_++; outstanding_[job.first] = Clock::now(); }
+		}
+	}
+
+	Config                                              cfg_;
+	std::function<bool(const std::string&)>             needsFill_;
+	std::function<void(const std::string&, const json&)> fill_;
+	mutable std::mutex                                  m_;
+	std::condition_variable                             cv_;
+	std::unordered_map<std::string, Node>               nodes_;
+	std::list<std::string>                              stateOrder_;   // least recently used first
+	std::unordered_map<std::string, Session>            sessions_;
+	std::deque<std::pair<std::string, json>>            queue_;
+	std::set<std::string>                               queued_;
+	std::unordered_map<std::string, Clock::time_point>  outstanding_;
+	bool                                                stopped_ = false;
+	std::thread                                         thread_;
+	uint64_t predictions_ = 0, generated_ = 0, skipped_ = 0, errors_ = 0, hits_ = 0, wasted_ = 0;
+};
+
+// X-Session-Id when the client sends one, else its address
+static std::string sessionOf(const crow::request& req) {
+	std::string id = req.get_header_value("X-Session-Id");
+	return id.empty() ? req.remote_ip_address : id;
+}
+
+// ————————————————————————————————————————————————
+// Loot hoards: a challenge rating (DMG hoard bands) or a gold budget becomes
+// coins plus a rarity and type mix of gear; the items are then generated
+// concurrently and reported one by one as each finishes.
+
+static const char* const HOARD_RARITIES[] = {"Common", "Uncommon", "Rare", "Very Rare", "Legendary", "Artifact"};
+// Typical gp value per rarity, what a budget is spent against
+static constexpr double HOARD_RARITY_GP[] = {75, 250, 1600, 16000, 110000, 500000};
+
+struct HoardCoins { const char* coin; int dice; int multiplier; };   // <dice>d6 × multiplier
+struct HoardBand {
+	int        maxCr;
+	int        rarityWeights[6];    // per HOARD_RARITIES
+	HoardCoins coins[3];
+};
+static constexpr HoardBand HOARD_BANDS[] = {
+	{4,       {60, 35,  5,  0,  0, 0}, {{"cp", 6, 100},  {"sp", 3, 100},  {"gp", 2, 10}}},
+	{10,      {25, 45, 25,  5,  0, 0}, {{"cp", 2, 100},  {"sp", 2, 1000}, {"gp", 6, 100}}},
+	{16,      { 0, 20, 45, 30,  5, 0}, {{"gp", 4, 1000}, {"pp", 5, 100},  {nullptr, 0, 0}}},
+	{INT_MAX, { 0,  0, 20, 45, 30, 5}, {{"gp", 12, 1000},{"pp", 8, 1000}, {nullptr, 0, 0}}},
+};
+
+struct HoardPlan {
+	json              coins = json::object();
+	std::vector<json> items;    // /api/gear parameters, one per item
+};
+
+// Jewelry a quarter of the time, otherwise drawn as for /api/gear/random
+static json hoardItemParams(const std::string& rarity, std::mt19937_64& gen) {
+	json in;
+	if (std::uniform_int_distribution<>(1, 4)(gen) == 4)
+		in = {{"type", "Jewelry"}, {"subtype", pickOne(JEWELRY_TYPES, gen)}, {"name", ""}};
+	else
+		in = randomGearParams();
+	in["rarity"] = rarity;
+	return in;
+}
+
+// {"cr": N} or {"budget": gp}, with an optional "count" (default 6,
+// at most HOARD_MAX_ITEMS). A budget is split evenly over the remaining
+// items, each taking the best rarity its share affords (a step lower 30% of
+// the time); what is left over is paid out in gold.
+static HoardPlan planHoard(const json& req) {
+	static thread_local std::mt19937_64 gen{ std::random_device{}() };
+	static const int maxItems = (int)envDouble("HOARD_MAX_ITEMS", 50);
+
+	int count = req.value("count", 6);
+	if (count < 0 || count > maxItems)
+		throw std::invalid_argument("count must be between 0 and " + std::to_string(maxItems));
+
+	HoardPlan plan;
+	if (req.contains("budget")) {
+		double budget = req["budget"].get<double>();
+		if (!(budget >= 0 && budget <= 1e15)) throw std::invalid_argument("budget must be between 0 and 1e15 gp");
+		for (int i = 0; i < count; ++i) {
+			double share = budget / (count - i);
+			int r = -1;
+			for (int k = 0; k < 6; ++k) if (HOARD_RARITY_GP[k] <= share) r = k;
+			if (r < 0) break;                   // not even a Common item left
+			if (r > 0 && std::uniform_real_distribution<>(0, 1)(gen) < 0.3) --r;
+			budget -= HOARD_RARITY_GP[r];
+			plan.items.push_back(hoardItemParams(HOARD_RARITIES[r], gen));
+		}
+		plan.coins["gp"] = (int64_t)budget;
+	} else if (req.contains("cr")) {
+		int cr = req["cr"].get<int>();
+		if (cr < 0) throw std::invalid_argument("cr must not be negative");
+		const HoardBand* band = &HOARD_BANDS[0];
+		while (cr > band->maxCr) ++band;
+
+		std::uniform_int_distribution<> d6(1, 6);
+		for (auto& c : band->coins) {
+			if (!c.coin) continue;
+			int64_t total = 0;
+			for (int i = 0; i < c.dice; ++i) total += d6(gen);
+			plan.coins[c.coin] = total * c.multiplier;
+		}
+		std::discrete_distribution<> dR(std::begin(band->rarityWeights), std::end(band->rarityWeights));
+		for (int i = 0; i < count; ++i)
+			plan.items.push_back(hoardItemParams(HOARD_RARITIES[dR(gen)], gen));
+	} else {
+		throw std::invalid_argument("Expected cr or budget");
+	}
+	return plan;
+}
+
+// Runs generate(index, params) over every item on up to `concurrency` threads and calls
+// done(index, result) as each finishes — from the worker threads, so done()
+// must be thread-safe. A throwing generate() reports {"error": message}.
+// Returns once every item is done.
+static void generateHoard(const std::vector<json>& items, int concurrency,
+						  const std::function<json(size_t, const json&)>& generate,
+						  const std::function<void(size_t, const json&)>& done) {
+	std::atomic<size_t> next{0};
+	auto work = [&]{
+		for (size_t i; (i = next++) < items.size(); ) {
+			json result;
+			try { result = generate(i, items[i]); }
+			catch (const std::exception& e) { result = {{"error", e.what()}}; }
+			done(i, result);
+		}
+	};
+	std::vector<std::thread> workers;
+	for (size_t w = 1; w < std::min(items.size(), (size_t)std::max(concurrency, 1)); ++w)
+		workers.emplace_back(work);
+	work();
+	for (auto& t : workers) t.join();
+}
+
+// ————————————————————————————————————————————————
+// Warm restart: on shutdown the access token, response cache, random pools,
+// demand sketch, circuit breakers and race budgets are written to
+// SNAPSHOT_PATH, and read back at startup before the listener opens.
+// File layout: "SNP1" magic, u32 format version, u32 CRC-32 of the body,
+// u32 body length, then the body as MessagePack.
+
+static const uint32_t SNAPSHOT_MAGIC   = 0x31504E53;   // "SNP1"
+static const uint32_t SNAPSHOT_VERSION = 2;
+
+static std::string snapshotPath() {
+	const char* p = std::getenv("SNAPSHOT_PATH");
+	return p ? p : "snapshot.bin";
+}
+
+static int64_t epochSeconds(Clock::time_point t) {
+	return std::chrono::duration_cast<std::chrono::seconds>(t.time_since_epoch()).count();
+}
+
+// Process-wide state that lives outside the objects owned by main()
+static json snapshotGlobals() {
+	json out;
+	{
+		std::lock_guard<std::mutex> lk(token_mutex);
+		if (!cached_token.empty() && Clock::now() < token_expiry)
+			out["token"] = {{"value", cached_token}, {"expires", epochSeconds(token_expiry)}};
+	}
+	{
+		std::lock_guard<std::mutex> lk(breaker_mutex);
+		json b = json::object();
+		for (auto& [provider, br] : breakers)
+			b[provider] = {{"failures", br.failures}, {"openUntil", epochSeconds(br.openUntil)}};
+		out["breakers"] = b;
+	}
+	{
+		std::lock_guard<std::mutex> lk(race_mutex);
+		json r = json::object();
+		for (auto& [route, rr] : race_routes)
+			r[route] = {{"day", rr.day}, {"spentUsd", rr.spentUsd}};
+		out["race"] = r;
+	}
+	return out;
+}
+
+static void restoreGlobals(const json& in) {
+	if (in.contains("token")) {
+		Clock::time_point expires{std::chrono::seconds(in["token"].at("expires").get<int64_t>())};
+		std::lock_guard<std::mutex> lk(token_mutex);
+		if (Clock::now() < expires) {
+			cached_token = in["token"].at("value");
+			token_expiry = expires;
+		}
+	}
+	if (in.contains("breakers")) {
+		std::lock_guard<std::mutex> lk(breaker_mutex);
+		for (auto& [provider, b] : in["breakers"].items()) {
+			breakers[provider].failures  = b.at("failures");
+			breakers[provider].openUntil = Clock::time_point{std::chrono::seconds(b.at("openUntil").get<int64_t>())};
+		}
+	}
+	if (in.contains("race")) {
+		std::lock_guard<std::mutex> lk(race_mutex);
+		for (auto& [route, r] : in["race"].items()) {
+			RaceRoute& rr = raceRoute(route);
+			rr.day      = r.at("day");
+			rr.spentUsd = r.at("spentUsd");
+		}
+	}
+}
+
+// Written to a temporary file and renamed, so a crash never leaves a torn snapshot
+static void writeSnapshot(const std::string& path, const json& snap) {
+	std::vector<uint8_t> body = json::to_msgpack(snap);
+	uint32_t hdr[4] = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION,
+					   crc32((const char*)body.data(), body.size()), (uint32_t)body.size()};
+	std::string tmp = path + ".tmp";
+	{
+		std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+		if (!out) throw std::runtime_error("Cannot write " + tmp);
+		out.write((const char*)hdr, sizeof(hdr));
+		out.write((const char*)body.data(), body.size());
+		if (!out) throw std::runtime_error("Short write to " + tmp);
+	}
+	// The snapshot holds a bearer token
+	std::filesystem::permissions(tmp, std::filesystem::perms::owner_read | std::filesystem::perms::owner_write);
+	std::filesystem::rename(tmp, path);
+}
+
+// Missing, stale-format or corrupt snapshots are ignored
+static std::optional<json> readSnapshot(const std::string& path) {
+	std::ifstream in(path, std::ios::binary);
+	if (!in) return std::nullopt;
+	uint32_t hdr[4];
+	if (!in.read((char*)hdr, sizeof(hdr)) || hdr[0] != SNAPSHOT_MAGIC || hdr[1] != SNAPSHOT_VERSION) {
+		std::cerr << "Ignoring snapshot " << path << ": unknown format\n";
+		return std::nullopt;
+	}
+	std::vector<uint8_t> body(hdr[3]);
+	if (!in.read((char*)body.data(), body.size()) || crc32((const char*)body.data(), body.size()) != hdr[2]) {
+		std::cerr << "Ignoring snapshot " << path << ": checksum mismatch\n";
+		return std::nullopt;
+	}
+	json snap = json::from_msgpack(body, true, false);
+	if (snap.is_discarded()) return std::nullopt;
+	return snap;
+}
+
+int main(int argc, char* argv[]) {
+	loadDotenv(".env");
+	const char* key = std::getenv("OPENAI_API_KEY");
+    if (!key) throw std::runtime_error("OPENAI_API_KEY not set");
+
+	const char* cred_env = std::getenv("GOOGLE_APPLICATION_CREDENTIALS");
+	if (!cred_env) {
+		std::cerr<<"Error: GOOGLE_APPLICATION_CREDENTIALS not set\n";
+		return 1;
+	}
+	json adc;
+	try { adc = loadJSON(cred_env); }
+	catch(const std::exception& e) {
+		std::cerr<<"Cred load failed: "<<e.what()<<"\n";
+		return 1;
+	}
+
+	const char* proj = std::getenv("GOOGLE_PROJECT_ID");
+	const char* loc  = std::getenv("GOOGLE_PROJECT_LOCATION");
+	if (!proj||!loc) {
+		std::cerr<<"Error: GOOGLE_PROJECT_ID or LOCATION missing\n";
+		return 1;
+	}
+	std::string project  = proj;
+	std::string location = loc;
+
+	registerDefaultProviders(adc, project, location);
+	reloadRoutingTable(true);
+
+	// Item type definitions are compiled once, before any request
+	try {
+		std::string names;
+		for (auto& n : itemTypes().names()) names += (names.empty() ? "" : ", ") + n;
+		std::cerr<<"Item types: "<<names<<"\n";
+	} catch(const std::exception& e) {
+		std::cerr<<"Item types failed to load: "<<e.what()<<"\n";
+		return 1;
+	}
+
+	// CLI mode
+	if (argc>1 && std::string(argv[1])=="--cli") {
+		std::string inraw{
+		  std::istreambuf_iterator<char>(std::cin),
+		  std::istreambuf_iterator<char>()
+		};
+		try {
+			json in  = json::parse(inraw);
+			json out = queryGemini(in);
+			std::cout<<out.dump()<<"\n";
+			return 0;
+		} catch(const std::exception& e) {
+			std::cerr<<"CLI error: "<<e.what()<<"\n";
+			return 2;
+		}
+	}
+
+	// HTTP‐server mode
+	ResponseCache cache(
+		(size_t)envDouble("CACHE_MAX_MB", 64) * 1024 * 1024,
+		(size_t)envDouble("CACHE_SHARDS", 16),
+		(size_t)envDouble("CACHE_VARIANTS", 4),
+		std::chrono::seconds((long)envDouble("CACHE_TTL_SECONDS", 3600))
+	);
+	// Optional cache and pool tier shared by all replicas
+	auto shared = sharedTierFromEnv();
+	cache.setShared(shared);
+	// Or: replicas own a slice of the key space each and forward to each other
+	auto peers = peerRingFromEnv();
+
+	SingleFlight flights(
+		std::chrono::milliseconds((long)envDouble("COALESCE_WINDOW_MS", 50)),
+		(size_t)envDouble("COALESCE_MAX_CANDIDATES", 4)
+	);
+
+	// Every generated item is archived; replaying the archive refills the cache
+	ItemStore store(
+		std::getenv("ITEM_STORE_DIR") ? std::getenv("ITEM_STORE_DIR") : "store",
+		(size_t)envDouble("ITEM_STORE_SEGMENT_MB", 64) * 1024 * 1024,
+		(size_t)envDouble("ITEM_STORE_MAX_MB", 4096) * 1024 * 1024
+	);
+	try {
+		// Keep the newest variants per key, then warm the cache in one pass
+		std::unordered_map<std::string, std::deque<ResponseCache::BodyPtr>> replayed;
+		store.open([&](const ItemStore::Record& r){
+			if (r.key.rfind("gear|", 0) != 0 && r.key.rfind("shopkeeper|", 0) != 0) return;
+			auto& vs = replayed[r.key];
+			vs.push_back(ResponseCache::makeBody(r.item));
+			if (vs.size() > cache.variants()) vs.pop_front();
+		});
+		std::vector<ResponseCache::WarmEntry> warm;
+		warm.reserve(replayed.size());
+		for (auto& [key, vs] : replayed) warm.push_back({key, {vs.begin(), vs.end()}});
+		cache.warm(std::move(warm));
+	} catch(const std::exception& e) {
+		// The archive is optional: run without it rather than not at all
+		std::cerr<<"Item store open failed, archiving disabled: "<<e.what()<<"\n";
+	}
+	// Split one multi-candidate request's usage evenly across its candidates
+	auto perCandidate = [](LlmResult meta, size_t n) {
+		if (n > 1) {
+			meta.usage.outputTokens /= (int64_t)n;
+			meta.texts.clear();
+		}
+		return meta;
+	};
+	// Archive a live generation, returning its ID (0 if it could not be stored)
+	auto archive = [&](const std::string& kind, const std::string& key, const json& params,
+					   const json& item, const LlmResult& meta) -> uint64_t {
+		try { return store.append(storeRecord(kind, key, params, item, meta)); }
+		catch(const std::exception& e) { std::cerr<<"Item store append failed: "<<e.what()<<"\n"; return 0; }
+	};
+	// When generation fails, serve the closest archived item instead of a 500
+	const double fallbackMinScore = envDouble("FALLBACK_MIN_SCORE", 0.5);
+	auto fallbackResponse = [&](const std::string& kind, const json& in,
+								const std::string& reason, const std::string& message) {
+		if (auto near = store.nearest(kind, in, fallbackMinScore)) {
+			crow::response res(near->first.item.dump());
+			res.set_header("Content-Type","application/json");
+			res.set_header("Cache-Control","no-store");
+			res.set_header("X-Fallback","nearest-match");
+			res.set_header("X-Fallback-Reason", reason);
+			res.set_header("X-Fallback-Score", std::to_string(near->second));
+			res.set_header("X-Item-Id", std::to_string(near->first.id));
+			return res;
+		}
+		json err = {{"error","ProcessingFailed"},{"message",message}};
+		crow::response res(500, err.dump());
+		res.set_header("Content-Type","application/json");
+		return res;
+	};
+
+	// Gear listed by served shopkeepers, generated ahead of the follow-up click
+	auto shopPrefetch = std::make_shared<ShopPrefetch>(
+		[&](const json& in, uint64_t* id) {
+			LlmResult meta;
+			json out = queryGemini(in, "gear/prefetch", &meta);
+			adjustWeight(out);
+			*id = archive("gear", canonicalParams("gear", in), in, out, meta);
+			return out;
+		},
+		(size_t)envDouble("SHOP_PREFETCH_MAX_SETS", 256),
+		std::chrono::seconds((long)envDouble("SHOP_PREFETCH_TTL_SECONDS", 600)),
+		(int)envDouble("SHOP_PREFETCH_MAX_IN_FLIGHT", 2));
+	shopPrefetch->start();
+
+	// Likely next requests per client session, pre-generated on idle quota
+	SessionPredictor::Config predictCfg;
+	predictCfg.perMinute   = (int)envDouble("PREDICT_PER_MINUTE", 10);
+	predictCfg.maxInFlight = (int)envDouble("PREDICT_MAX_IN_FLIGHT", 2);
+	predictCfg.minProb     = envDouble("PREDICT_MIN_PROBABILITY", 0.3);
+	predictCfg.minCount    = (uint32_t)envDouble("PREDICT_MIN_COUNT", 3);
+	predictCfg.window      = std::chrono::seconds((long)envDouble("PREDICT_WINDOW_SECONDS", 600));
+	predictCfg.sessionTtl  = std::chrono::seconds((long)envDouble("PREDICT_SESSION_TTL_SECONDS", 1800));
+	auto predictor = std::make_shared<SessionPredictor>(predictCfg,
+		[&](const std::string& key) { return cache.needsFill(key); },
+		[&](const std::string& key, const json& in) {
+			bool gear = key.rfind("gear|", 0) == 0;
+			LlmResult meta;
+			json out = gear ? queryGemini(in, "gear/predict", &meta)
+							: queryShopkeeper(in, "shopkeeper/predict", &meta);
+			if (!out.is_object() || out.empty()) throw std::runtime_error("No JSON object in response");
+			if (gear) adjustWeight(out);
+			archive(gear ? "gear" : "shopkeeper", key, in, out, meta);
+			cache.put(key, ResponseCache::makeBody(out));
+		});
+	predictor->start();
+
+	// Popular /api/gear tuples, pre-generated into the cache while upstream is idle
+	HeavyHitters hot((size_t)envDouble("PREGEN_SKETCH_SIZE", 256));
+	PregenStats  pregenStats;
+	Pregenerator pregen(hot, cache, store, pregenStats);
+	pregen.start();
+
+	// Random-route pools: GEAR_POOL_DEPTH / SHOPKEEPER_POOL_DEPTH items each,
+	// refilled by POOL_WORKERS threads per pool
+	int poolWorkers = (int)envDouble("POOL_WORKERS", 2);
+	auto gearPool = std::make_shared<ItemPool>("gear",
+		(size_t)envDouble("GEAR_POOL_DEPTH", 8),
+		[&]{
+			LlmResult meta;
+			json in  = randomGearParams();
+			json out = queryGemini(in, "gear/pool", &meta);
+			adjustWeight(out);
+			archive("gear", canonicalParams("gear", in), in, out, meta);
+			return out;
+		});
+	auto shopkeeperPool = std::make_shared<ItemPool>("shopkeeper",
+		(size_t)envDouble("SHOPKEEPER_POOL_DEPTH", 8),
+		[&]{
+			LlmResult meta;
+			json in  = randomShopkeeperParams();
+			json out = queryShopkeeper(in, "shopkeeper/pool", &meta);
+			if (!out.empty()) archive("shopkeeper", canonicalParams("shopkeeper", in), in, out, meta);
+			return out;
+		});
+
+	// Warm restart from the previous instance's snapshot
+	std::string snapPath = snapshotPath();
+	if (!snapPath.empty()) {
+		if (auto snap = readSnapshot(snapPath)) {
+			try {
+				restoreGlobals(*snap);
+				if (snap->contains("cache"))          cache.restore((*snap)["cache"]);
+				if (snap->contains("pregen"))         hot.restore((*snap)["pregen"]);
+				if (snap->contains("gearPool"))       gearPool->restore((*snap)["gearPool"]);
+				if (snap->contains("shopkeeperPool")) shopkeeperPool->restore((*snap)["shopkeeperPool"]);
+				std::cerr<<"Restored snapshot "<<snapPath<<"\n";
+			} catch(const std::exception& e) {
+				std::cerr<<"Snapshot restore failed: "<<e.what()<<"\n";
+			}
+		}
+	}
+
+	if (shared) {
+		size_t sharedDepth = (size_t)envDouble("REDIS_POOL_DEPTH", 32);
+		gearPool->setShared(shared, sharedDepth);
+		shopkeeperPool->setShared(shared, sharedDepth);
+	}
+	gearPool->start(poolWorkers);
+	shopkeeperPool->start(poolWorkers);
+
+	try { loadBulkJobs(); }
+	catch(const std::exception& e) { std::cerr<<"Bulk job load failed: "<<e.what()<<"\n"; }
+	BulkPoller bulkPoller(store);
+	bulkPoller.start();
+
+	crow::SimpleApp app;
+
+	// Gear builder route
+	CROW_ROUTE(app, "/api/gear").methods("GET"_method)
+	([&](const crow::request& req){
+		json in;
+		try {
+			// Every parameter some item type reads
+			for (auto& key : itemTypes().requestKeys())
+				if (auto v = req.url_params.get(key)) in[key] = v;
+
+			bool useCache = !cacheOptOut(req);
+			std::string key = canonicalParams("gear", in);
+			if (!PeerRing::fromPeer(req))
+				if (auto owner = peers->ownerOf(key))
+					if (auto res = peers->forward(*owner, req)) return std::move(*res);
+			predictor->observe(sessionOf(req), key, useCache ? in : json());
+			if (in.value("name", "").empty() && in.value("description", "").empty()) hot.record(key, in);
+			ResponseCache::BodyPtr body;
+			uint64_t id = 0;
+			bool hit = useCache && cache.get(key, body, req.get_header_value("If-None-Match"));
+			bool led = true;
+			if (!hit) {
+				// Identical requests in flight share one generation
+				json got = withDeadline([&flights, &cache, &archive, &perCandidate, in, key, useCache]{
+					bool first = true;
+					json got = flights.run(key, [&](size_t n) {
+						LlmResult meta;
+						auto items = queryGeminiCandidates(in, "gear", (int)n, &meta);
+						meta = perCandidate(meta, items.size());
+						std::vector<json> outs;
+						for (auto& item : items) {
+							uint64_t itemId = archive("gear", key, in, item, meta);
+							auto body = ResponseCache::makeBody(item);
+							if (useCache) cache.put(key, body);
+							outs.push_back({{"id", itemId}, {"body", body->bytes}});
+						}
+						return outs;
+					}, &first);
+					got["led"] = first;
+					return got;
+				});
+				body = ResponseCache::makeBody(got["body"].get<std::string>());
+				id   = got["id"];
+				led  = got["led"];
+			}
+            crow::response res = bodyResponse(req, *body, useCache);
+            res.set_header("X-Cache", hit ? "HIT" : (led ? "MISS" : "COALESCED"));
+            if (id) res.set_header("X-Item-Id", std::to_string(id));
+            return res;
+        } catch (const UpstreamUnavailable& e) {
+            return fallbackResponse("gear", in, e.reason, e.what());
+        } catch (const std::exception& e) {
+            return fallbackResponse("gear", in, "error", e.what());
+        }
+    });
+
+	// Random‐gear route
+	CROW_ROUTE(app, "/api/gear/random").methods("GET"_method)
+	([&](const crow::request& req){
+		predictor->observe(sessionOf(req), "gear/random", nullptr);
+		if (auto pooled = gearPool->pop()) {
+			crow::response res(pooled->dump());
+			res.set_header("Content-Type","application/json");
+			res.set_header("X-Pool","HIT");
+			return res;
+		}
+
+		json in = randomGearParams();
+
+		try {
+			json got = withDeadline([&archive, in]{
+				LlmResult meta;
+				json out = queryGemini(in, "gear/random", &meta);
+				adjustWeight(out);
+				uint64_t id = archive("gear", canonicalParams("gear", in), in, out, meta);
+				return json{{"id", id}, {"item", out}};
+			});
+			uint64_t id = got["id"];
+			crow::response res(got["item"].dump());
+			if (id) res.set_header("X-Item-Id", std::to_string(id));
+			res.set_header("Content-Type","application/json");
+			res.set_header("X-Pool","MISS");
+			return res;
+		} catch(const UpstreamUnavailable& e) {
+			return fallbackResponse("gear", in, e.reason, e.what());
+		} catch(const std::exception& e) {
+			return fallbackResponse("gear", in, "error", e.what());
+		}
+	});
+
+	// Partial re-roll route: body is {"item": {...}, "field": "Description"},
+	// or {"id": <archived item ID>, "field": ...}
+	CROW_ROUTE(app, "/api/gear/reroll").methods("POST"_method)
+	([&](const crow::request& req){
+		json body = json::parse(req.body, nullptr, false);
+		bool byId = body.is_object() && body.contains("id") && body["id"].is_number_unsigned();
+		if (body.is_discarded() || !(byId || (body.contains("item") && body["item"].is_object()))
+			|| !body.contains("field") || !body["field"].is_string())
+		{
+			json err = {{"error","BadRequest"},{"message","Expected {\"item\": {...} or \"id\": N, \"field\": \"...\"}"}};
+			crow::response res(400, err.dump());
+			res.set_header("Content-Type","application/json");
+			return res;
+		}
+		json item;
+		json params = json::object();
+		if (byId) {
+			auto rec = store.get(body["id"].get<uint64_t>());
+			if (!rec || rec->kind != "gear") {
+				json err = {{"error","NotFound"},{"message","No archived gear item " + body["id"].dump()}};
+				crow::response res(404, err.dump());
+				res.set_header("Content-Type","application/json");
+				return res;
+			}
+			item   = rec->item;
+			params = rec->params;
+		} else {
+			item = body["item"];
+		}
+		std::string field = body["field"];
+		if (field != "Name" && field != "Description" && field != "Properties" && !item.contains(field)) {
+			json err = {{"error","BadRequest"},{"message","Unknown field: " + field}};
+			crow::response res(400, err.dump());
+			res.set_header("Content-Type","application/json");
+			return res;
+		}
+
+		try {
+			LlmResult meta;
+			json out = rerollGearField(item, field, params.value("type", ""), &meta);
+			adjustWeight(out);
+			uint64_t id = archive("gear", canonicalParams("gear/reroll", params), params, out, meta);
+			crow::response res(out.dump());
+			res.set_header("Content-Type","application/json");
+			if (id) res.set_header("X-Item-Id", std::to_string(id));
+			return res;
+		} catch(const std::exception& e) {
+			json err = {{"error","ProcessingFailed"},{"message",e.what()}};
+			crow::response res(500, err.dump());
+			res.set_header("Content-Type","application/json");
+			return res;
+		}
+	});
+
+	// Generates a hoard plan's items HOARD_CONCURRENCY at a time through the
+	// same cache, coalescing, deadline and archive as /api/gear, falling back
+	// to the nearest archived item; onItem(index, {"id", "item"} or {"error"}) is
+	// called from the worker threads as each finishes. Repeated parameters
+	// within one hoard read the cache once so they don't come back identical.
+	int hoardConcurrency = (int)envDouble("HOARD_CONCURRENCY", 8);
+	auto runHoard = [&](const HoardPlan& plan, const std::function<void(size_t, const json&)>& onItem) {
+		std::vector<std::string> keys;
+		std::set<std::string> seen;
+		std::vector<char> readCache;
+		for (auto& in : plan.items) {
+			keys.push_back(canonicalParams("gear", in));
+			readCache.push_back(seen.insert(keys.back()).second);
+		}
+		generateHoard(plan.items, hoardConcurrency, [&](size_t i, const json& in) -> json {
+			const std::string& key = keys[i];
+			ResponseCache::BodyPtr body;
+			if (readCache[i] && cache.get(key, body))
+				return {{"item", json::parse(body->bytes)}, {"cache", "HIT"}};
+			try {
+				json got = withDeadline([&flights, &cache, &archive, &perCandidate, in, key]{
+					return flights.run(key, [&](size_t n) {
+						LlmResult meta;
+						auto items = queryGeminiCandidates(in, "gear/hoard", (int)n, &meta);
+						meta = perCandidate(meta, items.size());
+						std::vector<json> outs;
+						for (auto& item : items) {
+							uint64_t itemId = archive("gear", key, in, item, meta);
+							auto body = ResponseCache::makeBody(item);
+							cache.put(key, body);
+							outs.push_back({{"id", itemId}, {"body", body->bytes}});
+						}
+						return outs;
+					});
+				});
+				return {{"id", got["id"]}, {"item", json::parse(got["body"].get<std::string>())}};
+			} catch (const std::exception&) {
+				if (auto near = store.nearest("gear", in, fallbackMinScore))
+					return {{"id", near->first.id}, {"item", near->first.item}, {"fallback", "nearest-match"}};
+				throw;
+			}
+		}, onItem);
+	};
+
+	// Hoard request from the query string or a websocket message
+	auto hoardRequest = [](const crow::query_string& params) {
+		json req = json::object();
+		if (auto v = params.get("cr"))     req["cr"]     = std::stoi(v);
+		if (auto v = params.get("budget")) req["budget"] = std::stod(v);
+		if (auto v = params.get("count"))  req["count"]  = std::stoi(v);
+		return req;
+	};
+
+	// Loot hoard: coins plus every item, returned once all are generated
+	CROW_ROUTE(app, "/api/hoard").methods("GET"_method)
+	([&](const crow::request& req){
+		HoardPlan plan;
+		try {
+			plan = planHoard(hoardRequest(req.url_params));
+		} catch (const std::exception& e) {
+			json err = {{"error","BadRequest"},{"message",e.what()}};
+			crow::response res(400, err.dump());
+			res.set_header("Content-Type","application/json");
+			return res;
+		}
+		json items = json::array();
+		for (size_t i = 0; i < plan.items.size(); ++i) items.push_back(nullptr);
+		std::mutex m;
+		runHoard(plan, [&](size_t i, const json& result) {
+			std::lock_guard<std::mutex> lk(m);
+			items[i] = result;
+		});
+		crow::response res(json{{"coins", plan.coins}, {"items", items}}.dump());
+		res.set_header("Content-Type","application/json");
+		res.set_header("Cache-Control","no-store");
+		return res;
+	});
+
+	// Streamed loot hoard: each {"cr": N} or {"budget": gp} message (plus an
+	// optional "count") is answered with {"type": "plan"}, one {"type": "item"}
+	// per item in completion order, and {"type": "done"}
+	struct HoardSocket {
+		std::mutex m;
+		bool       open = true;
+	};
+	// Stream workers still running; shutdown waits for them before the snapshot
+	struct HoardWorkers {
+		std::mutex              m;
+		std::condition_variable cv;
+		size_t                  running  = 0;
+		bool                    stopping = false;
+	};
+	auto hoardWorkers = std::make_shared<HoardWorkers>();
+	CROW_WEBSOCKET_ROUTE(app, "/api/hoard/stream")
+	.onopen([&](crow::websocket::connection& conn) {
+		conn.userdata(new std::shared_ptr<HoardSocket>(std::make_shared<HoardSocket>()));
+	})
+	.onclose([&](crow::websocket::connection& conn, const std::string&, auto&&...) {
+		auto* sock = static_cast<std::shared_ptr<HoardSocket>*>(conn.userdata());
+		if (!sock) return;
+		{
+			std::lock_guard<std::mutex> lk((*sock)->m);
+			(*sock)->open = false;
+		}
+		conn.userdata(nullptr);
+		delete sock;
+	})
+	.onmessage([&](crow::websocket::connection& conn, const std::string& data, bool) {
+		auto* held = static_cast<std::shared_ptr<HoardSocket>*>(conn.userdata());
+		if (!held) return;
+		auto sock = *held;
+		auto send = [sock, &conn](const json& msg) {
+			std::lock_guard<std::mutex> lk(sock->m);
+			if (sock->open) conn.send_text(msg.dump());
+		};
+
+		auto plan = std::make_shared<HoardPlan>();
+		try {
+			*plan = planHoard(json::parse(data));
+		} catch (const std::exception& e) {
+			send({{"type", "error"}, {"message", e.what()}});
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lk(hoardWorkers->m);
+			if (hoardWorkers->stopping) {
+				send({{"type", "error"}, {"message", "Server is shutting down"}});
+				return;
+			}
+			hoardWorkers->running++;
+		}
+		send({{"type", "plan"}, {"coins", plan->coins}, {"items", plan->items}});
+		std::thread([&runHoard, plan, send, workers = hoardWorkers]{
+			std::atomic<size_t> failed{0};
+			runHoard(*plan, [&](size_t i, const json& result) {
+				if (result.contains("error")) failed++;
+				json msg = result;
+				msg["type"]  = "item";
+				msg["index"] = i;
+				send(msg);
+			});
+			send({{"type", "done"}, {"count", plan->items.size()}, {"failed", failed.load()}});
+			std::lock_guard<std::mutex> lk(workers->m);
+			workers->running--;
+			workers->cv.notify_all();
+		}).detach();
+	});
+
+	// Archived item by ID
+	CROW_ROUTE(app, "/api/items/<uint>").methods("GET"_method)
+	([&](uint64_t id){
+		auto rec = store.get(id);
+		if (!rec) {
+			json err = {{"error","NotFound"},{"message","No archived item " + std::to_string(id)}};
+			crow::response res(404, err.dump());
+			res.set_header("Content-Type","application/json");
+			return res;
+		}
+		crow::response res(ItemStore::toJson(*rec).dump());
+		res.set_header("Content-Type","application/json");
+		return res;
+	});
+
+	CROW_ROUTE(app, "/api/shopkeeper").methods("GET"_method)
+    ([&](const crow::request& req){
+		json in;
+		try {
+            auto& params = req.url_params;
+            if (auto v = params.get("name"))           in["name"]           = v;
+            if (auto v = params.get("race"))           in["race"]           = v;
+            if (auto v = params.get("settlementSize")) in["settlementSize"] = v;
+            if (auto v = params.get("shopType"))       in["shopType"]       = v;
+            if (auto v = params.get("description"))    in["description"]    = v;
+
+            bool useCache = !cacheOptOut(req);
+            std::string key = canonicalParams("shopkeeper", in);
+            if (!PeerRing::fromPeer(req))
+                if (auto owner = peers->ownerOf(key))
+                    if (auto res = peers->forward(*owner, req)) return std::move(*res);
+            predictor->observe(sessionOf(req), key, useCache ? in : json());
+            ResponseCache::BodyPtr body;
+            uint64_t id = 0;
+            bool hit = useCache && cache.get(key, body, req.get_header_value("If-None-Match"));
+            bool led = true;
+            if (!hit) {
+                // Identical requests in flight share one generation
+                json got = withDeadline([&flights, &cache, &archive, &perCandidate, in, key, useCache]{
+                    bool first = true;
+                    json got = flights.run(key, [&](size_t n) {
+                        LlmResult meta;
+                        auto items = queryShopkeeperCandidates(in, "shopkeeper", (int)n, &meta);
+                        meta = perCandidate(meta, items.size());
+                        std::vector<json> outs;
+                        for (auto& item : items) {
+                            uint64_t itemId = archive("shopkeeper", key, in, item, meta);
+                            auto body = ResponseCache::makeBody(item);
+                            if (useCache) cache.put(key, body);
+                            outs.push_back({{"id", itemId}, {"body", body->bytes}});
+                        }
+                        if (outs.empty()) outs.push_back({{"id", 0}, {"body", "{}"}});
+                        return outs;
+                    }, &first);
+                    got["led"] = first;
+                    return got;
+                });
+                body = ResponseCache::makeBody(got["body"].get<std::string>());
+                id   = got["id"];
+                led  = got["led"];
+            }
+            crow::response res = bodyResponse(req, *body, useCache);
+            res.set_header("X-Cache", hit ? "HIT" : (led ? "MISS" : "COALESCED"));
+            if (id) res.set_header("X-Item-Id", std::to_string(id));
+            std::string rid = responseId(body->bytes);
+            res.set_header("X-Response-Id", rid);
+            shopPrefetch->offer(rid, body->bytes);
+            return res;
+        } catch (const UpstreamUnavailable& e) {
+            return fallbackResponse("shopkeeper", in, e.reason, e.what());
+        } catch (const std::exception& e) {
+            return fallbackResponse("shopkeeper", in, "error", e.what());
+        }
+    });
+
+	CROW_ROUTE(app, "/api/shopkeeper/random").methods("GET"_method)
+    ([&](const crow::request& req){
+        predictor->observe(sessionOf(req), "shopkeeper/random", nullptr);
+        if (auto pooled = shopkeeperPool->pop()) {
+            std::string bytes = pooled->dump();
+            std::string rid   = responseId(bytes);
+            shopPrefetch->offer(rid, bytes);
+            crow::response res(std::move(bytes));
+            res.set_header("Content-Type","application/json");
+            res.set_header("X-Pool","HIT");
+            res.set_header("X-Response-Id", rid);
+            return res;
+        }
+
+        json in = randomShopkeeperParams();
+
+        try {
+            json got = withDeadline([&archive, in]{
+                LlmResult meta;
+                json out = queryShopkeeper(in, "shopkeeper/random", &meta);
+                uint64_t id = out.empty() ? 0 : archive("shopkeeper", canonicalParams("shopkeeper", in), in, out, meta);
+                return json{{"id", id}, {"item", out}};
+            });
+            uint64_t id = got["id"];
+            std::string bytes = got["item"].dump();
+            std::string rid   = responseId(bytes);
+            shopPrefetch->offer(rid, bytes);
+            crow::response res(std::move(bytes));
+            if (id) res.set_header("X-Item-Id", std::to_string(id));
+            res.set_header("Content-Type","application/json");
+            res.set_header("X-Pool","MISS");
+            res.set_header("X-Response-Id", rid);
+            return res;
+        } catch (const UpstreamUnavailable& e) {
+            return fallbackResponse("shopkeeper", in, e.reason, e.what());
+        } catch (const std::exception& e) {
+            return fallbackResponse("shopkeeper", in, "error", e.what());
+        }
+    });
+
+	// Full details for entry <index> of a served shopkeeper's ItemsList,
+	// by the shopkeeper's X-Response-Id
+	CROW_ROUTE(app, "/api/shopkeeper/<string>/items/<uint>").methods("GET"_method)
+	([&](const std::string& rid, uint64_t index){
+		try {
+			json item;
+			uint64_t id = 0;
+			auto found = shopPrefetch->get(rid, (size_t)index, item, id);
+			if (found == ShopPrefetch::Lookup::UNKNOWN || found == ShopPrefetch::Lookup::NOT_GEAR) {
+				bool unknown = found == ShopPrefetch::Lookup::UNKNOWN;
+				json err = {{"error", unknown ? "NotFound" : "NotGear"},
+							{"message", unknown ? "No recent shopkeeper item " + rid + "/" + std::to_string(index)
+												: "Listed item is not weapon, armor or jewelry"}};
+				crow::response res(unknown ? 404 : 422, err.dump());
+				res.set_header("Content-Type","application/json");
+				return res;
+			}
+			crow::response res(item.dump());
+			res.set_header("Content-Type","application/json");
+			res.set_header("X-Prefetch", found == ShopPrefetch::Lookup::READY  ? "HIT"
+									   : found == ShopPrefetch::Lookup::WAITED ? "WAIT" : "MISS");
+			if (id) res.set_header("X-Item-Id", std::to_string(id));
+			return res;
+		} catch (const std::exception& e) {
+			json err = {{"error","ProcessingFailed"},{"message",e.what()}};
+			crow::response res(500, err.dump());
+			res.set_header("Content-Type","application/json");
+			return res;
+		}
+	});
+
+	// Bulk generation: {"kind": "gear"|"shopkeeper", "count": N} for random
+	// parameters, or {"kind": ..., "items": [{...}, ...]}; optional "provider"/"model"
+	CROW_ROUTE(app, "/api/bulk").methods("POST"_method)
+	([&](const crow::request& req){
+		json body = json::parse(req.body, nullptr, false);
+		std::string kind = body.is_object() ? body.value("kind", "gear") : "";
+		if (kind != "gear" && kind != "shopkeeper") {
+			json err = {{"error","BadRequest"},{"message","Expected {\"kind\": \"gear\"|\"shopkeeper\", \"count\": N} or \"items\""}};
+			crow::response res(400, err.dump());
+			res.set_header("Content-Type","application/json");
+			return res;
+		}
+
+		std::vector<json> params;
+		if (body.contains("items") && body["items"].is_array()) {
+			for (auto& it : body["items"]) params.push_back(it);
+		} else {
+			int count = std::min(body.value("count", 0), 50000);
+			for (int i = 0; i < count; ++i)
+				params.push_back(kind == "gear" ? randomGearParams() : randomShopkeeperParams());
+		}
+		if (params.empty()) {
+			json err = {{"error","BadRequest"},{"message","Nothing to generate"}};
+			crow::response res(400, err.dump());
+			res.set_header("Content-Type","application/json");
+			return res;
+		}
+
+		try {
+			ModelChoice choice = routeModel("", "", kind);
+			if (choice.provider == "procedural" && choice.fallback) choice = *choice.fallback;   // batch APIs only
+			if (body.contains("provider")) choice = {body["provider"], body.value("model", choice.model), nullptr};
+			BulkJob job = submitBulkJob(kind, std::move(params), choice);
+			crow::response res(202, bulkJobJson(job, false).dump());
+			res.set_header("Content-Type","application/json");
+			return res;
+		} catch(const std::exception& e) {
+			json err = {{"error","ProcessingFailed"},{"message",e.what()}};
+			crow::response res(500, err.dump());
+			res.set_header("Content-Type","application/json");
+			return res;
+		}
+	});
+
+	CROW_ROUTE(app, "/api/bulk").methods("GET"_method)
+	([&](){
+		json all = json::array();
+		{
+			std::lock_guard<std::mutex> lk(bulk_mutex);
+			for (auto& [id, j] : bulk_jobs) all.push_back(bulkJobJson(j, false));
+		}
+		crow::response res(all.dump());
+		res.set_header("Content-Type","application/json");
+		return res;
+	});
+
+	CROW_ROUTE(app, "/api/bulk/<string>").methods("GET"_method)
+	([&](const std::string& id){
+		std::lock_guard<std::mutex> lk(bulk_mutex);
+		auto it = bulk_jobs.find(id);
+		if (it == bulk_jobs.end()) {
+			json err = {{"error","NotFound"},{"message","No bulk job " + id}};
+			crow::response res(404, err.dump());
+			res.set_header("Content-Type","application/json");
+			return res;
+		}
+		crow::response res(bulkJobJson(it->second, false).dump());
+		res.set_header("Content-Type","application/json");
+		return res;
+	});
+
+	// Re-read the routing table without a restart
+	CROW_ROUTE(app, "/api/admin/routing/reload").methods("POST"_method)
+	([&](){
+		reloadRoutingTable(true);
+		crow::response res(json{{"status","reloaded"},{"path",routingTablePath()}}.dump());
+		res.set_header("Content-Type","application/json");
+		return res;
+	});
+
+	// Response cache and item store statistics
+	CROW_ROUTE(app, "/api/stats/cache").methods("GET"_method)
+	([&](){
+		json out = cache.stats();
+		out["store"]      = store.stats();
+		out["coalescing"] = flights.stats();
+		out["peers"]      = peers->stats();
+		crow::response res(out.dump());
+		res.set_header("Content-Type","application/json");
+		return res;
+	});
+
+	// Popular gear tuples and pre-generation counters
+	CROW_ROUTE(app, "/api/stats/pregen").methods("GET"_method)
+	([&](){
+		json top = json::array();
+		for (auto& c : hot.top(32)) {
+			top.push_back({{"params", c.params}, {"count", c.count}, {"error", c.error}});
+		}
+		json out = {
+			{"generated",   pregenStats.generated.load()},
+			{"errors",      pregenStats.errors.load()},
+			{"skippedBusy", pregenStats.skippedBusy.load()},
+			{"top",         top},
+			{"shopPrefetch", shopPrefetch->stats()},
+			{"predictive",   predictor->stats()}
+		};
+		crow::response res(out.dump());
+		res.set_header("Content-Type","application/json");
+		return res;
+	});
+
+	// Random-route pool statistics
+	CROW_ROUTE(app, "/api/stats/pool").methods("GET"_method)
+	([&](){
+		json out = {{"gear", gearPool->stats()}, {"shopkeeper", shopkeeperPool->stats()}};
+		crow::response res(out.dump());
+		res.set_header("Content-Type","application/json");
+		return res;
+	});
+
+	// Provider race statistics
+	CROW_ROUTE(app, "/api/stats/race").methods("GET"_method)
+	([&](){
+		crow::response res(raceStats().dump());
+		res.set_header("Content-Type","application/json");
+		return res;
+	});
+
+	app.port(5000).multithreaded().run();
+
+	// Graceful shutdown: finish streamed hoards, stop and join every background
+	// worker that uses the cache or the store, then snapshot for the next
+	// instance
+	{
+		std::unique_lock<std::mutex> lk(hoardWorkers->m);
+		hoardWorkers->stopping = true;
+		hoardWorkers->cv.wait(lk, [&]{ return hoardWorkers->running == 0; });
+	}
+	gearPool->stop();
+	shopkeeperPool->stop();
+	shopPrefetch->stop();
+	predictor->stop();
+	pregen.stop();
+	bulkPoller.stop();
+	if (!snapPath.empty()) {
+		try {
+			json snap = snapshotGlobals();
+			snap["cache"]          = cache.snapshot();
+			snap["pregen"]         = hot.snapshot();
+			snap["gearPool"]       = gearPool->snapshot();
+			snap["shopkeeperPool"] = shopkeeperPool->snapshot();
+			writeSnapshot(snapPath, snap);
+		} catch(const std::exception& e) {
+			std::cerr<<"Snapshot write failed: "<<e.what()<<"\n";
+		}
+	}
 	return 0;
 }
\ No newline at end of file